@@ -0,0 +1,203 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+#include "errors.h"
+
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Per host copy of the serverinfo and applist responses, one "key value" per line:
+//   appversion 7.1.431.-1
+//   mode 1920 1080 60
+//   app 1 Steam
+// Lists are stored and restored in the order they're held in memory, the reverse
+// of the response as the extractors prepend every item.
+
+static void cache_path(char* path, size_t size, const char* keyDirectory, const char* address) {
+  snprintf(path, size, "%s/%s/%s", keyDirectory, CACHE_DIRECTORY_NAME, address);
+}
+
+static void* append(void** tail, size_t size) {
+  void* item = calloc(1, size);
+  if (item != NULL)
+    *tail = item;
+
+  return item;
+}
+
+int cache_load(const char* keyDirectory, PSERVER_DATA server, PAPP_LIST *app_list) {
+  char path[PATH_MAX];
+  cache_path(path, sizeof(path), keyDirectory, server->serverInfo.address);
+
+  FILE* fd = fopen(path, "r");
+  if (fd == NULL)
+    return GS_FAILED;
+
+  char* appVersion = NULL;
+  char* gfeVersion = NULL;
+  char* gpuType = NULL;
+  char* gsVersion = NULL;
+  bool paired = false, supports4K = false;
+  PDISPLAY_MODE modes = NULL, *modeTail = &modes;
+  PAPP_LIST apps = NULL, *appTail = &apps;
+
+  int ret = GS_OK;
+  char* line = NULL;
+  size_t len = 0;
+  while (ret == GS_OK && getline(&line, &len, fd) != -1) {
+    line[strcspn(line, "\n")] = 0;
+    char* value = strchr(line, ' ');
+    if (value == NULL)
+      continue;
+
+    *value++ = 0;
+    if (strcmp(line, "appversion") == 0) {
+      free(appVersion);
+      appVersion = strdup(value);
+    } else if (strcmp(line, "gfeversion") == 0) {
+      free(gfeVersion);
+      gfeVersion = strdup(value);
+    } else if (strcmp(line, "gputype") == 0) {
+      free(gpuType);
+      gpuType = strdup(value);
+    } else if (strcmp(line, "gsversion") == 0) {
+      free(gsVersion);
+      gsVersion = strdup(value);
+    } else if (strcmp(line, "paired") == 0)
+      paired = atoi(value) == 1;
+    else if (strcmp(line, "4k") == 0)
+      supports4K = atoi(value) == 1;
+    else if (strcmp(line, "mode") == 0) {
+      PDISPLAY_MODE mode = append((void**) modeTail, sizeof(DISPLAY_MODE));
+      if (mode == NULL)
+        ret = GS_OUT_OF_MEMORY;
+      else if (sscanf(value, "%u %u %u", &mode->width, &mode->height, &mode->refresh) != 3)
+        ret = GS_INVALID;
+      else
+        modeTail = &mode->next;
+    } else if (strcmp(line, "app") == 0) {
+      PAPP_LIST app = append((void**) appTail, sizeof(APP_LIST));
+      char* name = strchr(value, ' ');
+      if (app == NULL)
+        ret = GS_OUT_OF_MEMORY;
+      else if (name == NULL)
+        ret = GS_INVALID;
+      else if ((app->name = strdup(name + 1)) == NULL)
+        ret = GS_OUT_OF_MEMORY;
+      else {
+        app->id = atoi(value);
+        appTail = &app->next;
+      }
+    }
+  }
+  free(line);
+  fclose(fd);
+
+  // Only a complete entry of a paired server can be launched from
+  if (ret == GS_OK && (appVersion == NULL || apps == NULL || !paired))
+    ret = GS_INVALID;
+
+  // Like a fresh serverinfo, an unsupported version is only used when asked for, the live check reports it
+  if (ret == GS_OK && !server->unsupported && (atoi(appVersion) > MAX_SUPPORTED_GFE_VERSION || atoi(appVersion) < MIN_SUPPORTED_GFE_VERSION))
+    ret = GS_UNSUPPORTED_VERSION;
+
+  if (ret != GS_OK) {
+    free(appVersion);
+    free(gfeVersion);
+    free(gpuType);
+    free(gsVersion);
+    while (modes != NULL) {
+      PDISPLAY_MODE next = modes->next;
+      free(modes);
+      modes = next;
+    }
+    while (apps != NULL) {
+      PAPP_LIST next = apps->next;
+      free(apps->name);
+      free(apps);
+      apps = next;
+    }
+    return ret;
+  }
+
+  // The running game is never cached, a launch while one is active fails and refreshes it
+  server->paired = paired;
+  server->supports4K = supports4K;
+  server->currentGame = 0;
+  server->serverMajorVersion = atoi(appVersion);
+  server->serverInfo.serverInfoAppVersion = appVersion;
+  server->serverInfo.serverInfoGfeVersion = gfeVersion;
+  server->gpuType = gpuType;
+  server->gsVersion = gsVersion;
+  server->modes = modes;
+  *app_list = apps;
+  return GS_OK;
+}
+
+int cache_save(const char* keyDirectory, PSERVER_DATA server, PAPP_LIST app_list) {
+  char path[PATH_MAX];
+  char temp[PATH_MAX + 16];
+
+  snprintf(path, sizeof(path), "%s/%s", keyDirectory, CACHE_DIRECTORY_NAME);
+  mkdir(path, 0775);
+
+  cache_path(path, sizeof(path), keyDirectory, server->serverInfo.address);
+  snprintf(temp, sizeof(temp), "%s.%d", path, getpid());
+
+  FILE* fd = fopen(temp, "w");
+  if (fd == NULL)
+    return GS_FAILED;
+
+  fprintf(fd, "appversion %s\n", server->serverInfo.serverInfoAppVersion);
+  if (server->serverInfo.serverInfoGfeVersion != NULL)
+    fprintf(fd, "gfeversion %s\n", server->serverInfo.serverInfoGfeVersion);
+  if (server->gpuType != NULL)
+    fprintf(fd, "gputype %s\n", server->gpuType);
+  if (server->gsVersion != NULL)
+    fprintf(fd, "gsversion %s\n", server->gsVersion);
+  fprintf(fd, "paired %d\n", server->paired);
+  fprintf(fd, "4k %d\n", server->supports4K);
+
+  for (PDISPLAY_MODE mode = server->modes; mode != NULL; mode = mode->next)
+    fprintf(fd, "mode %u %u %u\n", mode->width, mode->height, mode->refresh);
+
+  for (PAPP_LIST app = app_list; app != NULL; app = app->next) {
+    if (app->name != NULL && strchr(app->name, '\n') == NULL)
+      fprintf(fd, "app %d %s\n", app->id, app->name);
+  }
+
+  // Replace the old entry at once so a concurrent launch never reads half of it
+  if (fclose(fd) != 0 || rename(temp, path) != 0) {
+    unlink(temp);
+    return GS_FAILED;
+  }
+
+  return GS_OK;
+}
+
+void cache_remove(const char* keyDirectory, const char* address) {
+  char path[PATH_MAX];
+  cache_path(path, sizeof(path), keyDirectory, address);
+  unlink(path);
+}
@@ -0,0 +1,28 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "client.h"
+
+#define CACHE_DIRECTORY_NAME "servers"
+
+int cache_load(const char* keyDirectory, PSERVER_DATA server, PAPP_LIST *app_list);
+int cache_save(const char* keyDirectory, PSERVER_DATA server, PAPP_LIST app_list);
+void cache_remove(const char* keyDirectory, const char* address);
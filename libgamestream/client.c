@@ -18,6 +18,7 @@
  */
 
 #include "http.h"
+#include "cache.h"
 #include "xml.h"
 #include "mkcert.h"
 #include "client.h"
@@ -45,10 +46,16 @@
 #define UNIQUEID_BYTES 8
 #define UNIQUEID_CHARS (UNIQUEID_BYTES*2)
 
+// Smaller downloads mostly measure the round trip and the TCP window
+#define BANDWIDTH_MIN_BYTES (128 * 1024)
+// Shorter transfers are timed as this long, which gives a lower bound of the rate
+#define BANDWIDTH_MIN_MS 5
+
 static char unique_id[UNIQUEID_CHARS+1];
 static X509 *cert;
 static char cert_hex[4096];
 static EVP_PKEY *privateKey;
+static char key_directory[PATH_MAX];
 
 const char* gs_error;
 
@@ -158,6 +165,39 @@ static int load_cert(const char* keyDirectory) {
   return GS_OK;
 }
 
+// Text of the serverinfo response, moved into SERVER_DATA once it is validated
+struct serverinfo_response {
+  char* currentGame;
+  char* pairStatus;
+  char* appVersion;
+  char* state;
+  char* codecModeSupport;
+  char* gpuType;
+  char* gsVersion;
+  char* gfeVersion;
+  PDISPLAY_MODE modes;
+};
+
+static const XML_FIELD mode_fields[] = {
+  {"Width", XML_INT, offsetof(DISPLAY_MODE, width)},
+  {"Height", XML_INT, offsetof(DISPLAY_MODE, height)},
+  {"RefreshRate", XML_INT, offsetof(DISPLAY_MODE, refresh)},
+  {NULL}
+};
+
+static const XML_FIELD serverinfo_fields[] = {
+  {"currentgame", XML_STRING, offsetof(struct serverinfo_response, currentGame)},
+  {"PairStatus", XML_STRING, offsetof(struct serverinfo_response, pairStatus)},
+  {"appversion", XML_STRING, offsetof(struct serverinfo_response, appVersion)},
+  {"state", XML_STRING, offsetof(struct serverinfo_response, state)},
+  {"ServerCodecModeSupport", XML_STRING, offsetof(struct serverinfo_response, codecModeSupport)},
+  {"gputype", XML_STRING, offsetof(struct serverinfo_response, gpuType)},
+  {"GsVersion", XML_STRING, offsetof(struct serverinfo_response, gsVersion)},
+  {"GfeVersion", XML_STRING, offsetof(struct serverinfo_response, gfeVersion)},
+  {"DisplayMode", XML_LIST, offsetof(struct serverinfo_response, modes), mode_fields, sizeof(DISPLAY_MODE), offsetof(DISPLAY_MODE, next)},
+  {NULL}
+};
+
 static int load_server_status(PSERVER_DATA server) {
 
   uuid_t uuid;
@@ -169,10 +209,7 @@ static int load_server_status(PSERVER_DATA server) {
 
   i = 0;
   do {
-    char *pairedText = NULL;
-    char *currentGameText = NULL;
-    char *stateText = NULL;
-    char *serverCodecModeSupportText = NULL;
+    struct serverinfo_response info = {0};
 
     ret = GS_INVALID;
 
@@ -196,68 +233,46 @@ static int load_server_status(PSERVER_DATA server) {
       goto cleanup;
     }
 
-    if (xml_status(data->memory, data->size) == GS_ERROR) {
+    int status = xml_extract(data->memory, data->size, serverinfo_fields, &info);
+    if (status == GS_ERROR) {
       ret = GS_ERROR;
       goto cleanup;
-    }
-
-    if (xml_search(data->memory, data->size, "currentgame", &currentGameText) != GS_OK) {
-      goto cleanup;
-    }
-
-    if (xml_search(data->memory, data->size, "PairStatus", &pairedText) != GS_OK)
-      goto cleanup;
-
-    if (xml_search(data->memory, data->size, "appversion", (char**) &server->serverInfo.serverInfoAppVersion) != GS_OK)
-      goto cleanup;
-
-    if (xml_search(data->memory, data->size, "state", &stateText) != GS_OK)
-      goto cleanup;
-
-    if (xml_search(data->memory, data->size, "ServerCodecModeSupport", &serverCodecModeSupportText) != GS_OK)
-      goto cleanup;
-
-    if (xml_search(data->memory, data->size, "gputype", &server->gpuType) != GS_OK)
-      goto cleanup;
-
-    if (xml_search(data->memory, data->size, "GsVersion", &server->gsVersion) != GS_OK)
-      goto cleanup;
-
-    if (xml_search(data->memory, data->size, "GfeVersion", (char**) &server->serverInfo.serverInfoGfeVersion) != GS_OK)
-      goto cleanup;
-
-    if (xml_modelist(data->memory, data->size, &server->modes) != GS_OK)
+    } else if (status != GS_OK)
       goto cleanup;
 
     // These fields are present on all version of GFE that this client supports
-    if (!strlen(currentGameText) || !strlen(pairedText) || !strlen(server->serverInfo.serverInfoAppVersion) || !strlen(stateText))
+    if (info.currentGame == NULL || info.pairStatus == NULL || info.appVersion == NULL || info.state == NULL)
+      goto cleanup;
+    else if (!strlen(info.currentGame) || !strlen(info.pairStatus) || !strlen(info.appVersion) || !strlen(info.state))
       goto cleanup;
 
-    server->paired = pairedText != NULL && strcmp(pairedText, "1") == 0;
-    server->currentGame = currentGameText == NULL ? 0 : atoi(currentGameText);
-    server->supports4K = serverCodecModeSupportText != NULL;
-    server->serverMajorVersion = atoi(server->serverInfo.serverInfoAppVersion);
+    server->paired = strcmp(info.pairStatus, "1") == 0;
+    server->currentGame = atoi(info.currentGame);
+    server->supports4K = info.codecModeSupport != NULL;
+    server->serverMajorVersion = atoi(info.appVersion);
 
-    if (strstr(stateText, "_SERVER_BUSY") == NULL) {
+    if (strstr(info.state, "_SERVER_BUSY") == NULL) {
       // After GFE 2.8, current game remains set even after streaming
       // has ended. We emulate the old behavior by forcing it to zero
       // if streaming is not active.
       server->currentGame = 0;
     }
+
+    // Hand the kept strings and modes over to the server data
+    server->serverInfo.serverInfoAppVersion = info.appVersion;
+    server->serverInfo.serverInfoGfeVersion = info.gfeVersion;
+    server->gpuType = info.gpuType;
+    server->gsVersion = info.gsVersion;
+    server->modes = info.modes;
+    info.appVersion = info.gfeVersion = info.gpuType = info.gsVersion = NULL;
+    info.modes = NULL;
     ret = GS_OK;
 
     cleanup:
     if (data != NULL)
       http_free_data(data);
 
-    if (pairedText != NULL)
-      free(pairedText);
-
-    if (currentGameText != NULL)
-      free(currentGameText);
-
-    if (serverCodecModeSupportText != NULL)
-      free(serverCodecModeSupportText);
+    xml_free_fields(serverinfo_fields, &info);
 
     i++;
   } while (ret != GS_OK && i < 2);
@@ -370,14 +385,48 @@ int gs_unpair(PSERVER_DATA server) {
   uuid_unparse(uuid, uuid_str);
   snprintf(url, sizeof(url), "http://%s:47989/unpair?uniqueid=%s&uuid=%s", server->serverInfo.address, unique_id, uuid_str);
   ret = http_request(url, data);
+  cache_remove(key_directory, server->serverInfo.address);
+  http_forget_session();
 
   http_free_data(data);
   return ret;
 }
 
+// Every step of the pairing handshake answers with paired and at most one of the other fields
+struct pair_response {
+  char* paired;
+  char* plaincert;
+  char* challengeResponse;
+  char* pairingSecret;
+};
+
+static const XML_FIELD pair_fields[] = {
+  {"paired", XML_STRING, offsetof(struct pair_response, paired)},
+  {"plaincert", XML_STRING, offsetof(struct pair_response, plaincert)},
+  {"challengeresponse", XML_STRING, offsetof(struct pair_response, challengeResponse)},
+  {"pairingsecret", XML_STRING, offsetof(struct pair_response, pairingSecret)},
+  {NULL}
+};
+
+static int pair_request(char* url, PHTTP_DATA data, struct pair_response* response) {
+  int ret;
+  xml_free_fields(pair_fields, response);
+  if ((ret = http_request(url, data)) != GS_OK)
+    return ret;
+  else if ((ret = xml_extract(data->memory, data->size, pair_fields, response)) != GS_OK)
+    return ret;
+
+  if (response->paired == NULL || strcmp(response->paired, "1") != 0) {
+    gs_error = "Pairing failed";
+    return GS_FAILED;
+  }
+
+  return GS_OK;
+}
+
 int gs_pair(PSERVER_DATA server, char* pin) {
   int ret = GS_OK;
-  char* result = NULL;
+  struct pair_response response = {0};
   char url[4096];
   uuid_t uuid;
   char uuid_str[37];
@@ -392,6 +441,9 @@ int gs_pair(PSERVER_DATA server, char* pin) {
     return GS_WRONG_STATE;
   }
 
+  // Sessions from before may not be resumed with the certificates of the new pairing
+  http_forget_session();
+
   unsigned char salt_data[16];
   char salt_hex[33];
   RAND_bytes(salt_data, 16);
@@ -403,26 +455,14 @@ int gs_pair(PSERVER_DATA server, char* pin) {
   PHTTP_DATA data = http_create_data();
   if (data == NULL)
     return GS_OUT_OF_MEMORY;
-  else if ((ret = http_request(url, data)) != GS_OK)
-    goto cleanup;
-
-  if ((ret = xml_status(data->memory, data->size) != GS_OK))
+  else if ((ret = pair_request(url, data, &response)) != GS_OK)
     goto cleanup;
-  else if ((ret = xml_search(data->memory, data->size, "paired", &result)) != GS_OK)
-    goto cleanup;
-
-  if (strcmp(result, "1") != 0) {
-    gs_error = "Pairing failed";
-    ret = GS_FAILED;
-    goto cleanup;
-  }
 
-  free(result);
-  result = NULL;
-  if ((ret = xml_search(data->memory, data->size, "plaincert", &result)) != GS_OK)
+  char* result = response.plaincert;
+  if (result == NULL) {
+    ret = GS_INVALID;
     goto cleanup;
-
-  if (strlen(result)/2 > 8191) {
+  } else if (strlen(result)/2 > 8191) {
     gs_error = "Server certificate too big";
     ret = GS_FAILED;
     goto cleanup;
@@ -459,25 +499,11 @@ int gs_pair(PSERVER_DATA server, char* pin) {
   uuid_generate_random(uuid);
   uuid_unparse(uuid, uuid_str);
   snprintf(url, sizeof(url), "http://%s:47989/pair?uniqueid=%s&uuid=%s&devicename=roth&updateState=1&clientchallenge=%s", server->serverInfo.address, unique_id, uuid_str, challenge_hex);
-  if ((ret = http_request(url, data)) != GS_OK)
+  if ((ret = pair_request(url, data, &response)) != GS_OK)
     goto cleanup;
 
-  free(result);
-  result = NULL;
-  if ((ret = xml_status(data->memory, data->size) != GS_OK))
-    goto cleanup;
-  else if ((ret = xml_search(data->memory, data->size, "paired", &result)) != GS_OK)
-    goto cleanup;
-
-  if (strcmp(result, "1") != 0) {
-    gs_error = "Pairing failed";
-    ret = GS_FAILED;
-    goto cleanup;
-  }
-
-  free(result);
-  result = NULL;
-  if (xml_search(data->memory, data->size, "challengeresponse", &result) != GS_OK) {
+  result = response.challengeResponse;
+  if (result == NULL) {
     ret = GS_INVALID;
     goto cleanup;
   }
@@ -518,25 +544,11 @@ int gs_pair(PSERVER_DATA server, char* pin) {
   uuid_generate_random(uuid);
   uuid_unparse(uuid, uuid_str);
   snprintf(url, sizeof(url), "http://%s:47989/pair?uniqueid=%s&uuid=%s&devicename=roth&updateState=1&serverchallengeresp=%s", server->serverInfo.address, unique_id, uuid_str, challenge_response_hex);
-  if ((ret = http_request(url, data)) != GS_OK)
+  if ((ret = pair_request(url, data, &response)) != GS_OK)
     goto cleanup;
 
-  free(result);
-  result = NULL;
-  if ((ret = xml_status(data->memory, data->size) != GS_OK))
-    goto cleanup;
-  else if ((ret = xml_search(data->memory, data->size, "paired", &result)) != GS_OK)
-    goto cleanup;
-
-  if (strcmp(result, "1") != 0) {
-    gs_error = "Pairing failed";
-    ret = GS_FAILED;
-    goto cleanup;
-  }
-
-  free(result);
-  result = NULL;
-  if (xml_search(data->memory, data->size, "pairingsecret", &result) != GS_OK) {
+  result = response.pairingSecret;
+  if (result == NULL) {
     ret = GS_INVALID;
     goto cleanup;
   }
@@ -569,50 +581,23 @@ int gs_pair(PSERVER_DATA server, char* pin) {
   uuid_generate_random(uuid);
   uuid_unparse(uuid, uuid_str);
   snprintf(url, sizeof(url), "http://%s:47989/pair?uniqueid=%s&uuid=%s&devicename=roth&updateState=1&clientpairingsecret=%s", server->serverInfo.address, unique_id, uuid_str, client_pairing_secret_hex);
-  if ((ret = http_request(url, data)) != GS_OK)
-    goto cleanup;
-
-  free(result);
-  result = NULL;
-  if ((ret = xml_status(data->memory, data->size) != GS_OK))
-    goto cleanup;
-  else if ((ret = xml_search(data->memory, data->size, "paired", &result)) != GS_OK)
+  if ((ret = pair_request(url, data, &response)) != GS_OK)
     goto cleanup;
 
-  if (strcmp(result, "1") != 0) {
-    gs_error = "Pairing failed";
-    ret = GS_FAILED;
-    goto cleanup;
-  }
-
   uuid_generate_random(uuid);
   uuid_unparse(uuid, uuid_str);
   snprintf(url, sizeof(url), "https://%s:47984/pair?uniqueid=%s&uuid=%s&devicename=roth&updateState=1&phrase=pairchallenge", server->serverInfo.address, unique_id, uuid_str);
-  if ((ret = http_request(url, data)) != GS_OK)
-    goto cleanup;
-
-  free(result);
-  result = NULL;
-  if ((ret = xml_status(data->memory, data->size) != GS_OK))
-    goto cleanup;
-  else if ((ret = xml_search(data->memory, data->size, "paired", &result)) != GS_OK)
-    goto cleanup;
-
-  if (strcmp(result, "1") != 0) {
-    gs_error = "Pairing failed";
-    ret = GS_FAILED;
+  if ((ret = pair_request(url, data, &response)) != GS_OK)
     goto cleanup;
-  }
 
   server->paired = true;
+  cache_remove(key_directory, server->serverInfo.address);
 
   cleanup:
   if (ret != GS_OK)
     gs_unpair(server);
 
-  if (result != NULL)
-    free(result);
-
+  xml_free_fields(pair_fields, &response);
   http_free_data(data);
 
   return ret;
@@ -632,19 +617,34 @@ int gs_applist(PSERVER_DATA server, PAPP_LIST *list) {
   snprintf(url, sizeof(url), "https://%s:47984/applist?uniqueid=%s&uuid=%s", server->serverInfo.address, unique_id, uuid_str);
   if (http_request(url, data) != GS_OK)
     ret = GS_IO_ERROR;
-  else if (xml_status(data->memory, data->size) == GS_ERROR)
-    ret = GS_ERROR;
-  else if (xml_applist(data->memory, data->size, list) != GS_OK)
+  else if ((ret = xml_applist(data->memory, data->size, list)) != GS_OK && ret != GS_ERROR)
     ret = GS_INVALID;
+  else if (ret == GS_OK && server->paired)
+    cache_save(key_directory, server, *list);
 
   http_free_data(data);
   return ret;
 }
 
+// Launch, resume and quit answer with a single value
+struct session_response {
+  char* value;
+};
+
+static const XML_FIELD gamesession_fields[] = {
+  {"gamesession", XML_STRING, offsetof(struct session_response, value)},
+  {NULL}
+};
+
+static const XML_FIELD cancel_fields[] = {
+  {"cancel", XML_STRING, offsetof(struct session_response, value)},
+  {NULL}
+};
+
 int gs_start_app(PSERVER_DATA server, STREAM_CONFIGURATION *config, int appId, bool sops, bool localaudio, int gamepad_mask) {
   int ret = GS_OK;
   uuid_t uuid;
-  char* result = NULL;
+  struct session_response response = {0};
   char uuid_str[37];
 
   PDISPLAY_MODE mode = server->modes;
@@ -699,30 +699,95 @@ int gs_start_app(PSERVER_DATA server, STREAM_CONFIGURATION *config, int appId, b
   else
     goto cleanup;
 
-  if ((ret = xml_status(data->memory, data->size) != GS_OK))
-    goto cleanup;
-  else if ((ret = xml_search(data->memory, data->size, "gamesession", &result)) != GS_OK)
+  if ((ret = xml_extract(data->memory, data->size, gamesession_fields, &response)) != GS_OK)
     goto cleanup;
 
-  if (!strcmp(result, "0")) {
+  // A response without the session is malformed, not a launch
+  if (response.value == NULL) {
+    gs_error = "Missing gamesession in response";
+    ret = GS_INVALID;
+    goto cleanup;
+  } else if (!strcmp(response.value, "0")) {
     ret = GS_FAILED;
     goto cleanup;
   }
 
   cleanup:
-  if (result != NULL)
-    free(result);
+  xml_free_fields(gamesession_fields, &response);
 
   http_free_data(data);
   return ret;
 }
 
+int gs_measure_bandwidth(PSERVER_DATA server, int appId, int probes, int* kbps, double* jitter) {
+  char url[4096];
+  uuid_t uuid;
+  char uuid_str[37];
+  double rates[probes];
+  double previous = 0;
+  int count = 0, small = 0;
+
+  PHTTP_DATA data = http_create_data();
+  if (data == NULL)
+    return GS_OUT_OF_MEMORY;
+
+  // The box art of the app is the largest download GFE offers
+  *jitter = 0;
+  for (int i = 0; i < probes; i++) {
+    uuid_generate_random(uuid);
+    uuid_unparse(uuid, uuid_str);
+    snprintf(url, sizeof(url), "https://%s:47984/appasset?uniqueid=%s&uuid=%s&appid=%d&AssetType=2&AssetIdx=0", server->serverInfo.address, unique_id, uuid_str, appId);
+    if (http_request(url, data) != GS_OK)
+      continue;
+
+    double firstByte, transfer, bytes;
+    http_last_transfer(&firstByte, &transfer, &bytes);
+    if (transfer <= 0 || bytes <= 0)
+      continue;
+
+    if (bytes < BANDWIDTH_MIN_BYTES) {
+      small++;
+      continue;
+    }
+
+    if (transfer < BANDWIDTH_MIN_MS)
+      transfer = BANDWIDTH_MIN_MS;
+
+    if (count > 0)
+      *jitter += firstByte > previous ? firstByte - previous : previous - firstByte;
+
+    previous = firstByte;
+    rates[count++] = bytes * 8 / transfer;
+  }
+  http_free_data(data);
+
+  if (count == 0 && small > 0) {
+    gs_error = "Box art too small to measure the bandwidth";
+    return GS_FAILED;
+  } else if (count == 0)
+    return GS_IO_ERROR;
+
+  // Median of the transfer rates, bits per ms equals kbps
+  for (int i = 1; i < count; i++) {
+    for (int j = i; j > 0 && rates[j - 1] > rates[j]; j--) {
+      double rate = rates[j];
+      rates[j] = rates[j - 1];
+      rates[j - 1] = rate;
+    }
+  }
+  *kbps = rates[count / 2];
+  if (count > 1)
+    *jitter /= count - 1;
+
+  return GS_OK;
+}
+
 int gs_quit_app(PSERVER_DATA server) {
   int ret = GS_OK;
   char url[4096];
   uuid_t uuid;
   char uuid_str[37];
-  char* result = NULL;
+  struct session_response response = {0};
   PHTTP_DATA data = http_create_data();
   if (data == NULL)
     return GS_OUT_OF_MEMORY;
@@ -733,25 +798,66 @@ int gs_quit_app(PSERVER_DATA server) {
   if ((ret = http_request(url, data)) != GS_OK)
     goto cleanup;
 
-  if ((ret = xml_status(data->memory, data->size) != GS_OK))
-    goto cleanup;
-  else if ((ret = xml_search(data->memory, data->size, "cancel", &result)) != GS_OK)
+  if ((ret = xml_extract(data->memory, data->size, cancel_fields, &response)) != GS_OK)
     goto cleanup;
 
-  if (strcmp(result, "0") == 0) {
+  if (response.value == NULL) {
+    gs_error = "Missing cancel in response";
+    ret = GS_INVALID;
+    goto cleanup;
+  } else if (strcmp(response.value, "0") == 0) {
     ret = GS_FAILED;
     goto cleanup;
   }
 
+  server->currentGame = 0;
+
   cleanup:
-  if (result != NULL)
-    free(result);
+  xml_free_fields(cancel_fields, &response);
 
   http_free_data(data);
   return ret;
 }
 
-int gs_init(PSERVER_DATA server, char *address, const char *keyDirectory, int log_level, bool unsupported) {
+static void free_server_status(PSERVER_DATA server) {
+  free((char*) server->serverInfo.serverInfoAppVersion);
+  free((char*) server->serverInfo.serverInfoGfeVersion);
+  free(server->gpuType);
+  free(server->gsVersion);
+  while (server->modes != NULL) {
+    PDISPLAY_MODE next = server->modes->next;
+    free(server->modes);
+    server->modes = next;
+  }
+  server->serverInfo.serverInfoAppVersion = server->serverInfo.serverInfoGfeVersion = NULL;
+  server->gpuType = server->gsVersion = NULL;
+}
+
+int gs_refresh(PSERVER_DATA server) {
+  free_server_status(server);
+  return load_server_status(server);
+}
+
+int gs_update_cache(PSERVER_DATA server) {
+  // Fetched into a copy as the caller may still be using the cached data
+  SERVER_DATA fresh = {0};
+  LiInitializeServerInformation(&fresh.serverInfo);
+  fresh.serverInfo.address = server->serverInfo.address;
+  fresh.unsupported = server->unsupported;
+
+  PAPP_LIST list = NULL;
+  int ret = load_server_status(&fresh);
+  if (ret == GS_OK && fresh.paired)
+    ret = gs_applist(&fresh, &list);
+  else if (ret == GS_OK)
+    cache_remove(key_directory, fresh.serverInfo.address);
+
+  xml_free_applist(list);
+  free_server_status(&fresh);
+  return ret;
+}
+
+static int init_client(PSERVER_DATA server, char *address, const char *keyDirectory, int log_level, bool unsupported) {
   mkdirtree(keyDirectory);
   if (load_unique_id(keyDirectory) != GS_OK)
     return GS_FAILED;
@@ -760,9 +866,31 @@ int gs_init(PSERVER_DATA server, char *address, const char *keyDirectory, int lo
     return GS_FAILED;
 
   http_init(keyDirectory, log_level);
+  strncpy(key_directory, keyDirectory, sizeof(key_directory) - 1);
 
+  memset(server, 0, sizeof(*server));
   LiInitializeServerInformation(&server->serverInfo);
   server->serverInfo.address = address;
   server->unsupported = unsupported;
+  return GS_OK;
+}
+
+int gs_init(PSERVER_DATA server, char *address, const char *keyDirectory, int log_level, bool unsupported) {
+  int ret = init_client(server, address, keyDirectory, log_level, unsupported);
+  if (ret != GS_OK)
+    return ret;
+
+  return load_server_status(server);
+}
+
+int gs_init_cached(PSERVER_DATA server, char *address, const char *keyDirectory, int log_level, bool unsupported, PAPP_LIST *app_list) {
+  int ret = init_client(server, address, keyDirectory, log_level, unsupported);
+  if (ret != GS_OK)
+    return ret;
+
+  *app_list = NULL;
+  if (cache_load(keyDirectory, server, app_list) == GS_OK)
+    return GS_OK;
+
   return load_server_status(server);
 }
@@ -42,8 +42,12 @@ typedef struct _SERVER_DATA {
 } SERVER_DATA, *PSERVER_DATA;
 
 int gs_init(PSERVER_DATA server, char* address, const char *keyDirectory, int logLevel, bool unsupported);
+int gs_init_cached(PSERVER_DATA server, char* address, const char *keyDirectory, int logLevel, bool unsupported, PAPP_LIST *app_list);
+int gs_refresh(PSERVER_DATA server);
+int gs_update_cache(PSERVER_DATA server);
 int gs_start_app(PSERVER_DATA server, PSTREAM_CONFIGURATION config, int appId, bool sops, bool localaudio, int gamepad_mask);
 int gs_applist(PSERVER_DATA server, PAPP_LIST *app_list);
 int gs_unpair(PSERVER_DATA server);
 int gs_pair(PSERVER_DATA server, char* pin);
 int gs_quit_app(PSERVER_DATA server);
+int gs_measure_bandwidth(PSERVER_DATA server, int appId, int probes, int* kbps, double* jitter);
@@ -17,7 +17,9 @@
  * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "errors.h"
+#include "discover.h"
+#include "http.h"
+#include "xml.h"
 
 #include <avahi-client/client.h>
 #include <avahi-client/lookup.h>
@@ -26,30 +28,58 @@
 #include <avahi-common/malloc.h>
 #include <avahi-common/error.h>
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdbool.h>
+#include <string.h>
 #include <time.h>
 
-static AvahiSimplePoll *simple_poll = NULL;
+/* Browsing runs on its own thread until the deadline, after which every
+ * host found is probed at once. The caller can meanwhile try the last
+ * known host and cancel the search when it answers.
+ */
+struct _DISCOVERY {
+  AvahiSimplePoll *poll;
+  AvahiClient *client;
+  AvahiServiceBrowser *browser;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  struct timespec deadline;
+  bool cancelled;
+  bool joined;
+  PDISCOVERED_HOST hosts;
+};
 
 static void client_callback(AvahiClient *c, AvahiClientState state, void *userdata) {
   if (state == AVAHI_CLIENT_FAILURE) {
     gs_error = "Server connection failure";
-    avahi_simple_poll_quit(simple_poll);
+    avahi_simple_poll_quit(((PDISCOVERY) userdata)->poll);
   }
 }
 
+static void add_host(PDISCOVERY discovery, const char* name, const char* address) {
+  pthread_mutex_lock(&discovery->mutex);
+  PDISCOVERED_HOST *tail = &discovery->hosts;
+  while (*tail != NULL && strcmp((*tail)->address, address) != 0)
+    tail = &(*tail)->next;
+
+  // A host is announced once for every interface it's seen on
+  if (*tail == NULL && (*tail = calloc(1, sizeof(DISCOVERED_HOST))) != NULL) {
+    snprintf((*tail)->name, sizeof((*tail)->name), "%s", name);
+    snprintf((*tail)->address, sizeof((*tail)->address), "%s", address);
+    (*tail)->probeTime = -1;
+  }
+  pthread_mutex_unlock(&discovery->mutex);
+}
+
 static void resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface, AvahiProtocol protocol, AvahiResolverEvent event, const char *name, const char *type, const char *domain, const char *host_name, const AvahiAddress *address, uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags, void *userdata) {
+  PDISCOVERY discovery = userdata;
+
   if (event == AVAHI_RESOLVER_FOUND) {
-    if (userdata != NULL) {
-      avahi_address_snprint(userdata, AVAHI_ADDRESS_STR_MAX, address);
-      avahi_simple_poll_quit(simple_poll);
-    } else {
-      char strAddress[AVAHI_ADDRESS_STR_MAX];
-      avahi_address_snprint(strAddress, sizeof(strAddress), address);
-      printf(" %s (%s)\n", host_name, strAddress);
-    }
+    char strAddress[AVAHI_ADDRESS_STR_MAX];
+    avahi_address_snprint(strAddress, sizeof(strAddress), address);
+    add_host(discovery, host_name, strAddress);
   }
 
   avahi_service_resolver_free(r);
@@ -61,48 +91,350 @@ static void browse_callback(AvahiServiceBrowser *b, AvahiIfIndex interface, Avah
   switch (event) {
   case AVAHI_BROWSER_FAILURE:
     gs_error = "Server browser failure";
-    avahi_simple_poll_quit(simple_poll);
+    avahi_simple_poll_quit(((PDISCOVERY) userdata)->poll);
     break;
   case AVAHI_BROWSER_NEW:
     if (!(avahi_service_resolver_new(c, interface, protocol, name, type, domain, AVAHI_PROTO_INET, 0, resolve_callback, userdata)))
       gs_error = "Failed to resolve service";
 
     break;
-  case AVAHI_BROWSER_REMOVE:
+  default:
     break;
   }
 }
 
-void gs_discover_server(char* dest) {
-  AvahiClient *client = NULL;
-  AvahiServiceBrowser *sb = NULL;
+static long remaining_ms(struct timespec *deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+// The caller can still add hosts, so only the hosts known when counting are probed
+static void probe_hosts(PDISCOVERY discovery) {
+  pthread_mutex_lock(&discovery->mutex);
+  int count = 0;
+  for (PDISCOVERED_HOST host = discovery->hosts; host != NULL; host = host->next)
+    count++;
+
+  if (count == 0) {
+    pthread_mutex_unlock(&discovery->mutex);
+    return;
+  }
+
+  char urls[count][MAX_ADDRESS_SIZE + 64];
+  char* urlList[count];
+  PDISCOVERED_HOST list[count];
+  double times[count];
 
-  if (!(simple_poll = avahi_simple_poll_new())) {
+  PDISCOVERED_HOST host = discovery->hosts;
+  for (int i = 0; i < count; i++, host = host->next) {
+    snprintf(urls[i], sizeof(urls[i]), "http://%s:47989/serverinfo?uniqueid=0123456789ABCDEF", host->address);
+    urlList[i] = urls[i];
+    list[i] = host;
+  }
+  pthread_mutex_unlock(&discovery->mutex);
+
+  http_probe(urlList, times, NULL, count, PROBE_TIMEOUT);
+
+  // Hosts are only freed with the discovery, after this thread is joined
+  pthread_mutex_lock(&discovery->mutex);
+  for (int i = 0; i < count; i++) {
+    list[i]->reachable = times[i] >= 0;
+    list[i]->probeTime = times[i];
+  }
+  pthread_mutex_unlock(&discovery->mutex);
+}
+
+static void* discover_thread(void* data) {
+  PDISCOVERY discovery = data;
+  bool cancelled;
+
+  for (;;) {
+    pthread_mutex_lock(&discovery->mutex);
+    cancelled = discovery->cancelled;
+    pthread_mutex_unlock(&discovery->mutex);
+
+    long timeout = remaining_ms(&discovery->deadline);
+    if (cancelled || timeout <= 0 || avahi_simple_poll_iterate(discovery->poll, timeout) != 0)
+      break;
+  }
+
+  // Browsing is done, but the caller may still be adding hosts
+  if (!cancelled)
+    probe_hosts(discovery);
+
+  return NULL;
+}
+
+PDISCOVERY gs_discover_start(int timeout) {
+  PDISCOVERY discovery = calloc(1, sizeof(struct _DISCOVERY));
+  if (discovery == NULL) {
+    gs_error = "Not enough memory";
+    return NULL;
+  }
+
+  pthread_mutex_init(&discovery->mutex, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &discovery->deadline);
+  discovery->deadline.tv_sec += timeout / 1000;
+  discovery->deadline.tv_nsec += (timeout % 1000) * 1000000;
+  if (discovery->deadline.tv_nsec >= 1000000000) {
+    discovery->deadline.tv_sec++;
+    discovery->deadline.tv_nsec -= 1000000000;
+  }
+
+  if (!(discovery->poll = avahi_simple_poll_new())) {
     gs_error = "Failed to create simple poll object";
-    goto cleanup;
+    goto error;
   }
 
   int error;
-  client = avahi_client_new(avahi_simple_poll_get(simple_poll), 0, client_callback, NULL, &error);
-  if (!client) {
+  discovery->client = avahi_client_new(avahi_simple_poll_get(discovery->poll), 0, client_callback, discovery, &error);
+  if (!discovery->client) {
     gs_error = "Failed to create client";
-    goto cleanup;
+    goto error;
   }
 
-  if (!(sb = avahi_service_browser_new(client, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, "_nvstream._tcp", NULL, 0, browse_callback, dest))) {
+  if (!(discovery->browser = avahi_service_browser_new(discovery->client, AVAHI_IF_UNSPEC, AVAHI_PROTO_INET, "_nvstream._tcp", NULL, 0, browse_callback, discovery))) {
     gs_error = "Failed to create service browser";
-    goto cleanup;
+    goto error;
+  }
+
+  if (pthread_create(&discovery->thread, NULL, discover_thread, discovery) != 0) {
+    gs_error = "Failed to start discovery";
+    goto error;
+  }
+
+  return discovery;
+
+  error:
+  // Without mDNS only hosts added by the caller are known
+  if (discovery->browser)
+    avahi_service_browser_free(discovery->browser);
+  if (discovery->client)
+    avahi_client_free(discovery->client);
+  if (discovery->poll)
+    avahi_simple_poll_free(discovery->poll);
+
+  discovery->browser = NULL;
+  discovery->client = NULL;
+  discovery->poll = NULL;
+  discovery->joined = true;
+  return discovery;
+}
+
+PDISCOVERED_HOST gs_discover_wait(PDISCOVERY discovery) {
+  if (discovery == NULL)
+    return NULL;
+
+  if (!discovery->joined) {
+    pthread_join(discovery->thread, NULL);
+    discovery->joined = true;
+  }
+
+  return discovery->hosts;
+}
+
+void gs_discover_free(PDISCOVERY discovery) {
+  if (discovery == NULL)
+    return;
+
+  if (!discovery->joined) {
+    pthread_mutex_lock(&discovery->mutex);
+    discovery->cancelled = true;
+    pthread_mutex_unlock(&discovery->mutex);
+    avahi_simple_poll_wakeup(discovery->poll);
+    gs_discover_wait(discovery);
   }
 
-  avahi_simple_poll_loop(simple_poll);
+  if (discovery->browser)
+    avahi_service_browser_free(discovery->browser);
+
+  if (discovery->client)
+    avahi_client_free(discovery->client);
+
+  if (discovery->poll)
+    avahi_simple_poll_free(discovery->poll);
 
-  cleanup:
-  if (sb)
-    avahi_service_browser_free(sb);
+  while (discovery->hosts != NULL) {
+    PDISCOVERED_HOST next = discovery->hosts->next;
+    free(discovery->hosts);
+    discovery->hosts = next;
+  }
+
+  pthread_mutex_destroy(&discovery->mutex);
+  free(discovery);
+}
 
-  if (client)
-    avahi_client_free(client);
+void gs_discover_add_host(PDISCOVERY discovery, const char* address) {
+  add_host(discovery, address, address);
+}
+
+struct serverinfo_state {
+  char* state;
+};
+
+static const XML_FIELD state_fields[] = {
+  {"state", XML_STRING, offsetof(struct serverinfo_state, state)},
+  {NULL}
+};
+
+static int compare_doubles(const void* a, const void* b) {
+  double diff = *(const double*) a - *(const double*) b;
+  return diff < 0 ? -1 : diff > 0;
+}
+
+// Idle before busy hosts, then the fewest lost probes and the lowest round-trip time plus twice the jitter
+static int compare_hosts(const void* a, const void* b) {
+  PDISCOVERED_HOST first = *(PDISCOVERED_HOST*) a;
+  PDISCOVERED_HOST second = *(PDISCOVERED_HOST*) b;
+
+  if (first->reachable != second->reachable)
+    return first->reachable ? -1 : 1;
+  if (first->busy != second->busy)
+    return first->busy ? 1 : -1;
+  if (first->lost != second->lost)
+    return first->lost - second->lost;
+
+  double diff = (first->rtt + 2 * first->jitter) - (second->rtt + 2 * second->jitter);
+  return diff < 0 ? -1 : diff > 0;
+}
+
+PDISCOVERED_HOST gs_discover_rank(PDISCOVERY discovery, int probes) {
+  PDISCOVERED_HOST hosts = gs_discover_wait(discovery);
+
+  int count = 0;
+  for (PDISCOVERED_HOST host = hosts; host != NULL; host = host->next)
+    count++;
+
+  if (count == 0 || probes <= 0)
+    return hosts;
+
+  char urls[count][MAX_ADDRESS_SIZE + 64];
+  char* urlList[count];
+  PDISCOVERED_HOST list[count];
+  PHTTP_DATA data[count];
+  double samples[count][probes];
+  double times[count];
+
+  int i = 0;
+  for (PDISCOVERED_HOST host = hosts; host != NULL; host = host->next, i++) {
+    snprintf(urls[i], sizeof(urls[i]), "http://%s:47989/serverinfo?uniqueid=0123456789ABCDEF", host->address);
+    urlList[i] = urls[i];
+    list[i] = host;
+    data[i] = NULL;
+    host->lost = 0;
+    host->busy = false;
+  }
+
+  // Every round probes all hosts at once, so a slow host doesn't delay the others
+  for (int round = 0; round < probes; round++) {
+    for (i = 0; i < count; i++) {
+      // Only the first answer is parsed for the state of the host
+      if (round == 0)
+        data[i] = http_create_data();
+      else if (data[i] != NULL && data[i]->size > 0) {
+        http_free_data(data[i]);
+        data[i] = NULL;
+      }
+    }
+
+    http_probe(urlList, times, data, count, PROBE_TIMEOUT);
+
+    for (i = 0; i < count; i++) {
+      samples[i][round] = times[i];
+      if (times[i] < 0)
+        list[i]->lost++;
+      else if (data[i] != NULL && data[i]->size > 0) {
+        struct serverinfo_state info = {0};
+        if (xml_extract(data[i]->memory, data[i]->size, state_fields, &info) == GS_OK && info.state != NULL)
+          list[i]->busy = strstr(info.state, "_SERVER_BUSY") != NULL;
+
+        xml_free_fields(state_fields, &info);
+      }
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (data[i] != NULL)
+      http_free_data(data[i]);
+
+    PDISCOVERED_HOST host = list[i];
+    host->reachable = host->lost < probes;
+    host->rtt = host->jitter = -1;
+    if (!host->reachable)
+      continue;
+
+    // Mean difference between successive answers, like the RTP interarrival jitter
+    double answered[probes];
+    int n = 0;
+    double jitter = 0;
+    for (int round = 0; round < probes; round++) {
+      if (samples[i][round] < 0)
+        continue;
+
+      if (n > 0)
+        jitter += samples[i][round] > answered[n - 1] ? samples[i][round] - answered[n - 1] : answered[n - 1] - samples[i][round];
+      answered[n++] = samples[i][round];
+    }
+    host->jitter = n > 1 ? jitter / (n - 1) : 0;
+
+    qsort(answered, n, sizeof(double), compare_doubles);
+    host->rtt = answered[n / 2];
+    host->probeTime = answered[0];
+  }
+
+  qsort(list, count, sizeof(PDISCOVERED_HOST), compare_hosts);
+  for (i = 0; i < count; i++)
+    list[i]->next = i + 1 < count ? list[i + 1] : NULL;
+
+  discovery->hosts = list[0];
+  return discovery->hosts;
+}
+
+int gs_discover_probe(const char* address, int timeout) {
+  char url[MAX_ADDRESS_SIZE + 64];
+  char* urls[] = {url};
+  double time;
+
+  snprintf(url, sizeof(url), "http://%s:47989/serverinfo?uniqueid=0123456789ABCDEF", address);
+  return http_probe(urls, &time, NULL, 1, timeout) == 1 ? GS_OK : GS_IO_ERROR;
+}
+
+int gs_discover_load_last(const char* keyDirectory, char* dest) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", keyDirectory, LAST_HOST_FILE_NAME);
+
+  FILE* fd = fopen(path, "r");
+  if (fd == NULL)
+    return GS_FAILED;
+
+  if (fgets(dest, MAX_ADDRESS_SIZE, fd) == NULL)
+    dest[0] = 0;
+  fclose(fd);
+
+  dest[strcspn(dest, "\n")] = 0;
+  return dest[0] != 0 ? GS_OK : GS_INVALID;
+}
+
+void gs_discover_save_last(const char* keyDirectory, const char* address) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", keyDirectory, LAST_HOST_FILE_NAME);
+
+  FILE* fd = fopen(path, "w");
+  if (fd != NULL) {
+    fprintf(fd, "%s\n", address);
+    fclose(fd);
+  }
+}
+
+void gs_discover_server(char* dest) {
+  PDISCOVERY discovery = gs_discover_start(DISCOVER_TIMEOUT);
+  for (PDISCOVERED_HOST host = gs_discover_wait(discovery); host != NULL; host = host->next) {
+    if (host->reachable) {
+      strcpy(dest, host->address);
+      break;
+    }
+  }
 
-  if (simple_poll)
-    avahi_simple_poll_free(simple_poll);
+  gs_discover_free(discovery);
 }
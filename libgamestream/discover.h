@@ -19,6 +19,41 @@
 
 #include "errors.h"
 
+#include <stdbool.h>
+
 #define MAX_ADDRESS_SIZE 40
+#define MAX_HOST_NAME_SIZE 256
+
+#define DISCOVER_TIMEOUT 2000
+#define PROBE_TIMEOUT 1000
+#define RANK_PROBES 5
+
+#define LAST_HOST_FILE_NAME "lasthost"
+
+typedef struct _DISCOVERED_HOST {
+  char name[MAX_HOST_NAME_SIZE];
+  char address[MAX_ADDRESS_SIZE];
+  // Whether serverinfo answered and how long that took in ms
+  bool reachable;
+  double probeTime;
+  // Measured by gs_discover_rank, times in ms
+  double rtt;
+  double jitter;
+  int lost;
+  bool busy;
+  struct _DISCOVERED_HOST *next;
+} DISCOVERED_HOST, *PDISCOVERED_HOST;
+
+typedef struct _DISCOVERY *PDISCOVERY;
+
+PDISCOVERY gs_discover_start(int timeout);
+PDISCOVERED_HOST gs_discover_wait(PDISCOVERY discovery);
+void gs_discover_free(PDISCOVERY discovery);
+void gs_discover_add_host(PDISCOVERY discovery, const char* address);
+PDISCOVERED_HOST gs_discover_rank(PDISCOVERY discovery, int probes);
+
+int gs_discover_probe(const char* address, int timeout);
+int gs_discover_load_last(const char* keyDirectory, char* dest);
+void gs_discover_save_last(const char* keyDirectory, const char* address);
 
 void gs_discover_server(char* dest);
@@ -21,10 +21,45 @@
 #include "errors.h"
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <curl/curl.h>
+#include <openssl/ssl.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define SSL_SESSION_up_ref(session) CRYPTO_add(&(session)->references, 1, CRYPTO_LOCK_SSL_SESSION)
+#define SSL_SESSION_get0_peer(session) ((session)->peer)
+#endif
 
 static CURL *curl;
+static pthread_once_t globalInit = PTHREAD_ONCE_INIT;
+
+/* DNS results, TLS sessions and open connections are kept in a share handle,
+ * so requests to the same host and scheme reuse the connection or at least
+ * resume the TLS session instead of a full handshake with client signing.
+ */
+static CURLSH *share;
+static pthread_mutex_t shareLocks[CURL_LOCK_DATA_LAST];
+
+/* The last TLS session is saved in the key directory, so the first HTTPS
+ * request of the next run can resume it. It is only offered to the same
+ * host and port, and only while the client certificate is unchanged. It is
+ * dropped when pairing changes and when the server shows another certificate.
+ */
+static char sessionFilePath[4096];
+static char clientCertDigest[SHA256_DIGEST_LENGTH * 2 + 1];
+static char serverCertDigest[SHA256_DIGEST_LENGTH * 2 + 1];
+static char requestHost[256];
+static char sessionHost[256];
+static SSL_SESSION *savedSession;
+static pthread_mutex_t sessionLock = PTHREAD_MUTEX_INITIALIZER;
+static int (*curlNewSession)(SSL*, SSL_SESSION*);
 
 static const char *pCertFile = "./client.pem";
 static const char *pKeyFile = "./key.pem";
@@ -47,18 +82,213 @@ static size_t _write_curl(void *contents, size_t size, size_t nmemb, void *userp
   return realsize;
 }
 
+static void _lock_share(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+  pthread_mutex_lock(&shareLocks[data]);
+}
+
+static void _unlock_share(CURL *handle, curl_lock_data data, void *userptr) {
+  pthread_mutex_unlock(&shareLocks[data]);
+}
+
+static CURLSH* _create_share() {
+  CURLSH* handle = curl_share_init();
+  if (handle == NULL)
+    return NULL;
+
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&shareLocks[i], NULL);
+
+  curl_share_setopt(handle, CURLSHOPT_LOCKFUNC, _lock_share);
+  curl_share_setopt(handle, CURLSHOPT_UNLOCKFUNC, _unlock_share);
+  curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  return handle;
+}
+
+// Host and port of a URL, which is what a saved session is tied to
+static void _url_host(const char* url, char* host, size_t size) {
+  const char* start = strstr(url, "://");
+  start = start != NULL ? start + 3 : url;
+  size_t len = strcspn(start, "/?");
+  if (len >= size)
+    len = size - 1;
+
+  memcpy(host, start, len);
+  host[len] = 0;
+}
+
+static void _hex_digest(const unsigned char* digest, char* out) {
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+    sprintf(out + i * 2, "%02x", digest[i]);
+}
+
+static void _digest_file(const char* path, char* out) {
+  out[0] = 0;
+  FILE* fd = fopen(path, "rb");
+  if (fd == NULL)
+    return;
+
+  unsigned char buffer[16384];
+  size_t len = fread(buffer, 1, sizeof(buffer), fd);
+  fclose(fd);
+
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(buffer, len, digest);
+  _hex_digest(digest, out);
+}
+
+// Digest of the certificate the server presented when the session was established
+static void _digest_peer(SSL_SESSION* session, char* out) {
+  out[0] = 0;
+  X509* peer = SSL_SESSION_get0_peer(session);
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int len;
+  if (peer != NULL && X509_digest(peer, EVP_sha256(), digest, &len))
+    _hex_digest(digest, out);
+}
+
+static void _forget_session() {
+  pthread_mutex_lock(&sessionLock);
+  if (savedSession != NULL) {
+    SSL_SESSION_free(savedSession);
+    savedSession = NULL;
+  }
+  unlink(sessionFilePath);
+  pthread_mutex_unlock(&sessionLock);
+}
+
+// File format: a line with the host, client and server certificate digests, followed by the DER encoded session
+static void _load_session() {
+  FILE* fd = fopen(sessionFilePath, "rb");
+  if (fd == NULL)
+    return;
+
+  char digest[sizeof(clientCertDigest)];
+  unsigned char der[8192];
+  long len = 0;
+  if (fscanf(fd, "%255s %64s %64s\n", sessionHost, digest, serverCertDigest) == 3)
+    len = fread(der, 1, sizeof(der), fd);
+  fclose(fd);
+
+  const unsigned char* p = der;
+  SSL_SESSION* session = len > 0 ? d2i_SSL_SESSION(NULL, &p, len) : NULL;
+  if (session == NULL)
+    return;
+
+  // Sessions established with another client certificate or past their lifetime can't be used
+  if (strcmp(digest, clientCertDigest) != 0 || SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(NULL)) {
+    SSL_SESSION_free(session);
+    unlink(sessionFilePath);
+    return;
+  }
+
+  savedSession = session;
+}
+
+static void _save_session(SSL_SESSION* session) {
+  int len = i2d_SSL_SESSION(session, NULL);
+  unsigned char* der = len > 0 ? malloc(len) : NULL;
+  if (der == NULL)
+    return;
+
+  unsigned char* p = der;
+  i2d_SSL_SESSION(session, &p);
+
+  // The session holds the master secret, keep it private
+  char tmpFile[sizeof(sessionFilePath) + 4];
+  snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", sessionFilePath);
+  int fd = open(tmpFile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd >= 0) {
+    FILE* out = fdopen(fd, "wb");
+    if (out != NULL) {
+      fprintf(out, "%s %s %s\n", requestHost, clientCertDigest, serverCertDigest);
+      fwrite(der, 1, len, out);
+      fclose(out);
+      rename(tmpFile, sessionFilePath);
+    } else
+      close(fd);
+  }
+
+  free(der);
+}
+
+static int _new_session(SSL* ssl, SSL_SESSION* session) {
+  char digest[sizeof(serverCertDigest)];
+  _digest_peer(session, digest);
+
+  pthread_mutex_lock(&sessionLock);
+  if (savedSession != NULL) {
+    // A full handshake with the same host showed that its certificate changed since the saved session
+    if (debug && strcmp(sessionHost, requestHost) == 0 && strcmp(serverCertDigest, digest) != 0)
+      printf("Server certificate of %s changed, saved TLS session dropped\n", requestHost);
+
+    SSL_SESSION_free(savedSession);
+  }
+
+  SSL_SESSION_up_ref(session);
+  savedSession = session;
+  strcpy(sessionHost, requestHost);
+  strcpy(serverCertDigest, digest);
+  _save_session(session);
+  pthread_mutex_unlock(&sessionLock);
+
+  // Let curl add it to its own cache as well
+  return curlNewSession != NULL ? curlNewSession(ssl, session) : 0;
+}
+
+// Offer the saved session when curl has none of its own for this connection
+static void _handshake_info(const SSL* ssl, int where, int ret) {
+  if (!(where & SSL_CB_HANDSHAKE_START) || SSL_get_session(ssl) != NULL)
+    return;
+
+  pthread_mutex_lock(&sessionLock);
+  if (savedSession != NULL && strcmp(sessionHost, requestHost) == 0)
+    SSL_set_session((SSL*) ssl, savedSession);
+  pthread_mutex_unlock(&sessionLock);
+}
+
+static CURLcode _ssl_context(CURL *handle, void *sslctx, void *userptr) {
+  SSL_CTX* ctx = (SSL_CTX*) sslctx;
+  if (SSL_CTX_sess_get_new_cb(ctx) != _new_session)
+    curlNewSession = SSL_CTX_sess_get_new_cb(ctx);
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, _new_session);
+  SSL_CTX_set_info_callback(ctx, _handshake_info);
+  return CURLE_OK;
+}
+
+// curl_global_init isn't thread safe, while probes may run before or next to http_init
+static void _global_init() {
+  curl_global_init(CURL_GLOBAL_ALL);
+}
+
+static size_t _discard_curl(void *contents, size_t size, size_t nmemb, void *userp) {
+  return size * nmemb;
+}
+
 int http_init(const char* keyDirectory, int logLevel) {
+  pthread_once(&globalInit, _global_init);
   curl = curl_easy_init();
   debug = logLevel >= 2;
   if (!curl)
     return GS_FAILED;
 
+  share = _create_share();
+  if (share != NULL)
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
   char certificateFilePath[4096];
   sprintf(certificateFilePath, "%s/%s", keyDirectory, CERTIFICATE_FILE_NAME);
 
   char keyFilePath[4096];
   sprintf(&keyFilePath[0], "%s/%s", keyDirectory, KEY_FILE_NAME);
 
+  snprintf(sessionFilePath, sizeof(sessionFilePath), "%s/%s", keyDirectory, TLS_SESSION_FILE_NAME);
+  _digest_file(certificateFilePath, clientCertDigest);
+  _load_session();
+
   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
   curl_easy_setopt(curl, CURLOPT_SSLENGINE_DEFAULT, 1L);
   curl_easy_setopt(curl, CURLOPT_SSLCERTTYPE,"PEM");
@@ -68,7 +298,10 @@ int http_init(const char* keyDirectory, int logLevel) {
   curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, _write_curl);
   curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-  curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE, 0L);
+  curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  // Not supported when curl isn't built with OpenSSL, sessions then only live as long as the process
+  curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, _ssl_context);
 
   return GS_OK;
 }
@@ -76,6 +309,7 @@ int http_init(const char* keyDirectory, int logLevel) {
 int http_request(char* url, PHTTP_DATA data) {
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, data);
   curl_easy_setopt(curl, CURLOPT_URL, url);
+  _url_host(url, requestHost, sizeof(requestHost));
 
   if (debug)
     printf("Request %s\n", url);
@@ -91,20 +325,141 @@ int http_request(char* url, PHTTP_DATA data) {
   CURLcode res = curl_easy_perform(curl);
 
   if(res != CURLE_OK) {
+    // Don't offer a saved session again after a failed handshake
+    if (res == CURLE_SSL_CONNECT_ERROR)
+      _forget_session();
+
     gs_error = curl_easy_strerror(res);
     return GS_FAILED;
   } else if (data->memory == NULL) {
     return GS_OUT_OF_MEMORY;
   }
 
-  if (debug)
+  if (debug) {
+    double lookup = 0, connect = 0, handshake = 0, start = 0, total = 0;
+    long connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &lookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &handshake);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &start);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    // All times are cumulative from the start of the request
+    printf("Timing: lookup %.1f ms, connect %.1f ms, TLS %.1f ms, first byte %.1f ms, total %.1f ms, %s connection\n",
+      lookup * 1000, connect * 1000, handshake * 1000, start * 1000, total * 1000, connects > 0 ? "new" : "reused");
     printf("Response:\n%s\n\n", data->memory);
+  }
 
   return GS_OK;
 }
 
+int http_probe(char** urls, double* times, PHTTP_DATA* data, int count, long timeout) {
+  pthread_once(&globalInit, _global_init);
+
+  CURLM *multi = curl_multi_init();
+  if (multi == NULL)
+    return 0;
+
+  // Own handles, so the probes neither wait for each other nor touch the request handle
+  CURL *handles[count];
+  for (int i = 0; i < count; i++) {
+    times[i] = -1;
+    handles[i] = curl_easy_init();
+    if (handles[i] == NULL)
+      continue;
+
+    curl_easy_setopt(handles[i], CURLOPT_URL, urls[i]);
+    if (data != NULL && data[i] != NULL) {
+      curl_easy_setopt(handles[i], CURLOPT_WRITEFUNCTION, _write_curl);
+      curl_easy_setopt(handles[i], CURLOPT_WRITEDATA, data[i]);
+    } else
+      curl_easy_setopt(handles[i], CURLOPT_WRITEFUNCTION, _discard_curl);
+    curl_easy_setopt(handles[i], CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(handles[i], CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handles[i], CURLOPT_TIMEOUT_MS, timeout);
+    curl_multi_add_handle(multi, handles[i]);
+  }
+
+  int running;
+  do {
+    if (curl_multi_perform(multi, &running) != CURLM_OK)
+      break;
+    if (running > 0)
+      curl_multi_wait(multi, NULL, 0, 100, NULL);
+  } while (running > 0);
+
+  int answered = 0;
+  int left;
+  CURLMsg *msg;
+  while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+    if (msg->msg != CURLMSG_DONE || msg->data.result != CURLE_OK)
+      continue;
+
+    for (int i = 0; i < count; i++) {
+      if (handles[i] == msg->easy_handle) {
+        curl_easy_getinfo(handles[i], CURLINFO_TOTAL_TIME, &times[i]);
+        times[i] *= 1000;
+        answered++;
+      }
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (handles[i] != NULL) {
+      curl_multi_remove_handle(multi, handles[i]);
+      curl_easy_cleanup(handles[i]);
+    }
+  }
+  curl_multi_cleanup(multi);
+
+  if (debug)
+    printf("Probed %d hosts, %d answered\n", count, answered);
+
+  return answered;
+}
+
+void http_last_transfer(double* firstByte, double* transfer, double* bytes) {
+  double pretransfer = 0, start = 0, total = 0;
+  curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+  curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &start);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, bytes);
+
+  // Without connection setup, so a reused and a new connection compare, and the
+  // transfer without the time the server took to produce the response
+  *firstByte = (start - pretransfer) * 1000;
+  *transfer = (total - start) * 1000;
+}
+
+static void _cleanup_share() {
+  if (share != NULL) {
+    curl_share_cleanup(share);
+    share = NULL;
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+      pthread_mutex_destroy(&shareLocks[i]);
+  }
+}
+
+/* Pairing decides which server and client certificates trust each other, so
+ * neither the saved session nor the ones curl cached may be resumed after it
+ * changes. Open connections are dropped along with them.
+ */
+void http_forget_session() {
+  _forget_session();
+
+  if (share != NULL) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, NULL);
+    _cleanup_share();
+    share = _create_share();
+    if (share != NULL)
+      curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  }
+}
+
 void http_cleanup() {
   curl_easy_cleanup(curl);
+  _cleanup_share();
 }
 
 PHTTP_DATA http_create_data() {
@@ -23,6 +23,7 @@
 
 #define CERTIFICATE_FILE_NAME "client.pem"
 #define KEY_FILE_NAME "key.pem"
+#define TLS_SESSION_FILE_NAME "tls_session"
 
 typedef struct _HTTP_DATA {
   char *memory;
@@ -32,4 +33,7 @@ typedef struct _HTTP_DATA {
 int http_init(const char* keyDirectory, int logLevel);
 PHTTP_DATA http_create_data();
 int http_request(char* url, PHTTP_DATA data);
+void http_last_transfer(double* firstByte, double* transfer, double* bytes);
+int http_probe(char** urls, double* times, PHTTP_DATA* data, int count, long timeout);
+void http_forget_session();
 void http_free_data(PHTTP_DATA data);
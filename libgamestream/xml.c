@@ -21,207 +21,232 @@
 #include "errors.h"
 
 #include <expat.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define STATUS_OK 200
 
-static XML_Parser parser;
-
-struct xml_query {
-  char *memory;
-  size_t size;
-  int start;
-  void* data;
+/* Extracts all fields described by a table in a single pass over the
+ * document, together with the status of the root element. The parser
+ * can be fed in chunks as the data arrives.
+ */
+struct _XML_EXTRACTOR {
+  XML_Parser parser;
+  const XML_FIELD* fields;
+  void* target;
+  int depth;
+
+  // List item that is being filled
+  const XML_FIELD* list;
+  void* item;
+  int itemDepth;
+
+  // Field whose text is being collected
+  const XML_FIELD* field;
+  int fieldDepth;
+  char* text;
+  size_t size, capacity;
+
+  int status;
+  bool outOfMemory;
 };
 
-static void XMLCALL _xml_start_element(void *userData, const char *name, const char **atts) {
-  struct xml_query *search = (struct xml_query*) userData;
-  if (strcmp(search->data, name) == 0)
-    search->start++;
-}
-
-static void XMLCALL _xml_end_element(void *userData, const char *name) {
-  struct xml_query *search = (struct xml_query*) userData;
-  if (strcmp(search->data, name) == 0)
-    search->start--;
+static const XML_FIELD* _xml_find_field(const XML_FIELD* fields, const char* name) {
+  for (; fields->node != NULL; fields++) {
+    if (strcmp(fields->node, name) == 0)
+      return fields;
+  }
+  return NULL;
 }
 
-static void XMLCALL _xml_start_applist_element(void *userData, const char *name, const char **atts) {
-  struct xml_query *search = (struct xml_query*) userData;
-  if (strcmp("App", name) == 0) {
-    PAPP_LIST app = malloc(sizeof(APP_LIST));
-    if (app == NULL)
+static void _xml_store_field(PXML_EXTRACTOR extractor) {
+  char* base = extractor->list != NULL ? extractor->item : extractor->target;
+  void* member = base + extractor->field->offset;
+  const char* text = extractor->text != NULL ? extractor->text : "";
+
+  if (extractor->field->type == XML_INT)
+    *(int*) member = atoi(text);
+  else {
+    char* value = strdup(text);
+    if (value == NULL) {
+      extractor->outOfMemory = true;
       return;
-
-    app->id = 0;
-    app->name = NULL;
-    app->next = (PAPP_LIST) search->data;
-    search->data = app;
-  } else if (strcmp("ID", name) == 0 || strcmp("AppTitle", name) == 0) {
-    search->memory = malloc(1);
-    search->size = 0;
-    search->start = 1;
+    }
+    free(*(char**) member);
+    *(char**) member = value;
   }
 }
 
-static void XMLCALL _xml_end_applist_element(void *userData, const char *name) {
-  struct xml_query *search = (struct xml_query*) userData;
-  if (search->start) {
-    PAPP_LIST list = (PAPP_LIST) search->data;
-    if (list == NULL)
-      return;
+static void XMLCALL _xml_start_element(void *userData, const char *name, const char **atts) {
+  PXML_EXTRACTOR extractor = (PXML_EXTRACTOR) userData;
+  extractor->depth++;
 
-    if (strcmp("ID", name) == 0) {
-        list->id = atoi(search->memory);
-        free(search->memory);
-    } else if (strcmp("AppTitle", name) == 0) {
-        list->name = search->memory;
+  if (strcmp("root", name) == 0) {
+    for (int i = 0; atts[i]; i += 2) {
+      if (strcmp("status_code", atts[i]) == 0)
+        extractor->status = atoi(atts[i + 1]);
+      else if (extractor->status != STATUS_OK && strcmp("status_message", atts[i]) == 0)
+        gs_error = strdup(atts[i + 1]);
     }
-    search->start = 0;
   }
-}
 
-static void XMLCALL _xml_start_mode_element(void *userData, const char *name, const char **atts) {
-  struct xml_query *search = (struct xml_query*) userData;
-  if (strcmp("DisplayMode", name) == 0) {
-    PDISPLAY_MODE mode = calloc(1, sizeof(DISPLAY_MODE));
-    if (mode != NULL) {
-      mode->next = (PDISPLAY_MODE) search->data;
-      search->data = mode;
+  // Elements inside a field only add their text to it
+  if (extractor->field != NULL)
+    return;
+
+  const XML_FIELD* field = _xml_find_field(extractor->list != NULL ? extractor->list->item : extractor->fields, name);
+  if (field == NULL)
+    return;
+
+  if (field->type == XML_LIST) {
+    void* item = calloc(1, field->itemSize);
+    if (item == NULL) {
+      extractor->outOfMemory = true;
+      return;
     }
-  } else if (search->data != NULL && (strcmp("Height", name) == 0 || strcmp("Width", name) == 0 || strcmp("RefreshRate", name) == 0)) {
-    search->memory = malloc(1);
-    search->size = 0;
-    search->start = 1;
+
+    void** head = (void**) ((char*) extractor->target + field->offset);
+    *(void**) ((char*) item + field->next) = *head;
+    *head = item;
+
+    extractor->list = field;
+    extractor->item = item;
+    extractor->itemDepth = extractor->depth;
+  } else {
+    extractor->field = field;
+    extractor->fieldDepth = extractor->depth;
+    extractor->size = 0;
+    if (extractor->text != NULL)
+      extractor->text[0] = 0;
   }
 }
 
-static void XMLCALL _xml_end_mode_element(void *userData, const char *name) {
-  struct xml_query *search = (struct xml_query*) userData;
-  if (search->data != NULL && search->start) {
-    PDISPLAY_MODE mode = (PDISPLAY_MODE) search->data;
-    if (strcmp("Width", name) == 0)
-      mode->width = atoi(search->memory);
-    else if (strcmp("Height", name) == 0)
-      mode->height = atoi(search->memory);
-    else if (strcmp("RefreshRate", name) == 0)
-      mode->refresh = atoi(search->memory);
-
-    free(search->memory);
-    search->start = 0;
+static void XMLCALL _xml_end_element(void *userData, const char *name) {
+  PXML_EXTRACTOR extractor = (PXML_EXTRACTOR) userData;
+
+  if (extractor->field != NULL && extractor->depth == extractor->fieldDepth) {
+    _xml_store_field(extractor);
+    extractor->field = NULL;
+  } else if (extractor->list != NULL && extractor->depth == extractor->itemDepth) {
+    extractor->list = NULL;
+    extractor->item = NULL;
   }
+
+  extractor->depth--;
 }
 
-static void XMLCALL _xml_start_status_element(void *userData, const char *name, const char **atts) {
-  if (strcmp("root", name) == 0) {
-    int* status = (int*) userData;
-    for (int i = 0; atts[i]; i += 2) {
-      if (strcmp("status_code", atts[i]) == 0)
-        *status = atoi(atts[i + 1]);
-      else if (*status != STATUS_OK && strcmp("status_message", atts[i]) == 0)
-        gs_error = strdup(atts[i + 1]);
+static void XMLCALL _xml_write_data(void *userData, const XML_Char *s, int len) {
+  PXML_EXTRACTOR extractor = (PXML_EXTRACTOR) userData;
+  if (extractor->field == NULL)
+    return;
+
+  if (extractor->size + len + 1 > extractor->capacity) {
+    size_t capacity = extractor->capacity == 0 ? 64 : extractor->capacity;
+    while (capacity < extractor->size + len + 1)
+      capacity *= 2;
+
+    char* text = realloc(extractor->text, capacity);
+    if (text == NULL) {
+      extractor->outOfMemory = true;
+      return;
     }
+    extractor->text = text;
+    extractor->capacity = capacity;
   }
+
+  memcpy(&extractor->text[extractor->size], s, len);
+  extractor->size += len;
+  extractor->text[extractor->size] = 0;
 }
 
-static void XMLCALL _xml_end_status_element(void *userData, const char *name) { }
+PXML_EXTRACTOR xml_extractor_create(const XML_FIELD* fields, void* target) {
+  PXML_EXTRACTOR extractor = calloc(1, sizeof(struct _XML_EXTRACTOR));
+  if (extractor == NULL)
+    return NULL;
 
-static void XMLCALL _xml_write_data(void *userData, const XML_Char *s, int len) {
-  struct xml_query *search = (struct xml_query*) userData;
-  if (search->start > 0) {
-    search->memory = realloc(search->memory, search->size + len + 1);
-    if(search->memory == NULL)
-      return;
-
-    memcpy(&(search->memory[search->size]), s, len);
-    search->size += len;
-    search->memory[search->size] = 0;
+  extractor->parser = XML_ParserCreate("UTF-8");
+  if (extractor->parser == NULL) {
+    free(extractor);
+    return NULL;
   }
+
+  extractor->fields = fields;
+  extractor->target = target;
+  XML_SetUserData(extractor->parser, extractor);
+  XML_SetElementHandler(extractor->parser, _xml_start_element, _xml_end_element);
+  XML_SetCharacterDataHandler(extractor->parser, _xml_write_data);
+  return extractor;
 }
 
-int xml_search(char* data, size_t len, char* node, char** result) {
-  struct xml_query search;
-  search.data = node;
-  search.start = 0;
-  search.memory = calloc(1, 1);
-  search.size = 0;
-  XML_Parser parser = XML_ParserCreate("UTF-8");
-  XML_SetUserData(parser, &search);
-  XML_SetElementHandler(parser, _xml_start_element, _xml_end_element);
-  XML_SetCharacterDataHandler(parser, _xml_write_data);
-  if (! XML_Parse(parser, data, len, 1)) {
-    int code = XML_GetErrorCode(parser);
+// Returns GS_OK until the final chunk, which reports the status of the response
+int xml_extractor_feed(PXML_EXTRACTOR extractor, const char* data, size_t len, bool final) {
+  if (!XML_Parse(extractor->parser, data, len, final)) {
+    int code = XML_GetErrorCode(extractor->parser);
     gs_error = XML_ErrorString(code);
-    XML_ParserFree(parser);
-    free(search.memory);
     return GS_INVALID;
-  } else if (search.memory == NULL) {
-    XML_ParserFree(parser);
+  } else if (extractor->outOfMemory)
     return GS_OUT_OF_MEMORY;
-  }
 
-  XML_ParserFree(parser);
-  *result = search.memory;
+  if (!final)
+    return GS_OK;
 
-  return GS_OK;
+  return extractor->status == STATUS_OK ? GS_OK : GS_ERROR;
 }
 
-int xml_applist(char* data, size_t len, PAPP_LIST *app_list) {
-  struct xml_query query;
-  query.memory = calloc(1, 1);
-  query.size = 0;
-  query.start = 0;
-  query.data = NULL;
-  XML_Parser parser = XML_ParserCreate("UTF-8");
-  XML_SetUserData(parser, &query);
-  XML_SetElementHandler(parser, _xml_start_applist_element, _xml_end_applist_element);
-  XML_SetCharacterDataHandler(parser, _xml_write_data);
-  if (! XML_Parse(parser, data, len, 1)) {
-    int code = XML_GetErrorCode(parser);
-    gs_error = XML_ErrorString(code);
-    XML_ParserFree(parser);
-    return GS_INVALID;
-  }
+void xml_extractor_free(PXML_EXTRACTOR extractor) {
+  XML_ParserFree(extractor->parser);
+  free(extractor->text);
+  free(extractor);
+}
 
-  XML_ParserFree(parser);
-  *app_list = (PAPP_LIST) query.data;
+int xml_extract(const char* data, size_t len, const XML_FIELD* fields, void* target) {
+  PXML_EXTRACTOR extractor = xml_extractor_create(fields, target);
+  if (extractor == NULL)
+    return GS_OUT_OF_MEMORY;
 
-  return GS_OK;
+  int ret = xml_extractor_feed(extractor, data, len, true);
+  xml_extractor_free(extractor);
+  return ret;
 }
 
-int xml_modelist(char* data, size_t len, PDISPLAY_MODE *mode_list) {
-  struct xml_query query = {0};
-  query.memory = calloc(1, 1);
-  XML_Parser parser = XML_ParserCreate("UTF-8");
-  XML_SetUserData(parser, &query);
-  XML_SetElementHandler(parser, _xml_start_mode_element, _xml_end_mode_element);
-  XML_SetCharacterDataHandler(parser, _xml_write_data);
-  if (! XML_Parse(parser, data, len, 1)) {
-    int code = XML_GetErrorCode(parser);
-    gs_error = XML_ErrorString(code);
-    XML_ParserFree(parser);
-    return GS_INVALID;
+// Free the strings and lists extracted into target
+void xml_free_fields(const XML_FIELD* fields, void* target) {
+  for (; fields->node != NULL; fields++) {
+    void** member = (void**) ((char*) target + fields->offset);
+    if (fields->type == XML_STRING) {
+      free(*member);
+      *member = NULL;
+    } else if (fields->type == XML_LIST) {
+      while (*member != NULL) {
+        void* item = *member;
+        *member = *(void**) ((char*) item + fields->next);
+        xml_free_fields(fields->item, item);
+        free(item);
+      }
+    }
   }
+}
 
-  XML_ParserFree(parser);
-  *mode_list = (PDISPLAY_MODE) query.data;
+static const XML_FIELD app_fields[] = {
+  {"ID", XML_INT, offsetof(APP_LIST, id)},
+  {"AppTitle", XML_STRING, offsetof(APP_LIST, name)},
+  {NULL}
+};
 
-  return GS_OK;
+static const XML_FIELD applist_fields[] = {
+  {"App", XML_LIST, 0, app_fields, sizeof(APP_LIST), offsetof(APP_LIST, next)},
+  {NULL}
+};
 
-}
+int xml_applist(char* data, size_t len, PAPP_LIST *app_list) {
+  *app_list = NULL;
+  int ret = xml_extract(data, len, applist_fields, app_list);
+  if (ret != GS_OK)
+    xml_free_fields(applist_fields, app_list);
 
-int xml_status(char* data, size_t len) {
-  int status = 0;
-  XML_Parser parser = XML_ParserCreate("UTF-8");
-  XML_SetUserData(parser, &status);
-  XML_SetElementHandler(parser, _xml_start_status_element, _xml_end_status_element);
-  if (!XML_Parse(parser, data, len, 1)) {
-    int code = XML_GetErrorCode(parser);
-    gs_error = XML_ErrorString(code);
-    XML_ParserFree(parser);
-    return GS_INVALID;
-  }
+  return ret;
+}
 
-  XML_ParserFree(parser);
-  return status == STATUS_OK ? GS_OK : GS_ERROR;
+void xml_free_applist(PAPP_LIST app_list) {
+  xml_free_fields(applist_fields, &app_list);
 }
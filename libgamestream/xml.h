@@ -19,6 +19,8 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 typedef struct _APP_LIST {
   char* name;
@@ -33,7 +35,26 @@ typedef struct _DISPLAY_MODE {
   struct _DISPLAY_MODE *next;
 } DISPLAY_MODE, *PDISPLAY_MODE;
 
-int xml_search(char* data, size_t len, char* node, char** result);
+typedef enum { XML_STRING, XML_INT, XML_LIST } XML_FIELD_TYPE;
+
+// Element to extract into the member at offset, strings are allocated and lists are prepended to
+typedef struct _XML_FIELD {
+  const char* node;
+  XML_FIELD_TYPE type;
+  size_t offset;
+  // Lists only: the fields of an item, its size and the offset of its next pointer
+  const struct _XML_FIELD* item;
+  size_t itemSize;
+  size_t next;
+} XML_FIELD;
+
+typedef struct _XML_EXTRACTOR *PXML_EXTRACTOR;
+
+PXML_EXTRACTOR xml_extractor_create(const XML_FIELD* fields, void* target);
+int xml_extractor_feed(PXML_EXTRACTOR extractor, const char* data, size_t len, bool final);
+void xml_extractor_free(PXML_EXTRACTOR extractor);
+
+int xml_extract(const char* data, size_t len, const XML_FIELD* fields, void* target);
+void xml_free_fields(const XML_FIELD* fields, void* target);
 int xml_applist(char* data, size_t len, PAPP_LIST *app_list);
-int xml_modelist(char* data, size_t len, PDISPLAY_MODE *mode_list);
-int xml_status(char* data, size_t len);
+void xml_free_applist(PAPP_LIST app_list);
@@ -0,0 +1,236 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "adaptive.h"
+#include "loop.h"
+#include "logging.h"
+
+#include "audio/audio.h"
+
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The stream steps through levels of lower quality, level 0 being the
+ * configured stream. Every level cuts the bitrate by a quarter, from
+ * ADAPTIVE_RESOLUTION_LEVEL on at 720p as well. A window is degraded when
+ * the connection is reported poor, frames were lost, decoding can't keep
+ * up with the frame rate or the audio ran dry. Enough degraded windows in
+ * a row step down, a long run of clean ones steps back up. An up step that
+ * is soon undone doubles the clean run needed for the next one.
+ */
+
+static DECODER_RENDERER_CALLBACKS wrappedCallbacks;
+static DecoderRendererSubmitDecodeUnit submitDecodeUnit;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int timerFd = -1;
+
+static int baseWidth, baseHeight, baseBitrate, frameIntervalUs;
+static int level, pendingLevel;
+static int degradedWindows, cleanWindows, settleWindows, upWindows;
+static bool lastStepUp;
+
+static bool connectionPoor;
+static int lastFrameNumber;
+static unsigned int windowFrames, windowDropped, lastUnderruns;
+static uint64_t windowDecodeUs;
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void adaptive_bitrate(int lvl, int* bitrate) {
+  *bitrate = baseBitrate;
+  for (int i = 0; i < lvl; i++)
+    *bitrate = *bitrate * 3 / 4;
+
+  if (*bitrate < ADAPTIVE_MIN_BITRATE)
+    *bitrate = ADAPTIVE_MIN_BITRATE;
+}
+
+static void adaptive_request(int newLevel, const char* reason) {
+  int bitrate;
+  adaptive_bitrate(newLevel, &bitrate);
+  _moonlight_log(INFO, "Adaptive: %s, restarting at level %d (%d kbps%s)\n", reason, newLevel, bitrate, newLevel >= ADAPTIVE_RESOLUTION_LEVEL && baseHeight > 720 ? ", 720p" : "");
+
+  pendingLevel = newLevel;
+}
+
+// Called with the mutex held once per window
+static void adaptive_evaluate() {
+  AUDIO_PIPELINE_STATS stats;
+  audio_pipeline_get_stats(&stats);
+  unsigned int underruns = stats.underruns - lastUnderruns;
+  lastUnderruns = stats.underruns;
+
+  int decodeUs = windowFrames > 0 ? windowDecodeUs / windowFrames : 0;
+  bool dropping = windowDropped * 50 > windowFrames + windowDropped;
+  bool overloaded = decodeUs > frameIntervalUs * 4 / 5;
+  bool degraded = connectionPoor || dropping || overloaded || underruns >= 2;
+
+  if (settleWindows > 0)
+    settleWindows--;
+  else if (degraded) {
+    cleanWindows = 0;
+    if (++degradedWindows == 1)
+      _moonlight_log(INFO, "Adaptive: degraded, %u of %u frames dropped, decode %d us, %u audio underruns%s\n", windowDropped, windowFrames + windowDropped, decodeUs, underruns, connectionPoor ? ", connection poor" : "");
+
+    if (degradedWindows >= ADAPTIVE_DOWN_WINDOWS && level < ADAPTIVE_MAX_LEVEL) {
+      if (lastStepUp && upWindows < ADAPTIVE_MAX_UP_WINDOWS) {
+        upWindows *= 2;
+        _moonlight_log(INFO, "Adaptive: last step up didn't hold, waiting %d s before the next one\n", upWindows * ADAPTIVE_WINDOW);
+      }
+      lastStepUp = false;
+      adaptive_request(level + 1, "degraded too long");
+    }
+  } else {
+    if (degradedWindows > 0)
+      _moonlight_log(INFO, "Adaptive: recovered after %d degraded windows\n", degradedWindows);
+
+    degradedWindows = 0;
+    if (++cleanWindows >= upWindows) {
+      // The last step up held
+      lastStepUp = false;
+      if (level > 0) {
+        lastStepUp = true;
+        adaptive_request(level - 1, "stable");
+      }
+    }
+  }
+
+  windowFrames = windowDropped = 0;
+  windowDecodeUs = 0;
+}
+
+// Windows are timed on the main loop, which also does the restart when a level is requested
+static int adaptive_timer(int fd) {
+  uint64_t expirations;
+  read(fd, &expirations, sizeof(expirations));
+
+  pthread_mutex_lock(&mutex);
+  if (pendingLevel == level) {
+    adaptive_evaluate();
+  }
+  bool restart = pendingLevel != level;
+  pthread_mutex_unlock(&mutex);
+
+  return restart ? LOOP_RETURN : LOOP_OK;
+}
+
+static int adaptive_submit_decode_unit(PDECODE_UNIT decodeUnit) {
+  uint64_t start = now_us();
+  int ret = submitDecodeUnit(decodeUnit);
+  uint64_t end = now_us();
+
+  pthread_mutex_lock(&mutex);
+  // Gaps in the frame numbers are frames lost on the network, like aml counts them
+  if (lastFrameNumber >= 0 && decodeUnit->frameNumber > lastFrameNumber + 1)
+    windowDropped += decodeUnit->frameNumber - lastFrameNumber - 1;
+  lastFrameNumber = decodeUnit->frameNumber;
+  windowFrames++;
+  windowDecodeUs += end - start;
+  pthread_mutex_unlock(&mutex);
+
+  return ret;
+}
+
+void adaptive_init(PSTREAM_CONFIGURATION config) {
+  baseWidth = config->width;
+  baseHeight = config->height;
+  baseBitrate = config->bitrate;
+  frameIntervalUs = 1000000 / (config->fps > 0 ? config->fps : 60);
+  level = pendingLevel = 0;
+  degradedWindows = cleanWindows = 0;
+  settleWindows = ADAPTIVE_SETTLE_WINDOWS;
+  upWindows = ADAPTIVE_UP_WINDOWS;
+  lastStepUp = false;
+  connectionPoor = false;
+  lastFrameNumber = -1;
+  windowFrames = windowDropped = lastUnderruns = 0;
+  windowDecodeUs = 0;
+
+  struct itimerspec interval = { .it_interval = { ADAPTIVE_WINDOW, 0 }, .it_value = { ADAPTIVE_WINDOW, 0 } };
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (timerFd < 0 || timerfd_settime(timerFd, 0, &interval, NULL) < 0) {
+    _moonlight_log(WARN, "Adaptive: can't create timer, disabled\n");
+    return;
+  }
+  loop_add_fd(timerFd, adaptive_timer, POLLIN);
+
+  _moonlight_log(INFO, "Adaptive: enabled, down after %d degraded windows of %d s, up after %d clean windows\n", ADAPTIVE_DOWN_WINDOWS, ADAPTIVE_WINDOW, ADAPTIVE_UP_WINDOWS);
+}
+
+PDECODER_RENDERER_CALLBACKS adaptive_wrap_video(PDECODER_RENDERER_CALLBACKS callbacks) {
+  wrappedCallbacks = *callbacks;
+  submitDecodeUnit = callbacks->submitDecodeUnit;
+  wrappedCallbacks.submitDecodeUnit = adaptive_submit_decode_unit;
+  return &wrappedCallbacks;
+}
+
+void adaptive_connection_status(int status) {
+  pthread_mutex_lock(&mutex);
+  connectionPoor = status == CONN_STATUS_POOR;
+  pthread_mutex_unlock(&mutex);
+}
+
+bool adaptive_restart_pending() {
+  pthread_mutex_lock(&mutex);
+  bool pending = timerFd >= 0 && pendingLevel != level;
+  pthread_mutex_unlock(&mutex);
+  return pending;
+}
+
+void adaptive_apply(PSTREAM_CONFIGURATION config) {
+  pthread_mutex_lock(&mutex);
+  level = pendingLevel;
+  adaptive_bitrate(level, &config->bitrate);
+  if (level >= ADAPTIVE_RESOLUTION_LEVEL && baseHeight > 720) {
+    // Keep the aspect ratio, with an even width
+    config->width = (baseWidth * 720 / baseHeight) & ~1;
+    config->height = 720;
+  } else {
+    config->width = baseWidth;
+    config->height = baseHeight;
+  }
+
+  degradedWindows = cleanWindows = 0;
+  settleWindows = ADAPTIVE_SETTLE_WINDOWS;
+  connectionPoor = false;
+  lastFrameNumber = -1;
+  lastUnderruns = 0;
+  windowFrames = windowDropped = 0;
+  windowDecodeUs = 0;
+  pthread_mutex_unlock(&mutex);
+
+  _moonlight_log(INFO, "Adaptive: streaming %dx%d at %d kbps\n", config->width, config->height, config->bitrate);
+}
+
+void adaptive_destroy() {
+  if (timerFd >= 0) {
+    loop_remove_fd(timerFd);
+    close(timerFd);
+    timerFd = -1;
+  }
+}
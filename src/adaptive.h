@@ -0,0 +1,41 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Limelight.h>
+
+#include <stdbool.h>
+
+// Seconds a measurement window lasts, and how many windows in a row it takes to step down or up
+#define ADAPTIVE_WINDOW 1
+#define ADAPTIVE_DOWN_WINDOWS 3
+#define ADAPTIVE_UP_WINDOWS 30
+#define ADAPTIVE_MAX_UP_WINDOWS 480
+// Windows ignored after a restart, while the new stream settles
+#define ADAPTIVE_SETTLE_WINDOWS 5
+
+#define ADAPTIVE_MAX_LEVEL 6
+#define ADAPTIVE_RESOLUTION_LEVEL 3
+#define ADAPTIVE_MIN_BITRATE 1000
+
+void adaptive_init(PSTREAM_CONFIGURATION config);
+PDECODER_RENDERER_CALLBACKS adaptive_wrap_video(PDECODER_RENDERER_CALLBACKS callbacks);
+void adaptive_connection_status(int status);
+bool adaptive_restart_pending();
+void adaptive_apply(PSTREAM_CONFIGURATION config);
+void adaptive_destroy();
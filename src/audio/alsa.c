@@ -20,15 +20,43 @@
 #include "audio.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "../logging.h"
-#include <opus_multistream.h>
 #include <alsa/asoundlib.h>
 
 #define CHECK_RETURN(f) if ((rc = f) < 0) { _moonlight_log(ERR, "Alsa error code %d\n", rc); return -1; }
 
+// Auto tuning starts from a single Opus frame per period and doubles it on repeated xruns
+#define TUNE_MIN_PERIOD FRAME_SIZE
+#define TUNE_MAX_PERIOD (FRAME_SIZE * FRAME_BUFFER)
+#define TUNE_PERIODS 3
+#define TUNE_XRUN_WINDOW 10
+
 static snd_pcm_t *handle;
-static OpusMSDecoder* decoder;
-static short pcmBuffer[FRAME_SIZE * MAX_CHANNEL_COUNT];
+static snd_pcm_uframes_t periodSize;
+static unsigned int channelCount, pcmRate;
+
+// Hardware device opened without the plug layer, samples get converted to its native format here
+#define CONVERT_FRAMES (FRAME_SIZE * FRAME_BUFFER)
+
+static bool hwDirect;
+static snd_pcm_format_t pcmFormat;
+static void* convertBuffer;
+
+static bool autoTune;
+static char* deviceName;
+static char geometryFile[4096];
+static struct timespec lastXrun;
+
+// Device area handed out by snd_pcm_mmap_begin, committed once all of it is filled
+static bool mmapEnabled;
+static bool mmapDisabled;
+static const snd_pcm_channel_area_t* mmapAreas;
+static snd_pcm_uframes_t mmapOffset, mmapFrames, mmapFilled;
+
+// Calls into the device, to compare the mmap path with regular writes
+static unsigned int pcmWrites, pcmCommits, pcmWaits;
 
 int initAudioConfig = -1, audio_delay = 0;
 OPUS_MULTISTREAM_CONFIGURATION initOpusConfig;
@@ -38,6 +66,346 @@ void alsa_set_audio_init_delay(int delaySec) {
   audio_delay = delaySec;
 }
 
+void alsa_set_auto_tune(const char* keyDir) {
+  autoTune = true;
+  snprintf(geometryFile, sizeof(geometryFile), "%s/alsa_geometry", keyDir);
+}
+
+void alsa_set_hw_direct() {
+  hwDirect = true;
+}
+
+// Regular writes only, to compare them with the mmap path
+void alsa_set_rw_access() {
+  mmapDisabled = true;
+}
+
+void alsa_get_call_counts(unsigned int* writes, unsigned int* commits, unsigned int* waits) {
+  *writes = __atomic_load_n(&pcmWrites, __ATOMIC_RELAXED);
+  *commits = __atomic_load_n(&pcmCommits, __ATOMIC_RELAXED);
+  *waits = __atomic_load_n(&pcmWaits, __ATOMIC_RELAXED);
+}
+
+// Period size that previously ran without xruns on this device, or 0 when unknown
+static snd_pcm_uframes_t alsa_load_geometry() {
+  FILE* fd = fopen(geometryFile, "r");
+  if (fd == NULL)
+    return 0;
+
+  char *line = NULL;
+  size_t len = 0;
+  unsigned long period = 0, value;
+  int offset;
+  while (getline(&line, &len, fd) != -1) {
+    line[strcspn(line, "\n")] = 0;
+    if (sscanf(line, "%lu %n", &value, &offset) == 1 && strcmp(&line[offset], deviceName) == 0)
+      period = value;
+  }
+
+  free(line);
+  fclose(fd);
+  return period;
+}
+
+static void alsa_save_geometry() {
+  char tmpFile[sizeof(geometryFile) + 4];
+  snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", geometryFile);
+
+  FILE* out = fopen(tmpFile, "w");
+  if (out == NULL) {
+    _moonlight_log(WARN, "Can't save audio buffer geometry to %s\n", geometryFile);
+    return;
+  }
+
+  // Keep the entries of other devices
+  FILE* in = fopen(geometryFile, "r");
+  if (in != NULL) {
+    char *line = NULL;
+    size_t len = 0;
+    unsigned long value;
+    int offset;
+    while (getline(&line, &len, in) != -1) {
+      line[strcspn(line, "\n")] = 0;
+      if (sscanf(line, "%lu %n", &value, &offset) == 1 && strcmp(&line[offset], deviceName) != 0)
+        fprintf(out, "%s\n", line);
+    }
+    free(line);
+    fclose(in);
+  }
+
+  fprintf(out, "%lu %s\n", (unsigned long) periodSize, deviceName);
+  fclose(out);
+  rename(tmpFile, geometryFile);
+}
+
+static int alsa_configure(snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size) {
+  int rc;
+  snd_pcm_hw_params_t *hw_params;
+  snd_pcm_sw_params_t *sw_params;
+  unsigned int sampleRate = pcmRate;
+
+  /* Set hardware parameters */
+  CHECK_RETURN(snd_pcm_hw_params_malloc(&hw_params));
+  CHECK_RETURN(snd_pcm_hw_params_any(handle, hw_params));
+  // Prefer decoding straight into the device buffer, not every device or plugin supports it
+  mmapEnabled = !mmapDisabled && snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+  if (!mmapEnabled) {
+    if (!mmapDisabled)
+      _moonlight_log(INFO, "Alsa device doesn't support mmap, using regular writes\n");
+    CHECK_RETURN(snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED));
+  }
+  CHECK_RETURN(snd_pcm_hw_params_set_format(handle, hw_params, pcmFormat));
+  CHECK_RETURN(snd_pcm_hw_params_set_rate_near(handle, hw_params, &sampleRate, NULL));
+  if (hwDirect && sampleRate != pcmRate) {
+    _moonlight_log(ERR, "Alsa device doesn't support %u Hz natively, use a plughw device instead\n", pcmRate);
+    return -1;
+  }
+  CHECK_RETURN(snd_pcm_hw_params_set_channels(handle, hw_params, channelCount));
+  CHECK_RETURN(snd_pcm_hw_params_set_period_size_near(handle, hw_params, &period_size, NULL));
+  CHECK_RETURN(snd_pcm_hw_params_set_buffer_size_near(handle, hw_params, &buffer_size));
+  CHECK_RETURN(snd_pcm_hw_params(handle, hw_params));
+  snd_pcm_hw_params_free(hw_params);
+
+  /* Set software parameters, playback starts once all but the last period is queued */
+  CHECK_RETURN(snd_pcm_sw_params_malloc(&sw_params));
+  CHECK_RETURN(snd_pcm_sw_params_current(handle, sw_params));
+  CHECK_RETURN(snd_pcm_sw_params_set_avail_min(handle, sw_params, period_size));
+  CHECK_RETURN(snd_pcm_sw_params_set_start_threshold(handle, sw_params, buffer_size > period_size ? buffer_size - period_size : buffer_size));
+  CHECK_RETURN(snd_pcm_sw_params(handle, sw_params));
+  snd_pcm_sw_params_free(sw_params);
+
+  CHECK_RETURN(snd_pcm_prepare(handle));
+
+  periodSize = period_size;
+  mmapFilled = 0;
+  _moonlight_log(INFO, "Alsa period %lu frames, buffer %lu frames\n", (unsigned long) period_size, (unsigned long) buffer_size);
+  return 0;
+}
+
+/* Recover from an xrun. The stream is stopped at this point anyway, so when
+ * tuning this is where a larger geometry gets applied without adding a gap.
+ */
+static int alsa_recover(int err) {
+  audio_pipeline_underrun();
+
+  if (autoTune && err == -EPIPE && periodSize < TUNE_MAX_PERIOD) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bool repeated = lastXrun.tv_sec != 0 && now.tv_sec - lastXrun.tv_sec < TUNE_XRUN_WINDOW;
+    lastXrun = now;
+
+    if (repeated) {
+      snd_pcm_uframes_t period = periodSize * 2 > TUNE_MAX_PERIOD ? TUNE_MAX_PERIOD : periodSize * 2;
+      snd_pcm_drop(handle);
+      if (alsa_configure(period, period * TUNE_PERIODS) == 0) {
+        lastXrun.tv_sec = 0;
+        return 0;
+      }
+    }
+  }
+
+  return snd_pcm_recover(handle, err, 1);
+}
+
+// Convert to the device format in blocks and write those, returns the result of the last write
+static int alsa_renderer_write_converted(short* pcm, int frames) {
+  int done = 0, rc = 0;
+  while (done < frames) {
+    int block = frames - done > CONVERT_FRAMES ? CONVERT_FRAMES : frames - done;
+    short* in = pcm + done * channelCount;
+    if (pcmFormat == SND_PCM_FORMAT_S32_LE)
+      convert_s16_to_s32(in, convertBuffer, block * channelCount);
+    else
+      convert_s16_to_float(in, convertBuffer, block * channelCount);
+
+    __atomic_fetch_add(&pcmWrites, 1, __ATOMIC_RELAXED);
+    rc = mmapEnabled ? snd_pcm_mmap_writei(handle, convertBuffer, block) : snd_pcm_writei(handle, convertBuffer, block);
+    if (rc < block)
+      return rc < 0 || done == 0 ? rc : done + rc;
+
+    done += block;
+  }
+
+  return done;
+}
+
+static int alsa_renderer_write(short* pcm, int frames) {
+  int rc;
+  if (convertBuffer != NULL)
+    rc = alsa_renderer_write_converted(pcm, frames);
+  else {
+    __atomic_fetch_add(&pcmWrites, 1, __ATOMIC_RELAXED);
+    rc = mmapEnabled ? snd_pcm_mmap_writei(handle, pcm, frames) : snd_pcm_writei(handle, pcm, frames);
+  }
+
+  if (rc == -EPIPE) {
+    alsa_recover(rc);
+    return 0;
+  }
+
+  if (rc<0)
+    _moonlight_log(ERR, "Alsa error from writei: %d\n", rc);
+
+  return rc;
+}
+
+// Block until a full period can be written, or any space at all before playback has started
+static int alsa_renderer_wait() {
+  for (;;) {
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(handle);
+    if (avail < 0) {
+      if (alsa_recover(avail) < 0)
+        return -1;
+
+      continue;
+    }
+
+    snd_pcm_state_t state = snd_pcm_state(handle);
+    if (avail >= (snd_pcm_sframes_t) periodSize || (avail > 0 && state == SND_PCM_STATE_PREPARED))
+      return 0;
+
+    __atomic_fetch_add(&pcmWaits, 1, __ATOMIC_RELAXED);
+    int rc = state == SND_PCM_STATE_PREPARED ? snd_pcm_start(handle) : snd_pcm_wait(handle, 1000);
+    if (rc < 0 && snd_pcm_recover(handle, rc, 1) < 0)
+      return -1;
+  }
+}
+
+static short* alsa_renderer_begin(int* frames) {
+  if (mmapFilled == 0) {
+    if (alsa_renderer_wait() < 0)
+      return NULL;
+
+    mmapFrames = periodSize;
+    int rc = snd_pcm_mmap_begin(handle, &mmapAreas, &mmapOffset, &mmapFrames);
+    if (rc < 0) {
+      _moonlight_log(ERR, "Alsa error from mmap_begin: %d\n", rc);
+      return NULL;
+    }
+  }
+
+  *frames = mmapFrames - mmapFilled;
+  return (short*) ((char*) mmapAreas[0].addr + (mmapAreas[0].first + (mmapOffset + mmapFilled) * mmapAreas[0].step) / 8);
+}
+
+static int alsa_renderer_commit(int frames) {
+  mmapFilled += frames;
+  if (mmapFilled < mmapFrames)
+    return 0;
+
+  __atomic_fetch_add(&pcmCommits, 1, __ATOMIC_RELAXED);
+  snd_pcm_sframes_t rc = snd_pcm_mmap_commit(handle, mmapOffset, mmapFilled);
+  mmapFilled = 0;
+  if (rc < 0 || rc != (snd_pcm_sframes_t) mmapFrames) {
+    alsa_recover(rc < 0 ? rc : -EPIPE);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int alsa_renderer_delay() {
+  snd_pcm_sframes_t delay;
+  if (snd_pcm_delay(handle, &delay) < 0)
+    return -1;
+
+  // Frames decoded into the mmap area play once the period is committed
+  return delay + mmapFilled;
+}
+
+/* Most channels of a layout the driver below the PCM supports, or 0 when the
+ * driver doesn't report layouts. The plug, dmix and hw plugins pass the query
+ * on to the hardware, so this still works when the plug layer would accept
+ * any channel count.
+ */
+static unsigned int alsa_hw_channels() {
+  snd_pcm_chmap_query_t** maps = snd_pcm_query_chmaps(handle);
+  if (maps == NULL)
+    return 0;
+
+  unsigned int channels = 0;
+  for (int i = 0; maps[i] != NULL; i++) {
+    if (maps[i]->map.channels > channels)
+      channels = maps[i]->map.channels;
+  }
+
+  snd_pcm_free_chmaps(maps);
+  return channels;
+}
+
+/* Pick the sample format and channel count before the geometry is set up.
+ * Stereo only devices get a stereo mix of 5.1 streams, the plug layer of the
+ * "sysdefault" device would otherwise accept 6 channels and do its own remap.
+ * Hardware devices get their native format, S16 is preferred so Opus can
+ * decode straight into the device buffer.
+ */
+static int alsa_negotiate() {
+  int rc;
+  snd_pcm_hw_params_t *hw_params;
+  CHECK_RETURN(snd_pcm_hw_params_malloc(&hw_params));
+  CHECK_RETURN(snd_pcm_hw_params_any(handle, hw_params));
+
+  unsigned int hwChannels = channelCount == 6 ? alsa_hw_channels() : 0;
+  if (channelCount == 6 && (snd_pcm_hw_params_test_channels(handle, hw_params, channelCount) < 0 || (hwChannels > 0 && hwChannels < channelCount))) {
+    channelCount = 2;
+    audio_pipeline_set_output_channels(channelCount);
+  }
+
+  static const snd_pcm_format_t formats[] = { SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT_LE };
+  pcmFormat = SND_PCM_FORMAT_UNKNOWN;
+  for (int i = 0; i < sizeof(formats) / sizeof(formats[0]) && pcmFormat == SND_PCM_FORMAT_UNKNOWN; i++) {
+    if (!hwDirect || snd_pcm_hw_params_test_format(handle, hw_params, formats[i]) == 0)
+      pcmFormat = formats[i];
+  }
+  snd_pcm_hw_params_free(hw_params);
+
+  if (pcmFormat == SND_PCM_FORMAT_UNKNOWN) {
+    _moonlight_log(ERR, "Alsa device doesn't support S16, S32 or float samples\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Hardware devices don't necessarily use the ALSA default channel order,
+ * read the layout the driver reports and build the decoder mapping from it.
+ */
+static int alsa_map_channels(POPUS_MULTISTREAM_CONFIGURATION opusConfig, unsigned char* mapping) {
+  // Stream order is FL-FR-C-LFE-RL-RR, side channels stand in for missing rear ones
+  static const unsigned int positions[][2] = {
+    { SND_CHMAP_FL, SND_CHMAP_FL }, { SND_CHMAP_FR, SND_CHMAP_FR }, { SND_CHMAP_FC, SND_CHMAP_FC },
+    { SND_CHMAP_LFE, SND_CHMAP_LFE }, { SND_CHMAP_RL, SND_CHMAP_SL }, { SND_CHMAP_RR, SND_CHMAP_SR },
+  };
+
+  // Stereo decodes use the stream order, which every driver agrees on
+  if (channelCount != 6)
+    return 0;
+
+  snd_pcm_chmap_t* chmap = snd_pcm_get_chmap(handle);
+  if (chmap == NULL)
+    return 0;
+
+  int rc = 0;
+  for (unsigned int i = 0; i < chmap->channels && i < channelCount; i++) {
+    int source = -1;
+    for (int j = 0; j < 6 && source < 0; j++) {
+      if (chmap->pos[i] == positions[j][0] || chmap->pos[i] == positions[j][1])
+        source = j;
+    }
+
+    if (source < 0) {
+      _moonlight_log(ERR, "Alsa device has an unsupported channel layout\n");
+      rc = -1;
+      break;
+    }
+
+    mapping[i] = opusConfig->mapping[source];
+  }
+
+  free(chmap);
+  return rc;
+}
+
 static int alsa_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
   int rc;
   unsigned char alsaMapping[MAX_CHANNEL_COUNT];
@@ -62,55 +430,76 @@ static int alsa_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGUR
     alsaMapping[5] = opusConfig->mapping[3];
   }
 
-  decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, alsaMapping, &rc);
-
-  snd_pcm_hw_params_t *hw_params;
-  snd_pcm_sw_params_t *sw_params;
   snd_pcm_uframes_t period_size = FRAME_SIZE * FRAME_BUFFER;
   snd_pcm_uframes_t buffer_size = 2 * period_size;
-  unsigned int sampleRate = opusConfig->sampleRate;
+  channelCount = opusConfig->channelCount;
+  pcmRate = opusConfig->sampleRate;
+  pcmWrites = pcmCommits = pcmWaits = 0;
 
   char* audio_device = (char*) context;
   if (audio_device == NULL)
-    audio_device = "sysdefault";
+    audio_device = hwDirect ? "hw:0" : "sysdefault";
 
   /* Open PCM device for playback. */
-  CHECK_RETURN(snd_pcm_open(&handle, audio_device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK))
+  int mode = SND_PCM_NONBLOCK;
+  if (hwDirect)
+    mode |= SND_PCM_NO_AUTO_RESAMPLE | SND_PCM_NO_AUTO_CHANNELS | SND_PCM_NO_AUTO_FORMAT;
 
-  /* Set hardware parameters */
-  CHECK_RETURN(snd_pcm_hw_params_malloc(&hw_params));
-  CHECK_RETURN(snd_pcm_hw_params_any(handle, hw_params));
-  CHECK_RETURN(snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED));
-  CHECK_RETURN(snd_pcm_hw_params_set_format(handle, hw_params, SND_PCM_FORMAT_S16_LE));
-  CHECK_RETURN(snd_pcm_hw_params_set_rate_near(handle, hw_params, &sampleRate, NULL));
-  CHECK_RETURN(snd_pcm_hw_params_set_channels(handle, hw_params, opusConfig->channelCount));
-  CHECK_RETURN(snd_pcm_hw_params_set_period_size_near(handle, hw_params, &period_size, NULL));
-  CHECK_RETURN(snd_pcm_hw_params_set_buffer_size_near(handle, hw_params, &buffer_size));
-  CHECK_RETURN(snd_pcm_hw_params(handle, hw_params));
-  snd_pcm_hw_params_free(hw_params);
+  CHECK_RETURN(snd_pcm_open(&handle, audio_device, SND_PCM_STREAM_PLAYBACK, mode))
+  // Writes happen on the audio pipeline's output thread, let them block at device pace
+  CHECK_RETURN(snd_pcm_nonblock(handle, 0))
 
-  /* Set software parameters */
-  CHECK_RETURN(snd_pcm_sw_params_malloc(&sw_params));
-  CHECK_RETURN(snd_pcm_sw_params_current(handle, sw_params));
-  CHECK_RETURN(snd_pcm_sw_params_set_avail_min(handle, sw_params, period_size));
-  CHECK_RETURN(snd_pcm_sw_params_set_start_threshold(handle, sw_params, buffer_size));
-  CHECK_RETURN(snd_pcm_sw_params(handle, sw_params));
-  snd_pcm_sw_params_free(sw_params);
+  if (alsa_negotiate() < 0)
+    return -1;
 
-  CHECK_RETURN(snd_pcm_prepare(handle));
+  deviceName = audio_device;
+  if (autoTune) {
+    period_size = alsa_load_geometry();
+    if (period_size < TUNE_MIN_PERIOD || period_size > TUNE_MAX_PERIOD)
+      period_size = TUNE_MIN_PERIOD;
+
+    buffer_size = period_size * TUNE_PERIODS;
+    lastXrun.tv_sec = 0;
+  }
+
+  if (alsa_configure(period_size, buffer_size) < 0)
+    return -1;
+
+  if (hwDirect && alsa_map_channels(opusConfig, alsaMapping) < 0)
+    return -1;
+
+  if (pcmFormat != SND_PCM_FORMAT_S16_LE) {
+    convertBuffer = malloc(CONVERT_FRAMES * channelCount * sizeof(int));
+    if (convertBuffer == NULL)
+      return -1;
+  } else if (mmapEnabled)
+    audio_pipeline_set_direct(alsa_renderer_begin, alsa_renderer_commit);
+
+  if (hwDirect) {
+    _moonlight_log(INFO, "Alsa hardware device %s: %s, %u Hz, %u channels, %s\n", audio_device, snd_pcm_format_name(pcmFormat), pcmRate, channelCount,
+                   convertBuffer != NULL ? "converted on write" : (mmapEnabled ? "decoded into the mmap buffer" : "written without conversion"));
+  }
+
+  if (audio_pipeline_init(opusConfig, alsaMapping, FRAME_SIZE * FRAME_BUFFER, alsa_renderer_write, alsa_renderer_delay) < 0)
+    return -1;
 
   audio_delay = 0;
   return 0;
 }
 
 static void alsa_renderer_cleanup() {
-  if (decoder != NULL)
-    opus_multistream_decoder_destroy(decoder);
+  audio_pipeline_destroy();
+
+  if (handle != NULL && autoTune)
+    alsa_save_geometry();
 
   if (handle != NULL) {
     snd_pcm_drain(handle);
     snd_pcm_close(handle);
   }
+
+  free(convertBuffer);
+  convertBuffer = NULL;
 }
 
 struct timespec currentTime, lastTry;
@@ -149,19 +538,7 @@ static bool check_for_audio_delay() {
 static void alsa_renderer_decode_and_play_sample(char* data, int length) {
   if (check_for_audio_delay() == false) return;
 
-  int decodeLen = opus_multistream_decode(decoder, data, length, pcmBuffer, FRAME_SIZE, 0);
-  if (decodeLen > 0) {
-    int rc = snd_pcm_writei(handle, pcmBuffer, decodeLen);
-    if (rc == -EPIPE)
-      snd_pcm_recover(handle, rc, 1);
-
-    if (rc<0)
-      _moonlight_log(ERR, "Alsa error from writei: %d\n", rc);
-    else if (decodeLen != rc)
-      _moonlight_log(WARN,"Alsa shortm write, write %d frames\n", rc);
-  } else {
-    _moonlight_log(ERR, "Opus error from decode: %d\n", decodeLen);
-  }
+  audio_pipeline_submit(data, length);
 }
 
 AUDIO_RENDERER_CALLBACKS audio_callbacks_alsa = {
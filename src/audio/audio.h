@@ -25,9 +25,59 @@
 #define FRAME_SIZE 240
 #define FRAME_BUFFER 12
 
+typedef struct _AUDIO_PIPELINE_STATS {
+  unsigned int packetQueueDepth;
+  unsigned int pcmQueueFrames;
+  unsigned int underruns;
+  unsigned int droppedPackets;
+  unsigned int droppedFrames;
+  unsigned int concealedFrames;
+  unsigned int recoveredFrames;
+  // Writes, commits or pulls of the device, each one is a wakeup and usually a system call
+  unsigned int deviceWrites;
+  // CPU time used by the decode and output threads that have ended
+  double threadCpuMs;
+  double latencyMs;
+  // Latency of the audio being played from its arrival, measured from the device delay, 0 when unknown
+  double playedLatencyMs;
+  double resampleRatio;
+} AUDIO_PIPELINE_STATS, *PAUDIO_PIPELINE_STATS;
+
+// Blocking write of interleaved samples to the device, returns the number of frames consumed or a negative error
+typedef int(*AudioPipelineWrite)(short* pcm, int frames);
+// Frames queued in the device not yet played, or a negative value when unknown
+typedef int(*AudioPipelineDelay)();
+// Zero-copy output: lend a contiguous device area for up to *frames frames, then commit the frames filled in it
+typedef short*(*AudioPipelineBegin)(int* frames);
+typedef int(*AudioPipelineCommit)(int frames);
+
+int audio_pipeline_init(POPUS_MULTISTREAM_CONFIGURATION opusConfig, const unsigned char* mapping, int bufferFrames, AudioPipelineWrite write, AudioPipelineDelay delay);
+void audio_pipeline_set_latency(int latencyMs);
+void audio_pipeline_set_direct(AudioPipelineBegin begin, AudioPipelineCommit commit);
+// Channels the device accepts, a 5.1 stream is mixed down when set to 2
+void audio_pipeline_set_output_channels(int channels);
+void audio_pipeline_submit(char* data, int length);
+// Without write callback, decode queued packets into pcm from the backend's own audio callback
+int audio_pipeline_pull(short* pcm, int frames);
+void audio_pipeline_underrun();
+void audio_pipeline_get_stats(PAUDIO_PIPELINE_STATS stats);
+void audio_pipeline_destroy();
+
+int resampler_init(int channels, int maxFrames);
+int resampler_process(short* in, int inFrames, short* out, int maxOutFrames, double ratio);
+void resampler_destroy();
+
+void downmix_51_to_stereo(const float* in, short* out, int frames);
+void convert_s16_to_s32(const short* in, int* out, int samples);
+void convert_s16_to_float(const short* in, float* out, int samples);
+
 #ifdef HAVE_ALSA
 extern AUDIO_RENDERER_CALLBACKS audio_callbacks_alsa;
 void alsa_set_audio_init_delay(int delaySec);
+void alsa_set_auto_tune(const char* keyDir);
+void alsa_set_hw_direct();
+void alsa_set_rw_access();
+void alsa_get_call_counts(unsigned int* writes, unsigned int* commits, unsigned int* waits);
 #endif
 #ifdef HAVE_SDL
 extern AUDIO_RENDERER_CALLBACKS audio_callbacks_sdl;
@@ -35,4 +85,11 @@ extern AUDIO_RENDERER_CALLBACKS audio_callbacks_sdl;
 #ifdef HAVE_PULSE
 extern AUDIO_RENDERER_CALLBACKS audio_callbacks_pulse;
 bool audio_pulse_init(char* audio_device);
+void audio_pulse_destroy();
+#endif
+#ifdef HAVE_PIPEWIRE
+extern AUDIO_RENDERER_CALLBACKS audio_callbacks_pipewire;
+bool audio_pipewire_init(char* audio_device);
+void audio_pipewire_destroy();
+void pipewire_set_quantum(int frames);
 #endif
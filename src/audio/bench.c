@@ -0,0 +1,296 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Standalone benchmark for the audio renderers. Synthetic test tones are
+ * encoded with the same Opus multistream layout the host sends, and the
+ * packets are handed to a renderer at the 5 ms stream cadence with optional
+ * delivery jitter and packet loss.
+ *
+ * Handing over a packet only queues it, decoding and device writes happen
+ * on the pipeline threads or the backend's own audio thread. Their cost is
+ * reported as the CPU time of the whole process during the run, next to the
+ * number of device writes and xruns.
+ *
+ * Useful targets without real output: the ALSA "null" device, a Pulse null
+ * sink (PULSE_SINK=...) and the SDL dummy driver, which is used by default.
+ * Running ALSA with and without -rw compares decoding into the mmap buffer
+ * with regular writes.
+ */
+
+#include "audio.h"
+
+#include <opus_multistream.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define BENCH_PACKETS 200
+#define BENCH_PACKET_SIZE 1400
+#define BENCH_INTERVAL_NS (FRAME_SIZE * 1000000000LL / 48000)
+
+static unsigned char packets[BENCH_PACKETS][BENCH_PACKET_SIZE];
+static int packetLengths[BENCH_PACKETS];
+
+static long long bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double bench_ms(struct timeval* tv) {
+  return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static int bench_compare(const void* a, const void* b) {
+  long long x = *(const long long*) a, y = *(const long long*) b;
+  return x < y ? -1 : x > y;
+}
+
+// Same stream layouts as the host uses for stereo and 5.1
+static void bench_opus_config(bool surround, POPUS_MULTISTREAM_CONFIGURATION config) {
+  static const unsigned char stereoMapping[] = { 0, 1 };
+  static const unsigned char surroundMapping[] = { 0, 4, 1, 5, 2, 3 };
+
+  memset(config, 0, sizeof(*config));
+  config->sampleRate = 48000;
+  config->channelCount = surround ? 6 : 2;
+  config->streams = surround ? 4 : 1;
+  config->coupledStreams = 2 - !surround;
+  memcpy(config->mapping, surround ? surroundMapping : stereoMapping, config->channelCount);
+}
+
+// A tone with its own frequency on every channel, so channel mixups are audible on real hardware
+static int bench_encode(POPUS_MULTISTREAM_CONFIGURATION config, int lossPercent) {
+  int rc;
+  OpusMSEncoder* encoder = opus_multistream_encoder_create(config->sampleRate, config->channelCount, config->streams, config->coupledStreams, config->mapping, OPUS_APPLICATION_RESTRICTED_LOWDELAY, &rc);
+  if (encoder == NULL) {
+    fprintf(stderr, "Opus error creating encoder: %d\n", rc);
+    return -1;
+  }
+
+  opus_multistream_encoder_ctl(encoder, OPUS_SET_BITRATE(config->channelCount * 64000));
+  if (lossPercent > 0) {
+    opus_multistream_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(1));
+    opus_multistream_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(lossPercent));
+  }
+
+  short pcm[FRAME_SIZE * MAX_CHANNEL_COUNT];
+  for (int i = 0; i < BENCH_PACKETS; i++) {
+    for (int j = 0; j < FRAME_SIZE; j++) {
+      long sample = i * FRAME_SIZE + j;
+      for (int c = 0; c < config->channelCount; c++)
+        pcm[j * config->channelCount + c] = 8000 * sin(2 * M_PI * 220 * (c + 1) * sample / config->sampleRate);
+    }
+
+    packetLengths[i] = opus_multistream_encode(encoder, pcm, FRAME_SIZE, packets[i], BENCH_PACKET_SIZE);
+    if (packetLengths[i] < 0) {
+      fprintf(stderr, "Opus error encoding: %d\n", packetLengths[i]);
+      opus_multistream_encoder_destroy(encoder);
+      return -1;
+    }
+  }
+
+  opus_multistream_encoder_destroy(encoder);
+  return 0;
+}
+
+static PAUDIO_RENDERER_CALLBACKS bench_renderer(char* name, char* device) {
+  #ifdef HAVE_ALSA
+  if (strcmp(name, "alsa") == 0)
+    return &audio_callbacks_alsa;
+  #endif
+  #ifdef HAVE_PULSE
+  if (strcmp(name, "pulse") == 0 && audio_pulse_init(device))
+    return &audio_callbacks_pulse;
+  #endif
+  #ifdef HAVE_PIPEWIRE
+  if (strcmp(name, "pipewire") == 0 && audio_pipewire_init(device))
+    return &audio_callbacks_pipewire;
+  #endif
+  #ifdef HAVE_SDL
+  if (strcmp(name, "sdl") == 0) {
+    setenv("SDL_AUDIODRIVER", "dummy", 0);
+    return &audio_callbacks_sdl;
+  }
+  #endif
+  return NULL;
+}
+
+static void help() {
+  printf("Usage: moonlight-audio-bench [options]\n\n");
+  printf("\t-backend <name>\t\tRenderer to drive: alsa, pulse, pipewire or sdl (default sdl)\n");
+  printf("\t-device <device>\tOutput device passed to the renderer (alsa defaults to null)\n");
+  printf("\t-surround\t\tStream 5.1 instead of stereo\n");
+  printf("\t-seconds <seconds>\tLength of the run (default 10)\n");
+  printf("\t-jitter <ms>\t\tDelay every packet by up to <ms> milliseconds\n");
+  printf("\t-loss <percent>\t\tDrop <percent> of the packets\n");
+  printf("\t-latency <ms>\t\tAudio latency target passed to the pipeline\n");
+  #ifdef HAVE_ALSA
+  printf("\t-rw\t\t\tUse regular ALSA writes instead of the mmap buffer\n");
+  #endif
+  exit(0);
+}
+
+int main(int argc, char* argv[]) {
+  char* backend = "sdl";
+  char* device = NULL;
+  bool surround = false;
+  int seconds = 10, jitterMs = 0, lossPercent = 0, latencyMs = 0;
+
+  for (int i = 1; i < argc; i++) {
+    bool value = i + 1 < argc;
+    if (strcmp(argv[i], "-backend") == 0 && value)
+      backend = argv[++i];
+    else if (strcmp(argv[i], "-device") == 0 && value)
+      device = argv[++i];
+    else if (strcmp(argv[i], "-surround") == 0)
+      surround = true;
+    else if (strcmp(argv[i], "-seconds") == 0 && value)
+      seconds = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-jitter") == 0 && value)
+      jitterMs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-loss") == 0 && value)
+      lossPercent = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-latency") == 0 && value)
+      latencyMs = atoi(argv[++i]);
+    #ifdef HAVE_ALSA
+    else if (strcmp(argv[i], "-rw") == 0)
+      alsa_set_rw_access();
+    #endif
+    else
+      help();
+  }
+
+  if (seconds < 1)
+    help();
+
+  if (device == NULL && strcmp(backend, "alsa") == 0)
+    device = "null";
+
+  PAUDIO_RENDERER_CALLBACKS renderer = bench_renderer(backend, device);
+  if (renderer == NULL) {
+    fprintf(stderr, "Audio backend %s isn't available\n", backend);
+    return 1;
+  }
+
+  OPUS_MULTISTREAM_CONFIGURATION opusConfig;
+  bench_opus_config(surround, &opusConfig);
+  if (bench_encode(&opusConfig, lossPercent) < 0)
+    return 1;
+
+  audio_pipeline_set_latency(latencyMs);
+  if (renderer->init(surround ? AUDIO_CONFIGURATION_51_SURROUND : AUDIO_CONFIGURATION_STEREO, &opusConfig, device, 0) != 0) {
+    fprintf(stderr, "Can't initialize %s\n", backend);
+    return 1;
+  }
+
+  int count = seconds * (1000000000LL / BENCH_INTERVAL_NS);
+  long long* callTimes = malloc(count * sizeof(long long));
+  if (callTimes == NULL)
+    return 1;
+
+  int lost = 0, samples = 0;
+  double latencySum = 0, latencyMax = 0;
+  struct rusage usageStart, usageEnd;
+  struct timespec submitStart, submitEnd;
+  getrusage(RUSAGE_SELF, &usageStart);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &submitStart);
+  long long start = bench_now(), deadline = start;
+  for (int i = 0; i < count; i++) {
+    // Jitter only delays a packet, a late one makes the following packets arrive in a burst
+    long long target = start + i * BENCH_INTERVAL_NS;
+    if (jitterMs > 0)
+      target += rand() % (jitterMs * 1000) * 1000LL;
+    if (target > deadline)
+      deadline = target;
+
+    struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+    long long before = bench_now();
+    if (lossPercent > 0 && rand() % 100 < lossPercent) {
+      renderer->decodeAndPlaySample(NULL, 0);
+      lost++;
+    } else
+      renderer->decodeAndPlaySample((char*) packets[i % BENCH_PACKETS], packetLengths[i % BENCH_PACKETS]);
+
+    callTimes[i] = bench_now() - before;
+
+    // Sample the queue every 100 ms once the device has had time to start
+    if (i % 20 == 0 && i >= 200) {
+      AUDIO_PIPELINE_STATS stats;
+      audio_pipeline_get_stats(&stats);
+      latencySum += stats.latencyMs;
+      if (stats.latencyMs > latencyMax)
+        latencyMax = stats.latencyMs;
+      samples++;
+    }
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &submitEnd);
+  long long elapsed = bench_now() - start;
+
+  // The pipeline threads add their CPU time when they end
+  renderer->cleanup();
+  getrusage(RUSAGE_SELF, &usageEnd);
+  AUDIO_PIPELINE_STATS stats;
+  audio_pipeline_get_stats(&stats);
+  #ifdef HAVE_PULSE
+  if (renderer == &audio_callbacks_pulse)
+    audio_pulse_destroy();
+  #endif
+  #ifdef HAVE_PIPEWIRE
+  if (renderer == &audio_callbacks_pipewire)
+    audio_pipewire_destroy();
+  #endif
+
+  long long total = 0;
+  for (int i = 0; i < count; i++)
+    total += callTimes[i];
+  qsort(callTimes, count, sizeof(long long), bench_compare);
+
+  printf("\n%s, %s, %d packets, %d lost, up to %d ms jitter\n", backend, surround ? "5.1" : "stereo", count, lost, jitterMs);
+  printf("Submit per packet: avg %.1f us, median %.1f us, 99%% %.1f us, max %.1f us\n", total / 1000.0 / count, callTimes[count / 2] / 1000.0, callTimes[count * 99 / 100] / 1000.0, callTimes[count - 1] / 1000.0);
+
+  double userMs = bench_ms(&usageEnd.ru_utime) - bench_ms(&usageStart.ru_utime);
+  double systemMs = bench_ms(&usageEnd.ru_stime) - bench_ms(&usageStart.ru_stime);
+  printf("CPU time: %.1f ms user, %.1f ms system, %.2f%% of a core\n", userMs, systemMs, (userMs + systemMs) * 100 / (elapsed / 1000000.0));
+  printf("CPU time of the pipeline threads %.1f ms, of the submitting thread %.1f ms\n", stats.threadCpuMs,
+         (submitEnd.tv_sec - submitStart.tv_sec) * 1000.0 + (submitEnd.tv_nsec - submitStart.tv_nsec) / 1000000.0);
+  printf("Device writes: %u (%.1f per second), %ld voluntary and %ld involuntary context switches\n", stats.deviceWrites, stats.deviceWrites / (elapsed / 1000000000.0),
+         usageEnd.ru_nvcsw - usageStart.ru_nvcsw, usageEnd.ru_nivcsw - usageStart.ru_nivcsw);
+  printf("Xruns: %u, dropped %u packets and %u frames\n", stats.underruns, stats.droppedPackets, stats.droppedFrames);
+  #ifdef HAVE_ALSA
+  if (renderer == &audio_callbacks_alsa) {
+    unsigned int writes, commits, waits;
+    alsa_get_call_counts(&writes, &commits, &waits);
+    printf("Alsa: %u writes, %u mmap commits, %u waits for space\n", writes, commits, waits);
+  }
+  #endif
+  printf("Concealed %u frames, recovered %u frames from FEC\n", stats.concealedFrames, stats.recoveredFrames);
+  if (samples > 0)
+    printf("Queue latency: avg %.1f ms, max %.1f ms\n", latencySum / samples, latencyMax);
+
+  free(callTimes);
+  return 0;
+}
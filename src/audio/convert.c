@@ -0,0 +1,75 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "audio.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Widen to the upper 16 bits, which is exact for any 32 bit or 24-in-32 device
+void convert_s16_to_s32(const short* in, int* out, int samples) {
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= samples; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*) &in[i]);
+    _mm_storeu_si128((__m128i*) &out[i], _mm_unpacklo_epi16(zero, v));
+    _mm_storeu_si128((__m128i*) &out[i + 4], _mm_unpackhi_epi16(zero, v));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= samples; i += 8) {
+    int16x8_t v = vld1q_s16(&in[i]);
+    vst1q_s32(&out[i], vshll_n_s16(vget_low_s16(v), 16));
+    vst1q_s32(&out[i + 4], vshll_n_s16(vget_high_s16(v), 16));
+  }
+#endif
+
+  for (; i < samples; i++)
+    out[i] = (int) ((unsigned int) in[i] << 16);
+}
+
+void convert_s16_to_float(const short* in, float* out, int samples) {
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(1.0f / 32768);
+  for (; i + 8 <= samples; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*) &in[i]);
+    // Sign extend by unpacking into the upper half and shifting back down
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    _mm_storeu_ps(&out[i], _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(&out[i + 4], _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= samples; i += 8) {
+    int16x8_t v = vld1q_s16(&in[i]);
+    // Fixed point conversion with 15 fraction bits does the scaling for free
+    vst1q_f32(&out[i], vcvtq_n_f32_s32(vmovl_s16(vget_low_s16(v)), 15));
+    vst1q_f32(&out[i + 4], vcvtq_n_f32_s32(vmovl_s16(vget_high_s16(v)), 15));
+  }
+#endif
+
+  for (; i < samples; i++)
+    out[i] = in[i] * (1.0f / 32768);
+}
@@ -0,0 +1,89 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "audio.h"
+
+#include <math.h>
+#include <limits.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Downmix from the stream order FL-FR-C-LFE-RL-RR to stereo with the usual
+ * -3 dB for center and surround channels. The LFE channel is left out and
+ * the gains are normalized so a full scale input on all channels can't clip.
+ */
+#define DOWNMIX_NORMALIZE (1 / (1 + 2 * 0.70710678f))
+#define DOWNMIX_FRONT (DOWNMIX_NORMALIZE * 32768)
+#define DOWNMIX_SIDE (0.70710678f * DOWNMIX_NORMALIZE * 32768)
+
+static inline short downmix_clip(float value) {
+  long sample = lrintf(value);
+  return sample > SHRT_MAX ? SHRT_MAX : (sample < SHRT_MIN ? SHRT_MIN : sample);
+}
+
+void downmix_51_to_stereo(const float* in, short* out, int frames) {
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128 front = _mm_set1_ps(DOWNMIX_FRONT);
+  const __m128 side = _mm_set1_ps(DOWNMIX_SIDE);
+
+  // Two frames (12 samples) per iteration, giving L0 R0 L1 R1
+  for (; i + 2 <= frames; i += 2, in += 12, out += 4) {
+    __m128 v0 = _mm_loadu_ps(in);
+    __m128 v1 = _mm_loadu_ps(in + 4);
+    __m128 v2 = _mm_loadu_ps(in + 8);
+
+    __m128 fronts = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 2, 1, 0));
+    __m128 rears = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(3, 2, 1, 0));
+    __m128 centers = _mm_shuffle_ps(v0, v2, _MM_SHUFFLE(0, 0, 2, 2));
+
+    __m128 mix = _mm_add_ps(_mm_mul_ps(fronts, front), _mm_mul_ps(_mm_add_ps(centers, rears), side));
+    __m128i samples = _mm_cvtps_epi32(mix);
+    _mm_storel_epi64((__m128i*) out, _mm_packs_epi32(samples, samples));
+  }
+#elif defined(__ARM_NEON)
+  const float32x4_t front = vdupq_n_f32(DOWNMIX_FRONT);
+  const float32x4_t side = vdupq_n_f32(DOWNMIX_SIDE);
+
+  for (; i + 2 <= frames; i += 2, in += 12, out += 4) {
+    float32x4_t v0 = vld1q_f32(in);
+    float32x4_t v1 = vld1q_f32(in + 4);
+    float32x4_t v2 = vld1q_f32(in + 8);
+
+    float32x4_t fronts = vcombine_f32(vget_low_f32(v0), vget_high_f32(v1));
+    float32x4_t rears = vcombine_f32(vget_low_f32(v1), vget_high_f32(v2));
+    float32x4_t centers = vcombine_f32(vdup_lane_f32(vget_high_f32(v0), 0), vdup_lane_f32(vget_low_f32(v2), 0));
+
+    float32x4_t mix = vmlaq_f32(vmulq_f32(fronts, front), vaddq_f32(centers, rears), side);
+    // Round half away from zero, the conversion itself truncates
+    mix = vaddq_f32(mix, vbslq_f32(vcltq_f32(mix, vdupq_n_f32(0)), vdupq_n_f32(-0.5f), vdupq_n_f32(0.5f)));
+    vst1_s16(out, vqmovn_s32(vcvtq_s32_f32(mix)));
+  }
+#endif
+
+  for (; i < frames; i++, in += 6, out += 2) {
+    out[0] = downmix_clip(in[0] * DOWNMIX_FRONT + (in[2] + in[4]) * DOWNMIX_SIDE);
+    out[1] = downmix_clip(in[1] * DOWNMIX_FRONT + (in[2] + in[5]) * DOWNMIX_SIDE);
+  }
+}
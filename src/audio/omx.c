@@ -21,18 +21,36 @@
 
 #include <stdio.h>
 
-#include <opus_multistream.h>
 #include "bcm_host.h"
 #include "ilclient.h"
 #include "../logging.h"
 
-static OpusMSDecoder* decoder;
 ILCLIENT_T* handle;
 COMPONENT_T* component;
 static OMX_BUFFERHEADERTYPE *buf;
-static short pcmBuffer[FRAME_SIZE * MAX_CHANNEL_COUNT];
 static int channelCount;
 
+static int omx_renderer_write(short* pcm, int frames) {
+  buf = ilclient_get_input_buffer(component, 100, 1);
+  buf->nOffset = 0;
+  buf->nFlags = OMX_BUFFERFLAG_TIME_UNKNOWN;
+
+  int maxFrames = buf->nAllocLen / (sizeof(short) * channelCount);
+  if (frames > maxFrames)
+    frames = maxFrames;
+
+  int bufLength = frames * sizeof(short) * channelCount;
+  memcpy(buf->pBuffer, pcm, bufLength);
+  buf->nFilledLen = bufLength;
+  int r = OMX_EmptyThisBuffer(ilclient_get_handle(component), buf);
+  if (r != OMX_ErrorNone) {
+    _moonlight_log(ERR, "Empty buffer error\n");
+    return -1;
+  }
+
+  return frames;
+}
+
 static int omx_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
   int rc, error;
   OMX_ERRORTYPE err;
@@ -50,8 +68,6 @@ static int omx_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURA
     omxMapping[3] = opusConfig->mapping[2];
   }
 
-  decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, omxMapping, &rc);
-
   handle = ilclient_init();
   if (handle == NULL) {
     _moonlight_log(ERR, "IL client init failed\n");
@@ -152,12 +168,11 @@ static int omx_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURA
     return -1;
   }
 
-  return 0;
+  return audio_pipeline_init(opusConfig, omxMapping, FRAME_SIZE * FRAME_BUFFER, omx_renderer_write, NULL);
 }
 
 static void omx_renderer_cleanup() {
-  if (decoder != NULL)
-    opus_multistream_decoder_destroy(decoder);
+  audio_pipeline_destroy();
   if (handle != NULL) {
     if((buf = ilclient_get_input_buffer(component, 100, 1)) == NULL){
       _moonlight_log(ERR, "Can't get audio buffer\n");
@@ -179,21 +194,7 @@ static void omx_renderer_cleanup() {
 }
 
 static void omx_renderer_decode_and_play_sample(char* data, int length) {
-  int decodeLen = opus_multistream_decode(decoder, data, length, pcmBuffer, FRAME_SIZE, 0);
-  if (decodeLen > 0) {
-    buf = ilclient_get_input_buffer(component, 100, 1);
-    buf->nOffset = 0;
-    buf->nFlags = OMX_BUFFERFLAG_TIME_UNKNOWN;
-    int bufLength = decodeLen * sizeof(short) * channelCount;
-    memcpy(buf->pBuffer, pcmBuffer, bufLength);
-    buf->nFilledLen = bufLength;
-    int r = OMX_EmptyThisBuffer(ilclient_get_handle(component), buf);
-    if (r != OMX_ErrorNone) {
-      _moonlight_log(ERR, "Empty buffer error\n");
-    }
-  } else {
-    _moonlight_log(ERR, "Opus error from decode: %d\n", decodeLen);
-  }
+  audio_pipeline_submit(data, length);
 }
 
 AUDIO_RENDERER_CALLBACKS audio_callbacks_omx = {
@@ -0,0 +1,623 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "audio.h"
+
+#include "../logging.h"
+
+#include <opus_multistream.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#define MAX_PACKET_SIZE 1400
+#define PACKET_SLOTS 16
+// Longer gaps aren't worth rebuilding, concealment degrades to silence anyway
+#define MAX_LOST_FRAMES 4
+
+// Latency controller tuning, 10 ms of error results in a 0.2% rate correction
+#define LATENCY_SMOOTHING 0.05
+#define LATENCY_GAIN_P (0.002 / 10)
+#define LATENCY_GAIN_I (LATENCY_GAIN_P / 20)
+#define MAX_CORRECTION 0.005
+
+/* Audio is split over three threads connected by single producer, single
+ * consumer rings:
+ *   receive thread -> packet ring -> decode thread -> PCM ring -> output thread
+ * The receive thread never decodes or blocks on the device, and the output
+ * thread drains decoded PCM at whatever pace the device accepts it.
+ *
+ * Backends driven by a real-time callback of their own instead pull from the
+ * packet ring and decode into the buffer they are given, without any
+ * pipeline threads.
+ */
+
+struct packet_slot {
+  int length;
+  // Number of frames lost right before this packet
+  int lost;
+  // Local time the packet arrived, in us
+  uint64_t arrival;
+  char data[MAX_PACKET_SIZE];
+};
+
+static struct packet_slot packets[PACKET_SLOTS];
+static uint32_t packetHead, packetTail;
+static sem_t packetSem;
+static int pendingLosses;
+
+static short* pcmRing;
+// Arrival time of the packet decoded into each FRAME_SIZE part of the ring
+static uint64_t* pcmArrival;
+static short* pcmScratch;
+static uint32_t pcmCapacity;
+static uint32_t pcmHead, pcmTail;
+static sem_t pcmSem;
+
+static OpusMSDecoder* decoder;
+static int channelCount;
+// Set when a 5.1 stream has to be mixed down for a stereo device
+static int outputChannels;
+static float* downmixBuffer;
+static int sampleRate;
+static AudioPipelineWrite writeSamples;
+static AudioPipelineDelay deviceDelay;
+static AudioPipelineBegin directBegin;
+static AudioPipelineCommit directCommit;
+
+static int targetLatencyMs;
+static short* resampleBuffer;
+static int resampleCapacity;
+static double smoothedLatencyMs, latencyIntegral;
+static double currentLatencyMs, resampleRatio = 1;
+// Time from the arrival of audio until the device plays it, measured when it's written
+static double playedLatencyMs;
+
+static pthread_t decodeThread, outputThread;
+static bool running, outputStarted, pullMode;
+
+// Decoded frames left over in pcmScratch from the previous pull
+static int pullOffset, pullFrames, pullStep;
+static bool pullStarted;
+// Upper bound on audio queued in pull mode, derived from the latency target
+static uint32_t pullCapFrames;
+
+static uint32_t underruns, droppedPackets, droppedFrames;
+static uint32_t concealedFrames, recoveredFrames;
+static uint32_t deviceWrites;
+static uint64_t threadCpuNs;
+
+static uint64_t audio_pipeline_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The device plays the last frame written after the frames it reports as
+ * delay, which gives the latency of audio as it is actually played. A packet
+ * is taken to have arrived at the end of the audio it carries.
+ */
+static void audio_pipeline_played(uint64_t arrival, int delay) {
+  if (arrival == 0 || delay < 0)
+    return;
+
+  double latency = (double) ((int64_t) audio_pipeline_now() - (int64_t) arrival) / 1000 + (double) delay * 1000 / sampleRate;
+  __atomic_store(&playedLatencyMs, &latency, __ATOMIC_RELAXED);
+}
+
+// Arrival time of the audio ending at frame position end of the ring
+static uint64_t audio_pipeline_ring_arrival(uint32_t end) {
+  uint32_t last = (end - 1) % pcmCapacity;
+  uint64_t arrival = pcmArrival[last / FRAME_SIZE];
+  if (arrival == 0)
+    return 0;
+
+  return arrival - (uint64_t) (FRAME_SIZE - 1 - last % FRAME_SIZE) * 1000000 / sampleRate;
+}
+
+/* Frames lost in front of a packet are rebuilt before the packet itself:
+ * the last one from the forward error correction data carried in the
+ * packet, any earlier ones by Opus packet loss concealment.
+ */
+static int audio_pipeline_opus(struct packet_slot* packet, int step, short* pcm) {
+  unsigned char* data = (unsigned char*) packet->data;
+  int length = packet->length;
+  int fec = 0;
+
+  if (step < packet->lost - 1) {
+    __atomic_fetch_add(&concealedFrames, FRAME_SIZE, __ATOMIC_RELAXED);
+    data = NULL;
+    length = 0;
+  } else if (step == packet->lost - 1) {
+    __atomic_fetch_add(&recoveredFrames, FRAME_SIZE, __ATOMIC_RELAXED);
+    fec = 1;
+  }
+
+  if (downmixBuffer == NULL)
+    return opus_multistream_decode(decoder, data, length, pcm, FRAME_SIZE, fec);
+
+  // Decode to float so the mix is done at full precision and clipped only once
+  int decodeLen = opus_multistream_decode_float(decoder, data, length, downmixBuffer, FRAME_SIZE, fec);
+  if (decodeLen > 0)
+    downmix_51_to_stereo(downmixBuffer, pcm, decodeLen);
+
+  return decodeLen;
+}
+
+// Decode into the area lent by the device, splitting the frame when it crosses the end of the device buffer
+static int audio_pipeline_decode_direct(struct packet_slot* packet, int step) {
+  int frames;
+  short* area = directBegin(&frames);
+  if (area == NULL)
+    return 0;
+
+  if (frames >= FRAME_SIZE) {
+    int decodeLen = audio_pipeline_opus(packet, step, area);
+    if (decodeLen > 0) {
+      __atomic_fetch_add(&deviceWrites, 1, __ATOMIC_RELAXED);
+      if (directCommit(decodeLen) < 0)
+        return 0;
+    }
+
+    return decodeLen;
+  }
+
+  int decodeLen = audio_pipeline_opus(packet, step, pcmScratch);
+  for (int copied = 0; copied < decodeLen; copied += frames) {
+    if (copied > 0 && (area = directBegin(&frames)) == NULL)
+      return 0;
+
+    if (frames > decodeLen - copied)
+      frames = decodeLen - copied;
+
+    memcpy(area, &pcmScratch[copied * channelCount], frames * channelCount * sizeof(short));
+    __atomic_fetch_add(&deviceWrites, 1, __ATOMIC_RELAXED);
+    if (directCommit(frames) < 0)
+      return 0;
+  }
+  return decodeLen;
+}
+
+static int audio_pipeline_decode_ring(struct packet_slot* packet, int step) {
+  uint32_t head = pcmHead;
+  uint32_t used = head - __atomic_load_n(&pcmTail, __ATOMIC_ACQUIRE);
+  if (pcmCapacity - used < FRAME_SIZE)
+    return 0;
+
+  // Decode straight into the ring unless the frame would wrap around its end
+  uint32_t offset = head % pcmCapacity;
+  bool direct = pcmCapacity - offset >= FRAME_SIZE;
+  short* target = direct ? &pcmRing[offset * channelCount] : pcmScratch;
+  int decodeLen = audio_pipeline_opus(packet, step, target);
+  if (decodeLen <= 0)
+    return decodeLen;
+
+  if (!direct) {
+    uint32_t first = pcmCapacity - offset;
+    if (first > decodeLen)
+      first = decodeLen;
+
+    memcpy(&pcmRing[offset * channelCount], pcmScratch, first * channelCount * sizeof(short));
+    memcpy(pcmRing, &pcmScratch[first * channelCount], (decodeLen - first) * channelCount * sizeof(short));
+  }
+
+  pcmArrival[offset / FRAME_SIZE] = packet->arrival;
+  __atomic_store_n(&pcmHead, head + decodeLen, __ATOMIC_RELEASE);
+  sem_post(&pcmSem);
+  return decodeLen;
+}
+
+// Publish the output latency for statistics and A/V sync, arrival is the one of the last frame written
+static void audio_pipeline_measure(uint32_t queued, uint64_t arrival) {
+  if (deviceDelay == NULL)
+    return;
+
+  int delay = deviceDelay();
+  if (delay < 0)
+    return;
+
+  double latency = (double) (delay + queued) * 1000 / sampleRate;
+  __atomic_store(&currentLatencyMs, &latency, __ATOMIC_RELAXED);
+  audio_pipeline_played(arrival, delay);
+}
+
+// Called by the pipeline threads when they end
+static void audio_pipeline_account_cpu() {
+  struct timespec cpu;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0)
+    __atomic_fetch_add(&threadCpuNs, cpu.tv_sec * 1000000000ULL + cpu.tv_nsec, __ATOMIC_RELAXED);
+}
+
+static void* audio_pipeline_decode_thread(void* data) {
+  while (sem_wait(&packetSem) == 0 && __atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    uint32_t tail = packetTail;
+    if (tail == __atomic_load_n(&packetHead, __ATOMIC_ACQUIRE))
+      continue;
+
+    struct packet_slot* packet = &packets[tail % PACKET_SLOTS];
+    uint64_t arrival = packet->arrival;
+    for (int step = 0; step <= packet->lost; step++) {
+      int decodeLen = outputStarted ? audio_pipeline_decode_ring(packet, step) : audio_pipeline_decode_direct(packet, step);
+      if (decodeLen < 0)
+        _moonlight_log(ERR, "Opus error from decode: %d\n", decodeLen);
+      else if (decodeLen == 0)
+        __atomic_fetch_add(&droppedFrames, FRAME_SIZE, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&packetTail, tail + 1, __ATOMIC_RELEASE);
+
+    if (!outputStarted)
+      audio_pipeline_measure(0, arrival);
+  }
+
+  audio_pipeline_account_cpu();
+  return NULL;
+}
+
+static int audio_pipeline_write(short* pcm, int frames) {
+  int total = 0;
+  while (total < frames) {
+    __atomic_fetch_add(&deviceWrites, 1, __ATOMIC_RELAXED);
+    int written = writeSamples(&pcm[total * channelCount], frames - total);
+    if (written < 0)
+      return written;
+
+    total += written;
+  }
+  return total;
+}
+
+// Estimate the end-to-end latency and steer the resampling ratio towards the target
+static double audio_pipeline_update_ratio(uint32_t queued, int frames, uint64_t arrival) {
+  int delay = deviceDelay();
+  if (delay < 0)
+    return resampleRatio;
+
+  // The frames about to be written play after the ones already queued
+  audio_pipeline_played(arrival, delay + frames);
+
+  double latency = (double) (delay + queued) * 1000 / sampleRate;
+  if (smoothedLatencyMs == 0)
+    smoothedLatencyMs = latency;
+  else
+    smoothedLatencyMs += (latency - smoothedLatencyMs) * LATENCY_SMOOTHING;
+
+  double error = smoothedLatencyMs - targetLatencyMs;
+  double seconds = (double) frames / sampleRate;
+  latencyIntegral += error * seconds;
+
+  // Prevent windup when the target can't be reached with the maximum correction
+  if (fabs(latencyIntegral * LATENCY_GAIN_I) > MAX_CORRECTION)
+    latencyIntegral = copysign(MAX_CORRECTION / LATENCY_GAIN_I, latencyIntegral);
+
+  double correction = error * LATENCY_GAIN_P + latencyIntegral * LATENCY_GAIN_I;
+  if (correction > MAX_CORRECTION)
+    correction = MAX_CORRECTION;
+  else if (correction < -MAX_CORRECTION)
+    correction = -MAX_CORRECTION;
+
+  double ratio = 1 + correction;
+  __atomic_store(&currentLatencyMs, &latency, __ATOMIC_RELAXED);
+  __atomic_store(&resampleRatio, &ratio, __ATOMIC_RELAXED);
+  return ratio;
+}
+
+static void* audio_pipeline_output_thread(void* data) {
+  while (sem_wait(&pcmSem) == 0 && __atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    uint32_t tail = pcmTail;
+    uint32_t available = __atomic_load_n(&pcmHead, __ATOMIC_ACQUIRE) - tail;
+    while (available > 0) {
+      uint32_t offset = tail % pcmCapacity;
+      uint32_t frames = pcmCapacity - offset;
+      if (frames > available)
+        frames = available;
+
+      int written;
+      if (resampleBuffer != NULL) {
+        if (frames > FRAME_SIZE)
+          frames = FRAME_SIZE;
+
+        double ratio = audio_pipeline_update_ratio(available, frames, audio_pipeline_ring_arrival(tail + frames));
+        int resampled = resampler_process(&pcmRing[offset * channelCount], frames, resampleBuffer, resampleCapacity, ratio);
+        written = audio_pipeline_write(resampleBuffer, resampled) < 0 ? -1 : frames;
+      } else {
+        __atomic_fetch_add(&deviceWrites, 1, __ATOMIC_RELAXED);
+        written = writeSamples(&pcmRing[offset * channelCount], frames);
+        if (written >= 0)
+          audio_pipeline_measure(available - written, written > 0 ? audio_pipeline_ring_arrival(tail + written) : 0);
+      }
+
+      if (written < 0)
+        break;
+
+      tail += written;
+      available -= written;
+      __atomic_store_n(&pcmTail, tail, __ATOMIC_RELEASE);
+    }
+  }
+
+  audio_pipeline_account_cpu();
+  return NULL;
+}
+
+void audio_pipeline_set_latency(int latencyMs) {
+  targetLatencyMs = latencyMs;
+}
+
+void audio_pipeline_set_output_channels(int channels) {
+  outputChannels = channels;
+}
+
+void audio_pipeline_set_direct(AudioPipelineBegin begin, AudioPipelineCommit commit) {
+  directBegin = begin;
+  directCommit = commit;
+}
+
+int audio_pipeline_pull(short* pcm, int frames) {
+  int filled = 0;
+  __atomic_fetch_add(&deviceWrites, 1, __ATOMIC_RELAXED);
+
+  // After a stall, skip the oldest packets instead of letting the backlog become permanent latency
+  uint32_t head = __atomic_load_n(&packetHead, __ATOMIC_ACQUIRE);
+  if (pullCapFrames > 0) {
+    uint32_t tail = packetTail;
+    while (tail != head && (head - tail) * FRAME_SIZE + pullFrames > pullCapFrames + frames) {
+      __atomic_fetch_add(&droppedFrames, FRAME_SIZE, __ATOMIC_RELAXED);
+      pullStep = 0;
+      tail++;
+    }
+    __atomic_store_n(&packetTail, tail, __ATOMIC_RELEASE);
+  }
+
+  while (filled < frames) {
+    if (pullFrames > 0) {
+      int count = pullFrames < frames - filled ? pullFrames : frames - filled;
+      memcpy(&pcm[filled * channelCount], &pcmScratch[pullOffset * channelCount], count * channelCount * sizeof(short));
+      pullOffset += count;
+      pullFrames -= count;
+      filled += count;
+      continue;
+    }
+
+    uint32_t tail = packetTail;
+    if (tail == __atomic_load_n(&packetHead, __ATOMIC_ACQUIRE))
+      break;
+
+    // Decode into the caller's buffer while a whole frame still fits
+    struct packet_slot* packet = &packets[tail % PACKET_SLOTS];
+    bool direct = frames - filled >= FRAME_SIZE;
+    short* target = direct ? &pcm[filled * channelCount] : pcmScratch;
+    int decodeLen = audio_pipeline_opus(packet, pullStep, target);
+    if (pullStep < packet->lost)
+      pullStep++;
+    else {
+      pullStep = 0;
+      __atomic_store_n(&packetTail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    // Called from a real-time thread, so errors are counted instead of logged
+    if (decodeLen <= 0)
+      __atomic_fetch_add(&droppedFrames, FRAME_SIZE, __ATOMIC_RELAXED);
+    else if (direct)
+      filled += decodeLen;
+    else {
+      pullOffset = 0;
+      pullFrames = decodeLen;
+    }
+  }
+
+  if (filled < frames) {
+    memset(&pcm[filled * channelCount], 0, (frames - filled) * channelCount * sizeof(short));
+    if (pullStarted)
+      __atomic_fetch_add(&underruns, 1, __ATOMIC_RELAXED);
+  }
+
+  if (filled > 0)
+    pullStarted = true;
+
+  uint32_t packetsQueued = __atomic_load_n(&packetHead, __ATOMIC_ACQUIRE) - packetTail;
+  double queued = (double) (packetsQueued * FRAME_SIZE + pullFrames) * 1000 / sampleRate;
+  __atomic_store(&currentLatencyMs, &queued, __ATOMIC_RELAXED);
+  return filled;
+}
+
+int audio_pipeline_init(POPUS_MULTISTREAM_CONFIGURATION opusConfig, const unsigned char* mapping, int bufferFrames, AudioPipelineWrite write, AudioPipelineDelay delay) {
+  int rc;
+  bool downmix = opusConfig->channelCount == 6 && outputChannels == 2;
+
+  // The downmix works on the stream's own channel order, the backend's mapping is for 5.1 output only
+  decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, downmix ? opusConfig->mapping : mapping, &rc);
+  if (decoder == NULL) {
+    _moonlight_log(ERR, "Opus error creating decoder: %d\n", rc);
+    return -1;
+  }
+
+  channelCount = downmix ? 2 : opusConfig->channelCount;
+  if (downmix) {
+    downmixBuffer = malloc(FRAME_SIZE * opusConfig->channelCount * sizeof(float));
+    if (downmixBuffer == NULL) {
+      _moonlight_log(ERR, "Not enough memory\n");
+      return -1;
+    }
+    _moonlight_log(INFO, "Mixing 5.1 surround down to stereo\n");
+  }
+  sampleRate = opusConfig->sampleRate;
+  writeSamples = write;
+  deviceDelay = delay;
+
+  // Round up to whole Opus frames so a decode never has to be split in the common case
+  pcmCapacity = ((bufferFrames + FRAME_SIZE - 1) / FRAME_SIZE) * FRAME_SIZE;
+  pcmRing = malloc(pcmCapacity * channelCount * sizeof(short));
+  pcmArrival = calloc(pcmCapacity / FRAME_SIZE, sizeof(uint64_t));
+  pcmScratch = malloc(FRAME_SIZE * channelCount * sizeof(short));
+  if (pcmRing == NULL || pcmArrival == NULL || pcmScratch == NULL) {
+    _moonlight_log(ERR, "Not enough memory\n");
+    return -1;
+  }
+
+  smoothedLatencyMs = latencyIntegral = currentLatencyMs = playedLatencyMs = 0;
+  resampleRatio = 1;
+  pullMode = write == NULL && directBegin == NULL;
+  if (targetLatencyMs > 0 && deviceDelay != NULL && !pullMode) {
+    resampleCapacity = FRAME_SIZE * (1 + MAX_CORRECTION) + 2;
+    resampleBuffer = malloc(resampleCapacity * channelCount * sizeof(short));
+    if (resampleBuffer == NULL || resampler_init(channelCount, FRAME_SIZE) < 0) {
+      _moonlight_log(ERR, "Not enough memory\n");
+      return -1;
+    }
+  }
+
+  packetHead = packetTail = 0;
+  pcmHead = pcmTail = 0;
+  pullOffset = pullFrames = pullStep = 0;
+  pullStarted = false;
+  underruns = droppedPackets = droppedFrames = 0;
+  concealedFrames = recoveredFrames = 0;
+  deviceWrites = 0;
+  threadCpuNs = 0;
+  pendingLosses = 0;
+
+  sem_init(&packetSem, 0, 0);
+  sem_init(&pcmSem, 0, 0);
+
+  running = true;
+  if (pullMode) {
+    pullCapFrames = targetLatencyMs * sampleRate / 1000;
+    return 0;
+  }
+
+  /* With a zero-copy device the decode thread writes into the device buffer
+   * itself and the output thread is not needed. Resampling still requires a
+   * separate output stage.
+   */
+  outputStarted = directBegin == NULL || resampleBuffer != NULL;
+
+  if (pthread_create(&decodeThread, NULL, audio_pipeline_decode_thread, NULL) != 0) {
+    _moonlight_log(ERR, "Can't create audio threads\n");
+    return -1;
+  }
+
+  if (outputStarted && pthread_create(&outputThread, NULL, audio_pipeline_output_thread, NULL) != 0) {
+    _moonlight_log(ERR, "Can't create audio threads\n");
+    outputStarted = false;
+    return -1;
+  }
+
+  return 0;
+}
+
+void audio_pipeline_submit(char* data, int length) {
+  // A missing packet is reported without data, it is rebuilt when the next packet arrives
+  if (data == NULL || length == 0) {
+    if (pendingLosses < MAX_LOST_FRAMES)
+      pendingLosses++;
+
+    return;
+  }
+
+  uint32_t head = packetHead;
+  if (length > MAX_PACKET_SIZE || head - __atomic_load_n(&packetTail, __ATOMIC_ACQUIRE) >= PACKET_SLOTS) {
+    __atomic_fetch_add(&droppedPackets, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  struct packet_slot* packet = &packets[head % PACKET_SLOTS];
+  memcpy(packet->data, data, length);
+  packet->length = length;
+  packet->lost = pendingLosses;
+  packet->arrival = audio_pipeline_now();
+  pendingLosses = 0;
+
+  __atomic_store_n(&packetHead, head + 1, __ATOMIC_RELEASE);
+  if (!pullMode)
+    sem_post(&packetSem);
+}
+
+void audio_pipeline_underrun() {
+  __atomic_fetch_add(&underruns, 1, __ATOMIC_RELAXED);
+}
+
+void audio_pipeline_get_stats(PAUDIO_PIPELINE_STATS stats) {
+  stats->packetQueueDepth = __atomic_load_n(&packetHead, __ATOMIC_ACQUIRE) - __atomic_load_n(&packetTail, __ATOMIC_ACQUIRE);
+  stats->pcmQueueFrames = __atomic_load_n(&pcmHead, __ATOMIC_ACQUIRE) - __atomic_load_n(&pcmTail, __ATOMIC_ACQUIRE);
+  stats->underruns = __atomic_load_n(&underruns, __ATOMIC_RELAXED);
+  stats->droppedPackets = __atomic_load_n(&droppedPackets, __ATOMIC_RELAXED);
+  stats->droppedFrames = __atomic_load_n(&droppedFrames, __ATOMIC_RELAXED);
+  stats->concealedFrames = __atomic_load_n(&concealedFrames, __ATOMIC_RELAXED);
+  stats->recoveredFrames = __atomic_load_n(&recoveredFrames, __ATOMIC_RELAXED);
+  stats->deviceWrites = __atomic_load_n(&deviceWrites, __ATOMIC_RELAXED);
+  stats->threadCpuMs = __atomic_load_n(&threadCpuNs, __ATOMIC_RELAXED) / 1000000.0;
+  __atomic_load(&currentLatencyMs, &stats->latencyMs, __ATOMIC_RELAXED);
+  __atomic_load(&playedLatencyMs, &stats->playedLatencyMs, __ATOMIC_RELAXED);
+  __atomic_load(&resampleRatio, &stats->resampleRatio, __ATOMIC_RELAXED);
+}
+
+void audio_pipeline_destroy() {
+  if (__atomic_exchange_n(&running, false, __ATOMIC_ACQ_REL)) {
+    if (!pullMode) {
+      sem_post(&packetSem);
+      sem_post(&pcmSem);
+      pthread_join(decodeThread, NULL);
+      if (outputStarted)
+        pthread_join(outputThread, NULL);
+    }
+    sem_destroy(&packetSem);
+    sem_destroy(&pcmSem);
+
+    AUDIO_PIPELINE_STATS stats;
+    audio_pipeline_get_stats(&stats);
+    _moonlight_log(INFO, "Audio: %u underruns, %u packets and %u frames dropped\n", stats.underruns, stats.droppedPackets, stats.droppedFrames);
+    _moonlight_log(INFO, "Audio: %u frames concealed, %u frames recovered from FEC\n", stats.concealedFrames, stats.recoveredFrames);
+    if (!pullMode)
+      _moonlight_log(INFO, "Audio: %u device writes, %.1f ms CPU time in the pipeline threads\n", stats.deviceWrites, stats.threadCpuMs);
+    if (resampleBuffer != NULL)
+      _moonlight_log(INFO, "Audio: latency %.1f ms (target %d ms), correction ratio %.5f\n", stats.latencyMs, targetLatencyMs, stats.resampleRatio);
+    else if (pullMode)
+      _moonlight_log(INFO, "Audio: %.1f ms queued (limit %d ms)\n", stats.latencyMs, targetLatencyMs);
+  }
+
+  directBegin = NULL;
+  directCommit = NULL;
+  outputChannels = 0;
+
+  free(downmixBuffer);
+  downmixBuffer = NULL;
+
+  if (resampleBuffer != NULL) {
+    resampler_destroy();
+    free(resampleBuffer);
+    resampleBuffer = NULL;
+  }
+
+  if (decoder != NULL) {
+    opus_multistream_decoder_destroy(decoder);
+    decoder = NULL;
+  }
+
+  free(pcmRing);
+  free(pcmArrival);
+  free(pcmScratch);
+  pcmRing = pcmScratch = NULL;
+  pcmArrival = NULL;
+}
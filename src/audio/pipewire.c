@@ -0,0 +1,246 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "audio.h"
+
+#include "../logging.h"
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+
+static struct pw_thread_loop* loop;
+static struct pw_context* pwContext;
+static struct pw_core* core;
+static struct pw_stream* stream;
+static struct spa_hook streamListener;
+static struct spa_hook coreListener;
+static bool coreFailed;
+
+static int quantum = FRAME_SIZE;
+static size_t frameBytes;
+
+void pipewire_set_quantum(int frames) {
+  if (frames > 0)
+    quantum = frames;
+}
+
+// Runs on the PipeWire data thread, Opus decodes straight into the dequeued buffer
+static void pipewire_process(void* data) {
+  struct pw_buffer* buffer = pw_stream_dequeue_buffer(stream);
+  if (buffer == NULL)
+    return;
+
+  struct spa_data* d = &buffer->buffer->datas[0];
+  if (d->data == NULL) {
+    pw_stream_queue_buffer(stream, buffer);
+    return;
+  }
+
+  uint32_t frames = d->maxsize / frameBytes;
+  if (buffer->requested > 0 && buffer->requested < frames)
+    frames = buffer->requested;
+
+  audio_pipeline_pull(d->data, frames);
+
+  d->chunk->offset = 0;
+  d->chunk->stride = frameBytes;
+  d->chunk->size = frames * frameBytes;
+  pw_stream_queue_buffer(stream, buffer);
+}
+
+static void pipewire_state_changed(void* data, enum pw_stream_state old, enum pw_stream_state state, const char* error) {
+  if (state == PW_STREAM_STATE_ERROR)
+    _moonlight_log(ERR, "PipeWire stream error: %s\n", error);
+}
+
+static const struct pw_stream_events stream_events = {
+  PW_VERSION_STREAM_EVENTS,
+  .state_changed = pipewire_state_changed,
+  .process = pipewire_process,
+};
+
+static void pipewire_core_error(void* data, uint32_t id, int seq, int res, const char* message) {
+  // The daemon went away, the next stream needs a new connection
+  if (id == PW_ID_CORE && res == -EPIPE)
+    coreFailed = true;
+}
+
+static const struct pw_core_events core_events = {
+  PW_VERSION_CORE_EVENTS,
+  .error = pipewire_core_error,
+};
+
+static void pipewire_disconnect() {
+  if (loop != NULL)
+    pw_thread_loop_stop(loop);
+
+  if (core != NULL) {
+    spa_hook_remove(&coreListener);
+    pw_core_disconnect(core);
+    core = NULL;
+  }
+
+  if (pwContext != NULL) {
+    pw_context_destroy(pwContext);
+    pwContext = NULL;
+  }
+
+  if (loop != NULL) {
+    pw_thread_loop_destroy(loop);
+    loop = NULL;
+  }
+
+  pw_deinit();
+}
+
+// Connecting to the daemon socket fails right away when no PipeWire daemon is running
+bool audio_pipewire_init(char* audio_device) {
+  if (loop != NULL) {
+    if (!coreFailed)
+      return true;
+
+    pipewire_disconnect();
+  }
+
+  pw_init(NULL, NULL);
+
+  loop = pw_thread_loop_new("moonlight-audio", NULL);
+  if (loop == NULL) {
+    pipewire_disconnect();
+    return false;
+  }
+
+  pwContext = pw_context_new(pw_thread_loop_get_loop(loop), NULL, 0);
+  if (pwContext == NULL || pw_thread_loop_start(loop) < 0) {
+    pipewire_disconnect();
+    return false;
+  }
+
+  pw_thread_loop_lock(loop);
+  core = pw_context_connect(pwContext, NULL, 0);
+  coreFailed = false;
+  if (core != NULL)
+    pw_core_add_listener(core, &coreListener, &core_events, NULL);
+  pw_thread_loop_unlock(loop);
+
+  if (core == NULL) {
+    pipewire_disconnect();
+    return false;
+  }
+
+  return true;
+}
+
+static int pipewire_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
+  unsigned char alsaMapping[MAX_CHANNEL_COUNT];
+
+  /* The supplied mapping array has order: FL-FR-C-LFE-RL-RR
+   * The stream is set up with the ALSA order: FL-FR-RL-RR-C-LFE
+   * We need copy the mapping locally and swap the channels around.
+   */
+  alsaMapping[0] = opusConfig->mapping[0];
+  alsaMapping[1] = opusConfig->mapping[1];
+  if (opusConfig->channelCount == 6) {
+    alsaMapping[2] = opusConfig->mapping[4];
+    alsaMapping[3] = opusConfig->mapping[5];
+    alsaMapping[4] = opusConfig->mapping[2];
+    alsaMapping[5] = opusConfig->mapping[3];
+  }
+
+  frameBytes = sizeof(short) * opusConfig->channelCount;
+
+  // Decoding happens in the process callback, so the pipeline has to be ready before the stream connects
+  if (audio_pipeline_init(opusConfig, alsaMapping, FRAME_SIZE, NULL, NULL) < 0)
+    return -1;
+
+  char latency[32];
+  snprintf(latency, sizeof(latency), "%d/%d", quantum, opusConfig->sampleRate);
+
+  struct pw_properties* props = pw_properties_new(
+    PW_KEY_MEDIA_TYPE, "Audio",
+    PW_KEY_MEDIA_CATEGORY, "Playback",
+    PW_KEY_MEDIA_ROLE, "Game",
+    PW_KEY_NODE_LATENCY, latency,
+    NULL);
+
+  char* audio_device = (char*) context;
+  if (audio_device != NULL)
+    pw_properties_set(props, PW_KEY_TARGET_OBJECT, audio_device);
+
+  struct spa_audio_info_raw info = {
+    .format = SPA_AUDIO_FORMAT_S16,
+    .rate = opusConfig->sampleRate,
+    .channels = opusConfig->channelCount,
+    .position = { SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR, SPA_AUDIO_CHANNEL_RL, SPA_AUDIO_CHANNEL_RR, SPA_AUDIO_CHANNEL_FC, SPA_AUDIO_CHANNEL_LFE },
+  };
+
+  uint8_t buffer[1024];
+  struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+  const struct spa_pod* params[1];
+  params[0] = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info);
+
+  pw_thread_loop_lock(loop);
+  stream = pw_stream_new(core, "Moonlight Embedded", props);
+  int rc = -1;
+  if (stream != NULL) {
+    pw_stream_add_listener(stream, &streamListener, &stream_events, NULL);
+    rc = pw_stream_connect(stream, PW_DIRECTION_OUTPUT, PW_ID_ANY, PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS, params, 1);
+  }
+  pw_thread_loop_unlock(loop);
+
+  if (rc < 0) {
+    _moonlight_log(ERR, "Can't create PipeWire stream: %d\n", rc);
+    return -1;
+  }
+
+  _moonlight_log(INFO, "PipeWire stream with a quantum of %s\n", latency);
+  return 0;
+}
+
+static void pipewire_renderer_decode_and_play_sample(char* data, int length) {
+  audio_pipeline_submit(data, length);
+}
+
+static void pipewire_renderer_cleanup() {
+  if (stream != NULL) {
+    pw_thread_loop_lock(loop);
+    pw_stream_destroy(stream);
+    stream = NULL;
+    pw_thread_loop_unlock(loop);
+  }
+
+  // The process callback doesn't run anymore once the stream is gone
+  audio_pipeline_destroy();
+}
+
+// The daemon connection outlives the streams, a restarted connection only creates a new stream
+void audio_pipewire_destroy() {
+  if (loop != NULL)
+    pipewire_disconnect();
+}
+
+AUDIO_RENDERER_CALLBACKS audio_callbacks_pipewire = {
+  .init = pipewire_renderer_init,
+  .cleanup = pipewire_renderer_cleanup,
+  .decodeAndPlaySample = pipewire_renderer_decode_and_play_sample,
+  .capabilities = CAPABILITY_DIRECT_SUBMIT,
+};
@@ -19,39 +19,214 @@
 
 #include "audio.h"
 
+#include "../logging.h"
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <pulse/pulseaudio.h>
 
-#include <opus_multistream.h>
-#include <pulse/simple.h>
-#include <pulse/error.h>
+// Latency requested from the server, and the amount it may ask for at once (one Opus frame)
+#define PULSE_LATENCY_USEC 20000
+#define PULSE_REQUEST_USEC 5000
 
-static OpusMSDecoder* decoder;
-static pa_simple *dev = NULL;
-static short pcmBuffer[FRAME_SIZE * MAX_CHANNEL_COUNT];
+static pa_threaded_mainloop *mainloop = NULL;
+static pa_context *pulseContext = NULL;
+static pa_stream *stream = NULL;
 static int channelCount;
+static int sampleRate;
+static size_t frameBytes;
+static size_t requestBytes;
+static void* writeBuffer;
+
+static void pulse_context_state(pa_context *c, void *userdata) {
+  pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void pulse_stream_state(pa_stream *s, void *userdata) {
+  pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void pulse_stream_request(pa_stream *s, size_t nbytes, void *userdata) {
+  pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void pulse_stream_underflow(pa_stream *s, void *userdata) {
+  audio_pipeline_underrun();
+}
 
+static void pulse_sink_info(pa_context *c, const pa_sink_info *info, int eol, void *userdata) {
+  if (eol == 0 && info != NULL)
+    *(int*) userdata = info->channel_map.channels;
+
+  pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+// Channel count of the sink, or 0 when it can't be determined
+static int pulse_sink_channels(const char* sink) {
+  int channels = 0;
+  pa_threaded_mainloop_lock(mainloop);
+  pa_operation* op = pa_context_get_sink_info_by_name(pulseContext, sink != NULL ? sink : "@DEFAULT_SINK@", pulse_sink_info, &channels);
+  if (op != NULL) {
+    while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
+      pa_threaded_mainloop_wait(mainloop);
+    pa_operation_unref(op);
+  }
+  pa_threaded_mainloop_unlock(mainloop);
+  return channels;
+}
+
+static void pulse_disconnect() {
+  if (mainloop != NULL)
+    pa_threaded_mainloop_stop(mainloop);
+
+  if (pulseContext != NULL) {
+    pa_context_disconnect(pulseContext);
+    pa_context_unref(pulseContext);
+    pulseContext = NULL;
+  }
+
+  if (mainloop != NULL) {
+    pa_threaded_mainloop_free(mainloop);
+    mainloop = NULL;
+  }
+}
+
+/* Connect to the server and keep the context for the stream. Checking the
+ * context state is enough to know the server is reachable, no test stream
+ * needs to be created. The audio device names the server, the stream plays
+ * on the default sink or the one set by PULSE_SINK. A context that is still
+ * connected is reused for the next stream.
+ */
 bool audio_pulse_init(char* audio_device) {
-  pa_sample_spec spec = {
-    .format = PA_SAMPLE_S16LE,
-    .rate = 44000,
-    .channels = 2
-  };
+  if (mainloop != NULL) {
+    pa_threaded_mainloop_lock(mainloop);
+    bool ready = pa_context_get_state(pulseContext) == PA_CONTEXT_READY;
+    pa_threaded_mainloop_unlock(mainloop);
+    if (ready)
+      return true;
+
+    pulse_disconnect();
+  }
+
+  mainloop = pa_threaded_mainloop_new();
+  if (mainloop == NULL)
+    return false;
+
+  pulseContext = pa_context_new(pa_threaded_mainloop_get_api(mainloop), "Moonlight Embedded");
+  if (pulseContext == NULL) {
+    pulse_disconnect();
+    return false;
+  }
+
+  pa_context_set_state_callback(pulseContext, pulse_context_state, NULL);
+  if (pa_context_connect(pulseContext, audio_device, PA_CONTEXT_NOAUTOSPAWN, NULL) < 0 || pa_threaded_mainloop_start(mainloop) < 0) {
+    pulse_disconnect();
+    return false;
+  }
+
+  pa_threaded_mainloop_lock(mainloop);
+  pa_context_state_t state;
+  while ((state = pa_context_get_state(pulseContext)) != PA_CONTEXT_READY && PA_CONTEXT_IS_GOOD(state))
+    pa_threaded_mainloop_wait(mainloop);
+  pa_threaded_mainloop_unlock(mainloop);
+
+  if (state != PA_CONTEXT_READY) {
+    pulse_disconnect();
+    return false;
+  }
+
+  return true;
+}
+
+// Wait for the server to request at least a whole Opus frame, called with the mainloop locked
+static size_t pulse_wait_writable() {
+  size_t writable;
+  while ((writable = pa_stream_writable_size(stream)) < requestBytes) {
+    if (pa_stream_get_state(stream) != PA_STREAM_READY)
+      return 0;
 
-  int error;
-  dev = pa_simple_new(audio_device, "Moonlight Embedded", PA_STREAM_PLAYBACK, NULL, "Streaming", &spec, NULL, NULL, &error);
+    pa_threaded_mainloop_wait(mainloop);
+  }
+  return writable;
+}
+
+static short* pulse_renderer_begin(int* frames) {
+  void* data = NULL;
+  pa_threaded_mainloop_lock(mainloop);
+  size_t nbytes = pulse_wait_writable();
+  if (nbytes > 0 && pa_stream_begin_write(stream, &data, &nbytes) < 0)
+    data = NULL;
+  pa_threaded_mainloop_unlock(mainloop);
+
+  writeBuffer = data;
+  if (data == NULL) {
+    _moonlight_log(ERR, "Pulseaudio error: %s\n", pa_strerror(pa_context_errno(pulseContext)));
+    return NULL;
+  }
+
+  *frames = nbytes / frameBytes;
+  return data;
+}
+
+static int pulse_renderer_commit(int frames) {
+  // Writing the buffer handed out by pa_stream_begin_write passes it on without a copy
+  pa_threaded_mainloop_lock(mainloop);
+  int rc = pa_stream_write(stream, writeBuffer, frames * frameBytes, NULL, 0, PA_SEEK_RELATIVE);
+  pa_threaded_mainloop_unlock(mainloop);
+
+  if (rc < 0) {
+    _moonlight_log(ERR, "Pulseaudio error: %s\n", pa_strerror(pa_context_errno(pulseContext)));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int pulse_renderer_write(short* pcm, int frames) {
+  int available;
+  short* data = pulse_renderer_begin(&available);
+  if (data == NULL)
+    return -1;
+
+  if (frames > available)
+    frames = available;
 
-  if (dev)
-    pa_simple_free(dev);
+  memcpy(data, pcm, frames * frameBytes);
+  if (pulse_renderer_commit(frames) < 0)
+    return -1;
 
-  return (bool) dev;
+  return frames;
+}
+
+static int pulse_renderer_delay() {
+  pa_usec_t latency;
+  int negative;
+
+  pa_threaded_mainloop_lock(mainloop);
+  int rc = pa_stream_get_latency(stream, &latency, &negative);
+  pa_threaded_mainloop_unlock(mainloop);
+
+  if (rc < 0 || negative)
+    return -1;
+
+  return latency * sampleRate / 1000000;
 }
 
 static int pulse_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
-  int rc, error;
   unsigned char alsaMapping[MAX_CHANNEL_COUNT];
 
   channelCount = opusConfig->channelCount;
+  sampleRate = opusConfig->sampleRate;
+
+  // Let a stereo sink get a proper stereo mix instead of the server's remapping
+  char* sink = getenv("PULSE_SINK");
+  if (channelCount == 6 && pulse_sink_channels(sink) == 2) {
+    channelCount = 2;
+    audio_pipeline_set_output_channels(channelCount);
+  }
+  frameBytes = sizeof(short) * channelCount;
 
   /* The supplied mapping array has order: FL-FR-C-LFE-RL-RR
    * ALSA expects the order: FL-FR-RL-RR-C-LFE
@@ -66,40 +241,77 @@ static int pulse_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGU
     alsaMapping[5] = opusConfig->mapping[3];
   }
 
-  decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, alsaMapping, &rc);
-
   pa_sample_spec spec = {
     .format = PA_SAMPLE_S16LE,
     .rate = opusConfig->sampleRate,
-    .channels = opusConfig->channelCount
+    .channels = channelCount
   };
 
-  char* audio_device = (char*) context;
-  dev = pa_simple_new(audio_device, "Moonlight Embedded", PA_STREAM_PLAYBACK, NULL, "Streaming", &spec, NULL, NULL, &error);
+  pa_buffer_attr attr = {
+    .maxlength = (uint32_t) -1,
+    .tlength = pa_usec_to_bytes(PULSE_LATENCY_USEC, &spec),
+    .prebuf = (uint32_t) -1,
+    .minreq = pa_usec_to_bytes(PULSE_REQUEST_USEC, &spec),
+    .fragsize = (uint32_t) -1,
+  };
+
+  pa_channel_map map;
+  pa_channel_map_init_auto(&map, channelCount, PA_CHANNEL_MAP_ALSA);
+
+  pa_threaded_mainloop_lock(mainloop);
+  stream = pa_stream_new(pulseContext, "Streaming", &spec, &map);
+  if (stream != NULL) {
+    pa_stream_set_state_callback(stream, pulse_stream_state, NULL);
+    pa_stream_set_write_callback(stream, pulse_stream_request, NULL);
+    pa_stream_set_underflow_callback(stream, pulse_stream_underflow, NULL);
 
-  if (!dev) {
-    printf("Pulseaudio error: %s\n", pa_strerror(error));
+    pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+    if (pa_stream_connect_playback(stream, sink, &attr, flags, NULL, NULL) == 0) {
+      pa_stream_state_t state;
+      while ((state = pa_stream_get_state(stream)) != PA_STREAM_READY && PA_STREAM_IS_GOOD(state))
+        pa_threaded_mainloop_wait(mainloop);
+    }
+  }
+
+  bool ready = stream != NULL && pa_stream_get_state(stream) == PA_STREAM_READY;
+  if (ready) {
+    // Smaller requests would commit a few samples at a time, with a wakeup for each
+    const pa_buffer_attr* actual = pa_stream_get_buffer_attr(stream);
+    requestBytes = FRAME_SIZE * frameBytes;
+    if (actual->minreq > requestBytes && actual->minreq < actual->tlength)
+      requestBytes = actual->minreq;
+    _moonlight_log(INFO, "Pulseaudio target length %u bytes, request size %u bytes\n", actual->tlength, actual->minreq);
+  }
+  pa_threaded_mainloop_unlock(mainloop);
+
+  if (!ready) {
+    _moonlight_log(ERR, "Pulseaudio error: %s\n", pa_strerror(pa_context_errno(pulseContext)));
     return -1;
   }
 
-  return 0;
+  audio_pipeline_set_direct(pulse_renderer_begin, pulse_renderer_commit);
+  return audio_pipeline_init(opusConfig, alsaMapping, FRAME_SIZE * FRAME_BUFFER, pulse_renderer_write, pulse_renderer_delay);
 }
 
 static void pulse_renderer_decode_and_play_sample(char* data, int length) {
-  int decodeLen = opus_multistream_decode(decoder, data, length, pcmBuffer, FRAME_SIZE, 0);
-  if (decodeLen > 0) {
-    int error;
-    int rc = pa_simple_write(dev, pcmBuffer, decodeLen * sizeof(short) * channelCount, &error);
+  audio_pipeline_submit(data, length);
+}
+
+static void pulse_renderer_cleanup() {
+  audio_pipeline_destroy();
 
-    if (rc<0)
-      printf("Pulseaudio error: %s\n", pa_strerror(error));
-  } else {
-    printf("Opus error from decode: %d\n", decodeLen);
+  if (stream != NULL) {
+    pa_threaded_mainloop_lock(mainloop);
+    pa_stream_disconnect(stream);
+    pa_stream_unref(stream);
+    stream = NULL;
+    pa_threaded_mainloop_unlock(mainloop);
   }
 }
 
-static void pulse_renderer_cleanup() {
-  pa_simple_free(dev);
+// The server connection outlives the streams, a restarted connection only creates a new stream
+void audio_pulse_destroy() {
+  pulse_disconnect();
 }
 
 AUDIO_RENDERER_CALLBACKS audio_callbacks_pulse = {
@@ -0,0 +1,152 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "audio.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Polyphase windowed sinc resampler for small ratio corrections around 1.0.
+ * The ratio only ever moves a fraction of a percent, so a short filter is
+ * enough and the cutoff can sit close to Nyquist.
+ */
+#define RESAMPLER_TAPS 16
+#define RESAMPLER_PHASES 32
+#define RESAMPLER_CUTOFF 0.95
+
+static float coefficients[RESAMPLER_PHASES + 1][RESAMPLER_TAPS];
+
+// Planar history per channel, the first RESAMPLER_TAPS frames are carried over between calls
+static float* history[MAX_CHANNEL_COUNT];
+static int historyFrames, historyCapacity;
+static int channelCount;
+static double position;
+
+static inline float resampler_dot(const float* a, const float* b) {
+#if defined(__SSE__)
+  __m128 sum = _mm_setzero_ps();
+  for (int i = 0; i < RESAMPLER_TAPS; i += 4)
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+#elif defined(__ARM_NEON)
+  float32x4_t sum = vdupq_n_f32(0);
+  for (int i = 0; i < RESAMPLER_TAPS; i += 4)
+    sum = vmlaq_f32(sum, vld1q_f32(a + i), vld1q_f32(b + i));
+
+  float32x2_t pair = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+  return vget_lane_f32(vpadd_f32(pair, pair), 0);
+#else
+  float sum = 0;
+  for (int i = 0; i < RESAMPLER_TAPS; i++)
+    sum += a[i] * b[i];
+
+  return sum;
+#endif
+}
+
+int resampler_init(int channels, int maxFrames) {
+  channelCount = channels;
+  position = 0;
+
+  for (int phase = 0; phase <= RESAMPLER_PHASES; phase++) {
+    double sum = 0;
+    for (int tap = 0; tap < RESAMPLER_TAPS; tap++) {
+      double x = tap - (RESAMPLER_TAPS / 2 - 1) - (double) phase / RESAMPLER_PHASES;
+      double sinc = x == 0 ? 1 : sin(M_PI * RESAMPLER_CUTOFF * x) / (M_PI * RESAMPLER_CUTOFF * x);
+      double window = 0.42 + 0.5 * cos(M_PI * x / (RESAMPLER_TAPS / 2)) + 0.08 * cos(2 * M_PI * x / (RESAMPLER_TAPS / 2));
+      coefficients[phase][tap] = sinc * window;
+      sum += coefficients[phase][tap];
+    }
+
+    // Normalize every phase to unity gain
+    for (int tap = 0; tap < RESAMPLER_TAPS; tap++)
+      coefficients[phase][tap] /= sum;
+  }
+
+  for (int i = 0; i < channels; i++) {
+    history[i] = calloc(2 * RESAMPLER_TAPS + maxFrames, sizeof(float));
+    if (history[i] == NULL)
+      return -1;
+  }
+  historyFrames = RESAMPLER_TAPS;
+  historyCapacity = 2 * RESAMPLER_TAPS + maxFrames;
+
+  return 0;
+}
+
+int resampler_process(short* in, int inFrames, short* out, int maxOutFrames, double ratio) {
+  if (inFrames > historyCapacity - historyFrames)
+    inFrames = historyCapacity - historyFrames;
+
+  for (int i = 0; i < inFrames; i++) {
+    for (int c = 0; c < channelCount; c++)
+      history[c][historyFrames + i] = in[i * channelCount + c];
+  }
+  historyFrames += inFrames;
+
+  int outFrames = 0;
+  while (outFrames < maxOutFrames && position + RESAMPLER_TAPS < historyFrames) {
+    int index = (int) position;
+    double phase = (position - index) * RESAMPLER_PHASES;
+    int phaseIndex = (int) phase;
+    float weight = phase - phaseIndex;
+
+    for (int c = 0; c < channelCount; c++) {
+      float* samples = &history[c][index];
+      float a = resampler_dot(samples, coefficients[phaseIndex]);
+      float b = resampler_dot(samples, coefficients[phaseIndex + 1]);
+      float value = a + (b - a) * weight;
+      out[outFrames * channelCount + c] = value > SHRT_MAX ? SHRT_MAX : (value < SHRT_MIN ? SHRT_MIN : (short) lrintf(value));
+    }
+
+    outFrames++;
+    position += ratio;
+  }
+
+  // Keep the samples still needed by the filter for the next call
+  int consumed = (int) position;
+  if (consumed > historyFrames - RESAMPLER_TAPS)
+    consumed = historyFrames - RESAMPLER_TAPS;
+
+  for (int c = 0; c < channelCount; c++)
+    memmove(history[c], &history[c][consumed], (historyFrames - consumed) * sizeof(float));
+
+  historyFrames -= consumed;
+  position -= consumed;
+
+  return outFrames;
+}
+
+void resampler_destroy() {
+  for (int i = 0; i < MAX_CHANNEL_COUNT; i++) {
+    free(history[i]);
+    history[i] = NULL;
+  }
+}
@@ -23,55 +23,64 @@
 #include <SDL_audio.h>
 
 #include <stdio.h>
-#include <opus_multistream.h>
 
-static OpusMSDecoder* decoder;
-static short pcmBuffer[FRAME_SIZE * MAX_CHANNEL_COUNT];
-static SDL_AudioDeviceID dev;
-static int channelCount;
+// Small device buffer, latency is bounded by the pipeline's packet queue instead
+#define SDL_DEVICE_SAMPLES 512
 
-static int sdl_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
-  int rc;
-  decoder = opus_multistream_decoder_create(opusConfig->sampleRate, opusConfig->channelCount, opusConfig->streams, opusConfig->coupledStreams, opusConfig->mapping, &rc);
+static SDL_AudioDeviceID dev;
+static int frameBytes;
 
-  channelCount = opusConfig->channelCount;
+// Runs on the SDL audio thread and decodes straight into the device buffer
+static void sdl_renderer_callback(void* userdata, Uint8* stream, int len) {
+  audio_pipeline_pull((short*) stream, len / frameBytes);
+}
 
+static int sdl_renderer_init(int audioConfiguration, POPUS_MULTISTREAM_CONFIGURATION opusConfig, void* context, int arFlags) {
   SDL_InitSubSystem(SDL_INIT_AUDIO);
 
   SDL_AudioSpec want, have;
   SDL_zero(want);
   want.freq = opusConfig->sampleRate;
-  want.format = AUDIO_S16LSB;
+  want.format = AUDIO_S16SYS;
   want.channels = opusConfig->channelCount;
-  want.samples = 4096;
+  want.samples = SDL_DEVICE_SAMPLES;
+  want.callback = sdl_renderer_callback;
+
+  // Devices open paused, so the callback doesn't run before the pipeline is ready
+  dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+  if (dev != 0 && have.channels != want.channels && have.channels != 2) {
+    // Only a stereo mix is done by the pipeline, let SDL convert anything else
+    SDL_CloseAudioDevice(dev);
+    dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+  }
 
-  dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FORMAT_CHANGE);
   if (dev == 0) {
     printf("Failed to open audio: %s\n", SDL_GetError());
     return -1;
-  } else {
-    if (have.format != want.format)  // we let this one thing change.
-      printf("We didn't get requested audio format.\n");
-    SDL_PauseAudioDevice(dev, 0);  // start audio playing.
   }
 
+  if (have.samples != want.samples)
+    printf("Audio device buffer is %d samples\n", have.samples);
+
+  if (have.channels != want.channels)
+    audio_pipeline_set_output_channels(have.channels);
+
+  frameBytes = have.channels * sizeof(short);
+  if (audio_pipeline_init(opusConfig, opusConfig->mapping, FRAME_SIZE, NULL, NULL) < 0)
+    return -1;
+
+  SDL_PauseAudioDevice(dev, 0);  // start audio playing.
   return 0;
 }
 
 static void sdl_renderer_cleanup() {
-  if (decoder != NULL)
-    opus_multistream_decoder_destroy(decoder);
-
   SDL_CloseAudioDevice(dev);
+
+  audio_pipeline_destroy();
 }
 
 static void sdl_renderer_decode_and_play_sample(char* data, int length) {
-  int decodeLen = opus_multistream_decode(decoder, data, length, pcmBuffer, FRAME_SIZE, 0);
-  if (decodeLen > 0) {
-    SDL_QueueAudio(dev, pcmBuffer, decodeLen * channelCount * sizeof(short));
-  } else {
-    printf("Opus error from decode: %d\n", decodeLen);
-  }
+  audio_pipeline_submit(data, length);
 }
 
 AUDIO_RENDERER_CALLBACKS audio_callbacks_sdl = {
@@ -0,0 +1,140 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bandwidth.h"
+#include "logging.h"
+
+#include <errors.h>
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static char bandwidthFile[4096];
+
+// The local address towards the host tells networks apart, like wired and Wi-Fi
+static void local_address(const char* host, char* address, size_t size) {
+  struct addrinfo hints = {0}, *res;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  snprintf(address, size, "unknown");
+  if (getaddrinfo(host, "47989", &hints, &res) != 0)
+    return;
+
+  int fd = socket(res->ai_family, SOCK_DGRAM, 0);
+  struct sockaddr_storage local;
+  socklen_t len = sizeof(local);
+  if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) == 0 && getsockname(fd, (struct sockaddr*) &local, &len) == 0)
+    getnameinfo((struct sockaddr*) &local, len, address, size, NULL, 0, NI_NUMERICHOST);
+
+  if (fd >= 0)
+    close(fd);
+  freeaddrinfo(res);
+}
+
+// Cached throughput in kbps of this host and network, or 0 when unknown or outdated
+static int bandwidth_load(const char* key, double* jitter) {
+  FILE* fd = fopen(bandwidthFile, "r");
+  if (fd == NULL)
+    return 0;
+
+  char *line = NULL;
+  size_t len = 0;
+  int kbps = 0, value;
+  double lineJitter;
+  long measured;
+  int offset;
+  while (getline(&line, &len, fd) != -1) {
+    line[strcspn(line, "\n")] = 0;
+    if (sscanf(line, "%d %lf %ld %n", &value, &lineJitter, &measured, &offset) == 3 && strcmp(&line[offset], key) == 0 && time(NULL) - measured < BANDWIDTH_CACHE_AGE) {
+      kbps = value;
+      *jitter = lineJitter;
+    }
+  }
+
+  free(line);
+  fclose(fd);
+  return kbps;
+}
+
+static void bandwidth_save(const char* key, int kbps, double jitter) {
+  char tmpFile[sizeof(bandwidthFile) + 4];
+  snprintf(tmpFile, sizeof(tmpFile), "%s.tmp", bandwidthFile);
+
+  FILE* out = fopen(tmpFile, "w");
+  if (out == NULL) {
+    _moonlight_log(WARN, "Can't save bandwidth measurement to %s\n", bandwidthFile);
+    return;
+  }
+
+  // Keep the entries of other hosts and networks
+  FILE* in = fopen(bandwidthFile, "r");
+  if (in != NULL) {
+    char *line = NULL;
+    size_t len = 0;
+    int value;
+    double lineJitter;
+    long measured;
+    int offset;
+    while (getline(&line, &len, in) != -1) {
+      line[strcspn(line, "\n")] = 0;
+      if (sscanf(line, "%d %lf %ld %n", &value, &lineJitter, &measured, &offset) == 3 && strcmp(&line[offset], key) != 0)
+        fprintf(out, "%s\n", line);
+    }
+    free(line);
+    fclose(in);
+  }
+
+  fprintf(out, "%d %.1f %ld %s\n", kbps, jitter, (long) time(NULL), key);
+  fclose(out);
+  rename(tmpFile, bandwidthFile);
+}
+
+int bandwidth_bitrate(PSERVER_DATA server, int appId, const char* keyDir, int headroom) {
+  char network[64];
+  char key[sizeof(network) + 64];
+  double jitter = 0;
+
+  snprintf(bandwidthFile, sizeof(bandwidthFile), "%s/bandwidth", keyDir);
+  local_address(server->serverInfo.address, network, sizeof(network));
+  snprintf(key, sizeof(key), "%s %s", server->serverInfo.address, network);
+
+  int kbps = bandwidth_load(key, &jitter);
+  if (kbps > 0)
+    _moonlight_log(INFO, "Bandwidth to %s from %s: %d kbps, first byte jitter %.1f ms (cached)\n", server->serverInfo.address, network, kbps, jitter);
+  else if (gs_measure_bandwidth(server, appId, BANDWIDTH_PROBES, &kbps, &jitter) == GS_OK) {
+    _moonlight_log(INFO, "Bandwidth to %s from %s: %d kbps, first byte jitter %.1f ms\n", server->serverInfo.address, network, kbps, jitter);
+    bandwidth_save(key, kbps, jitter);
+  } else {
+    _moonlight_log(WARN, "Can't measure bandwidth to %s: %s\n", server->serverInfo.address, gs_error);
+    return -1;
+  }
+
+  int bitrate = (long long) kbps * headroom / 100;
+  if (bitrate < MIN_AUTO_BITRATE)
+    bitrate = MIN_AUTO_BITRATE;
+  else if (bitrate > MAX_AUTO_BITRATE)
+    bitrate = MAX_AUTO_BITRATE;
+
+  return bitrate;
+}
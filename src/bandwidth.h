@@ -0,0 +1,28 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <client.h>
+
+#define BANDWIDTH_PROBES 4
+#define BANDWIDTH_CACHE_AGE (7 * 24 * 60 * 60)
+
+#define MIN_AUTO_BITRATE 2000
+#define MAX_AUTO_BITRATE 150000
+
+int bandwidth_bitrate(PSERVER_DATA server, int appId, const char* keyDir, int headroom);
@@ -64,6 +64,15 @@ static struct option long_options[] = {
   {"rotate", required_argument, NULL, '3'},
   {"logging", no_argument, NULL, '4'},
   {"delay", required_argument, NULL, '5'},
+  {"audiolatency", required_argument, NULL, '6'},
+  {"audiotune", no_argument, NULL, '7'},
+  {"audioquantum", required_argument, NULL, '8'},
+  {"avsync", required_argument, NULL, '9'},
+  {"audiohw", no_argument, NULL, 'e'},
+  {"selecthost", no_argument, NULL, 'f'},
+  {"headroom", required_argument, NULL, 'w'},
+  {"adaptive", no_argument, NULL, 'A'},
+  {"socket", required_argument, NULL, 'B'},
   {"verbose", no_argument, NULL, 'z'},
   {"debug", no_argument, NULL, 'Z'},
   {0, 0, 0, 0},
@@ -121,6 +130,33 @@ static void parse_argument(int c, char* value, PCONFIGURATION config) {
   case '5':
     config->stream_start_delay = atoi(value);
     break;
+  case '6':
+    config->audio_latency = atoi(value);
+    break;
+  case '7':
+    config->audio_tune = true;
+    break;
+  case '8':
+    config->audio_quantum = atoi(value);
+    break;
+  case '9':
+    config->av_sync = atoi(value);
+    break;
+  case 'e':
+    config->audio_hw = true;
+    break;
+  case 'f':
+    config->select_host = true;
+    break;
+  case 'w':
+    config->bitrate_headroom = atoi(value);
+    break;
+  case 'A':
+    config->adaptive = true;
+    break;
+  case 'B':
+    config->control_socket = value;
+    break;
   case 'l':
     config->sops = false;
     break;
@@ -241,7 +277,7 @@ void config_save(char* filename, PCONFIGURATION config) {
     write_config_int(fd, "fps", config->stream.fps);
   if (config->stream.bitrate != -1)
     write_config_int(fd, "bitrate", config->stream.bitrate);
-  if (config->stream.packetSize != 1024)
+  if (config->stream.packetSize != -1)
     write_config_int(fd, "packetsize", config->stream.packetSize);
   if (!config->sops)
     write_config_bool(fd, "sops", config->sops);
@@ -253,6 +289,24 @@ void config_save(char* filename, PCONFIGURATION config) {
     write_config_bool(fd, "viewonly", config->viewonly);
   if (config->rotate != 0)
     write_config_int(fd, "rotate", config->rotate);
+  if (config->audio_latency != 0)
+    write_config_int(fd, "audiolatency", config->audio_latency);
+  if (config->audio_tune)
+    write_config_bool(fd, "audiotune", config->audio_tune);
+  if (config->audio_quantum != 0)
+    write_config_int(fd, "audioquantum", config->audio_quantum);
+  if (config->av_sync != 0)
+    write_config_int(fd, "avsync", config->av_sync);
+  if (config->audio_hw)
+    write_config_bool(fd, "audiohw", config->audio_hw);
+  if (config->select_host)
+    write_config_bool(fd, "selecthost", config->select_host);
+  if (config->bitrate_headroom != 80)
+    write_config_int(fd, "headroom", config->bitrate_headroom);
+  if (config->adaptive)
+    write_config_bool(fd, "adaptive", config->adaptive);
+  if (config->control_socket != NULL)
+    write_config_string(fd, "socket", config->control_socket);
 
   if (strcmp(config->app, "Steam") != 0)
     write_config_string(fd, "app", config->app);
@@ -267,7 +321,7 @@ void config_parse(int argc, char* argv[], PCONFIGURATION config) {
   config->stream.height = 720;
   config->stream.fps = -1;
   config->stream.bitrate = -1;
-  config->stream.packetSize = 1024;
+  config->stream.packetSize = -1;
   config->stream.streamingRemotely = 0;
   config->stream.audioConfiguration = AUDIO_CONFIGURATION_STEREO;
   config->stream.supportsHevc = false;
@@ -287,6 +341,15 @@ void config_parse(int argc, char* argv[], PCONFIGURATION config) {
   config->viewonly = false;
   config->rotate = 0;
   config->stream_start_delay = -1;
+  config->audio_latency = 0;
+  config->audio_tune = false;
+  config->audio_quantum = 0;
+  config->av_sync = 0;
+  config->audio_hw = false;
+  config->select_host = false;
+  config->bitrate_headroom = 80;
+  config->adaptive = false;
+  config->control_socket = NULL;
   config->codec = CODEC_UNSPECIFIED;
 
   config->inputsCount = 0;
@@ -306,7 +369,7 @@ void config_parse(int argc, char* argv[], PCONFIGURATION config) {
   } else {
     int option_index = 0;
     int c;
-    while ((c = getopt_long_only(argc, argv, "-abc:d:efg:h:i:j:k:lm:no:p:q:r:stuv:w:xy", long_options, &option_index)) != -1) {
+    while ((c = getopt_long_only(argc, argv, "-AB:abc:d:efg:h:i:j:k:lm:no:p:q:r:stuv:w:xy", long_options, &option_index)) != -1) {
       parse_argument(c, optarg, config);
     }
   }
@@ -328,6 +391,8 @@ void config_parse(int argc, char* argv[], PCONFIGURATION config) {
   if (config->stream.fps == -1)
     config->stream.fps = config->stream.height >= 1080 ? 30 : 60;
 
+  // The table is the fallback when the bandwidth to the host can't be measured
+  config->auto_bitrate = config->stream.bitrate == -1;
   if (config->stream.bitrate == -1) {
     if (config->stream.height >= 1080 && config->stream.fps >= 60)
       config->stream.bitrate = 20000;
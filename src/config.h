@@ -42,9 +42,19 @@ typedef struct _CONFIGURATION {
   bool log_file_enabled;
   int rotate;
   int stream_start_delay;
+  int audio_latency;
+  bool audio_tune;
+  bool audio_hw;
+  int audio_quantum;
+  int av_sync;
   bool unsupported;
   bool quitappafter;
   bool viewonly;
+  bool select_host;
+  bool auto_bitrate;
+  int bitrate_headroom;
+  bool adaptive;
+  char* control_socket;
   char* inputs[MAX_INPUTS];
   int inputsCount;
   enum codecs codec;
@@ -18,6 +18,7 @@
  */
 
 #include "connection.h"
+#include "adaptive.h"
 #include "logging.h"
 
 #include <stdio.h>
@@ -30,7 +31,7 @@ ConnListenerRumble rumble_handler = NULL;
 
 static void connection_terminated() {
   if (main_thread_id != 0)
-    pthread_kill(main_thread_id, SIGTERM);
+    pthread_kill(main_thread_id, SIGUSR1);
 }
 
 //TODO: Parse to logging?
@@ -47,6 +48,7 @@ static void rumble(unsigned short controllerNumber, unsigned short lowFreqMotor,
 }
 
 static void connection_status_update(int status) {
+  adaptive_connection_status(status);
   switch (status) {
     case CONN_STATUS_OKAY:
       _moonlight_log(INFO,"Connection is okay\n");
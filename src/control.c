@@ -0,0 +1,210 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "control.h"
+#include "loop.h"
+#include "logging.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Commands are lines of text on a UNIX socket, answered by zero or more
+ * lines and a final "ok" or "error <reason>" line, so a shell can drive
+ * the daemon with socat or nc -U.
+ */
+
+struct control_client {
+  int fd;
+  size_t length;
+  char line[CONTROL_LINE];
+};
+
+static struct control_client clients[CONTROL_CLIENTS];
+static int listenFd = -1;
+static char* socketPath = NULL;
+static ControlHandler commandHandler;
+
+static void control_close(struct control_client* client) {
+  loop_remove_fd(client->fd);
+  close(client->fd);
+  client->fd = -1;
+  client->length = 0;
+}
+
+static int control_dispatch(int fd, char* line) {
+  line[strcspn(line, "\r")] = 0;
+  char* command = line + strspn(line, " \t");
+  if (*command == 0)
+    return LOOP_OK;
+
+  char* argument = command + strcspn(command, " \t");
+  if (*argument != 0) {
+    *argument++ = 0;
+    argument += strspn(argument, " \t");
+  }
+
+  return commandHandler(fd, command, *argument != 0 ? argument : NULL);
+}
+
+static int control_client_handle(int fd) {
+  struct control_client* client = NULL;
+  for (int i = 0; i < CONTROL_CLIENTS; i++) {
+    if (clients[i].fd == fd)
+      client = &clients[i];
+  }
+  if (client == NULL)
+    return LOOP_OK;
+
+  ssize_t size = read(fd, client->line + client->length, CONTROL_LINE - 1 - client->length);
+  if (size < 0 && (errno == EAGAIN || errno == EINTR))
+    return LOOP_OK;
+  else if (size <= 0) {
+    control_close(client);
+    return LOOP_OK;
+  }
+
+  client->length += size;
+  int ret = LOOP_OK;
+  char* end;
+  while ((end = memchr(client->line, '\n', client->length)) != NULL) {
+    *end = 0;
+    if (control_dispatch(fd, client->line) == LOOP_RETURN)
+      ret = LOOP_RETURN;
+
+    size_t used = end - client->line + 1;
+    client->length -= used;
+    memmove(client->line, end + 1, client->length);
+  }
+
+  if (client->length == CONTROL_LINE - 1) {
+    control_reply(fd, "error line too long\n");
+    control_close(client);
+  }
+
+  return ret;
+}
+
+static int control_accept(int fd) {
+  int clientFd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (clientFd < 0)
+    return LOOP_OK;
+
+  for (int i = 0; i < CONTROL_CLIENTS; i++) {
+    if (clients[i].fd < 0) {
+      clients[i].fd = clientFd;
+      clients[i].length = 0;
+      loop_add_fd(clientFd, control_client_handle, POLLIN);
+      return LOOP_OK;
+    }
+  }
+
+  control_reply(clientFd, "error too many clients\n");
+  close(clientFd);
+  return LOOP_OK;
+}
+
+bool control_init(const char* path, ControlHandler handler) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    _moonlight_log(ERR, "Control socket path %s is too long\n", path);
+    return false;
+  }
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    _moonlight_log(ERR, "Can't create control socket: %s\n", strerror(errno));
+    return false;
+  }
+
+  // A socket nobody answers on is left behind by a daemon which didn't exit cleanly
+  int probeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probeFd >= 0 && connect(probeFd, (struct sockaddr*) &address, sizeof(address)) == 0) {
+    _moonlight_log(ERR, "Another daemon is listening on %s\n", path);
+    close(probeFd);
+    close(fd);
+    return false;
+  }
+  if (probeFd >= 0)
+    close(probeFd);
+  unlink(path);
+
+  // Only the user running the daemon may control it
+  mode_t mask = umask(0077);
+  int ret = bind(fd, (struct sockaddr*) &address, sizeof(address));
+  umask(mask);
+  if (ret < 0 || listen(fd, CONTROL_CLIENTS) < 0) {
+    _moonlight_log(ERR, "Can't listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  for (int i = 0; i < CONTROL_CLIENTS; i++)
+    clients[i].fd = -1;
+
+  listenFd = fd;
+  socketPath = strdup(path);
+  commandHandler = handler;
+  loop_add_fd(listenFd, control_accept, POLLIN);
+  return true;
+}
+
+void control_reply(int client, const char* format, ...) {
+  char buffer[CONTROL_LINE];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  if (length >= (int) sizeof(buffer)) {
+    length = sizeof(buffer) - 1;
+    buffer[length - 1] = '\n';
+  }
+
+  // A client which went away mustn't take the daemon with it
+  if (length > 0)
+    send(client, buffer, length, MSG_NOSIGNAL);
+}
+
+void control_destroy() {
+  if (listenFd < 0)
+    return;
+
+  for (int i = 0; i < CONTROL_CLIENTS; i++) {
+    if (clients[i].fd >= 0)
+      control_close(&clients[i]);
+  }
+
+  loop_remove_fd(listenFd);
+  close(listenFd);
+  listenFd = -1;
+  unlink(socketPath);
+  free(socketPath);
+  socketPath = NULL;
+}
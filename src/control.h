@@ -0,0 +1,30 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+
+#define CONTROL_CLIENTS 4
+#define CONTROL_LINE 256
+
+// Called with a command and the rest of its line, or NULL without one, returns LOOP_RETURN to leave the loop
+typedef int(*ControlHandler)(int client, char* command, char* argument);
+
+bool control_init(const char* path, ControlHandler handler);
+void control_reply(int client, const char* format, ...);
+void control_destroy();
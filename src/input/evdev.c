@@ -20,6 +20,7 @@
 #include "evdev.h"
 
 #include "keyboard.h"
+#include "haptics.h"
 
 #include "../loop.h"
 #include "../logging.h"
@@ -71,6 +72,7 @@ struct input_device {
   struct timeval touchDownTime;
   short controllerId;
   int haptic_effect_id;
+  bool haptic_playing;
   int buttonFlags;
   char leftTrigger, rightTrigger;
   short leftStickX, leftStickY;
@@ -104,6 +106,11 @@ static bool* currentReverse;
 
 static bool grabbingDevices;
 
+static int hapticsPipe[2] = {-1, -1};
+
+#define HOTPLUG_OPEN_RETRIES 20
+#define HOTPLUG_OPEN_DELAY 50000 // microseconds
+
 int evdev_gamepads = 0;
 
 #define ACTION_MODIFIERS (MODIFIER_SHIFT|MODIFIER_ALT|MODIFIER_CTRL)
@@ -143,6 +150,10 @@ static void evdev_remove(int devindex) {
   if (devices[devindex].controllerId >= 0)
     assignedControllerIds &= ~(1 << devices[devindex].controllerId);
 
+  loop_remove_fd(devices[devindex].fd);
+  libevdev_free(devices[devindex].dev);
+  close(devices[devindex].fd);
+
   if (devindex != numDevices && numDevices > 0)
     memcpy(&devices[devindex], &devices[numDevices], sizeof(struct input_device));
 
@@ -514,6 +525,7 @@ static int evdev_handle(int fd) {
       }
       if (rc == -ENODEV) {
         evdev_remove(i);
+        return LOOP_OK;
       } else if (rc != -EAGAIN && rc < 0) {
         _moonlight_log(ERR, "Error: %s\n", strerror(-rc));
         exit(EXIT_FAILURE);
@@ -523,12 +535,12 @@ static int evdev_handle(int fd) {
   return LOOP_OK;
 }
 
-void evdev_create(const char* device, struct mapping* mappings, bool verbose, int rotate) {
+static struct input_device* evdev_probe(const char* device, struct mapping* mappings, bool verbose, int rotate) {
   int fd = open(device, O_RDWR|O_NONBLOCK);
   if (fd <= 0) {
     _moonlight_log(ERR, "Failed to open device %s\n", device);
     fflush(stderr);
-    return;
+    return NULL;
   }
 
   struct libevdev *evdev = libevdev_new();
@@ -579,44 +591,33 @@ void evdev_create(const char* device, struct mapping* mappings, bool verbose, in
     mappings = default_mapping;
   }
 
-  if (!is_keyboard && !is_mouse && !is_touchscreen)
-    evdev_gamepads++;
-
-  int dev = numDevices;
-  numDevices++;
-
-  if (devices == NULL) {
-    devices = malloc(sizeof(struct input_device));
-  } else {
-    devices = realloc(devices, sizeof(struct input_device)*numDevices);
-  }
-
-  if (devices == NULL) {
+  struct input_device* dev = malloc(sizeof(struct input_device));
+  if (dev == NULL) {
     _moonlight_log(ERR, "Not enough memory\n");
     exit(EXIT_FAILURE);
   }
 
-  memset(&devices[dev], 0, sizeof(devices[0]));
-  devices[dev].fd = fd;
-  devices[dev].dev = evdev;
-  devices[dev].map = mappings;
-  memset(&devices[dev].key_map, -2, sizeof(devices[dev].key_map));
-  memset(&devices[dev].abs_map, -2, sizeof(devices[dev].abs_map));
-  devices[dev].is_keyboard = is_keyboard;
-  devices[dev].is_mouse = is_mouse;
-  devices[dev].is_touchscreen = is_touchscreen;
-  devices[dev].rotate = rotate;
-  devices[dev].touchDownX = TOUCH_UP;
-  devices[dev].touchDownY = TOUCH_UP;
+  memset(dev, 0, sizeof(*dev));
+  dev->fd = fd;
+  dev->dev = evdev;
+  dev->map = mappings;
+  memset(&dev->key_map, -2, sizeof(dev->key_map));
+  memset(&dev->abs_map, -2, sizeof(dev->abs_map));
+  dev->is_keyboard = is_keyboard;
+  dev->is_mouse = is_mouse;
+  dev->is_touchscreen = is_touchscreen;
+  dev->rotate = rotate;
+  dev->touchDownX = TOUCH_UP;
+  dev->touchDownY = TOUCH_UP;
 
   int nbuttons = 0;
   for (int i = BTN_JOYSTICK; i < KEY_MAX; ++i) {
-    if (libevdev_has_event_code(devices[dev].dev, EV_KEY, i))
-      devices[dev].key_map[i - BTN_MISC] = nbuttons++;
+    if (libevdev_has_event_code(dev->dev, EV_KEY, i))
+      dev->key_map[i - BTN_MISC] = nbuttons++;
   }
   for (int i = BTN_MISC; i < BTN_JOYSTICK; ++i) {
-    if (libevdev_has_event_code(devices[dev].dev, EV_KEY, i))
-      devices[dev].key_map[i - BTN_MISC] = nbuttons++;
+    if (libevdev_has_event_code(dev->dev, EV_KEY, i))
+      dev->key_map[i - BTN_MISC] = nbuttons++;
   }
 
   int naxes = 0;
@@ -624,26 +625,51 @@ void evdev_create(const char* device, struct mapping* mappings, bool verbose, in
     /* Skip hats */
     if (i == ABS_HAT0X)
       i = ABS_HAT3Y;
-    else if (libevdev_has_event_code(devices[dev].dev, EV_ABS, i))
-      devices[dev].abs_map[i] = naxes++;
+    else if (libevdev_has_event_code(dev->dev, EV_ABS, i))
+      dev->abs_map[i] = naxes++;
   }
 
-  devices[dev].controllerId = -1;
-  devices[dev].haptic_effect_id = -1;
+  dev->controllerId = -1;
+  dev->haptic_effect_id = -1;
 
-  if (devices[dev].map != NULL) {
-    bool valid = evdev_init_parms(&devices[dev], &(devices[dev].xParms), devices[dev].map->abs_leftx);
-    valid &= evdev_init_parms(&devices[dev], &(devices[dev].yParms), devices[dev].map->abs_lefty);
-    valid &= evdev_init_parms(&devices[dev], &(devices[dev].zParms), devices[dev].map->abs_lefttrigger);
-    valid &= evdev_init_parms(&devices[dev], &(devices[dev].rxParms), devices[dev].map->abs_rightx);
-    valid &= evdev_init_parms(&devices[dev], &(devices[dev].ryParms), devices[dev].map->abs_righty);
-    valid &= evdev_init_parms(&devices[dev], &(devices[dev].rzParms), devices[dev].map->abs_righttrigger);
+  if (dev->map != NULL) {
+    bool valid = evdev_init_parms(dev, &(dev->xParms), dev->map->abs_leftx);
+    valid &= evdev_init_parms(dev, &(dev->yParms), dev->map->abs_lefty);
+    valid &= evdev_init_parms(dev, &(dev->zParms), dev->map->abs_lefttrigger);
+    valid &= evdev_init_parms(dev, &(dev->rxParms), dev->map->abs_rightx);
+    valid &= evdev_init_parms(dev, &(dev->ryParms), dev->map->abs_righty);
+    valid &= evdev_init_parms(dev, &(dev->rzParms), dev->map->abs_righttrigger);
     if (!valid)
       _moonlight_log(ERR, "Mapping for %s (%s) on %s is incorrect\n", name, str_guid, device);
   }
 
-  if (grabbingDevices && (is_keyboard || is_mouse || is_touchscreen)) {
-    if (ioctl(fd, EVIOCGRAB, 1) < 0) {
+  return dev;
+}
+
+static void evdev_add(struct input_device* device) {
+  if (!device->is_keyboard && !device->is_mouse && !device->is_touchscreen)
+    evdev_gamepads++;
+
+  int dev = numDevices;
+  numDevices++;
+
+  if (devices == NULL) {
+    devices = malloc(sizeof(struct input_device));
+  } else {
+    devices = realloc(devices, sizeof(struct input_device)*numDevices);
+  }
+
+  if (devices == NULL) {
+    _moonlight_log(ERR, "Not enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(&devices[dev], device, sizeof(struct input_device));
+  free(device);
+
+  // Decided here on the loop thread, which also grabs and releases the devices in evdev_start and evdev_stop
+  if (grabbingDevices && (devices[dev].is_keyboard || devices[dev].is_mouse || devices[dev].is_touchscreen)) {
+    if (ioctl(devices[dev].fd, EVIOCGRAB, 1) < 0) {
       _moonlight_log(ERR, "EVIOCGRAB failed with error %d\n", errno);
     }
   }
@@ -651,6 +677,80 @@ void evdev_create(const char* device, struct mapping* mappings, bool verbose, in
   loop_add_fd(devices[dev].fd, &evdev_handle, POLLIN);
 }
 
+void evdev_create(const char* device, struct mapping* mappings, bool verbose, int rotate) {
+  struct input_device* dev = evdev_probe(device, mappings, verbose, rotate);
+  if (dev != NULL)
+    evdev_add(dev);
+}
+
+struct hotplug_request {
+  char* device;
+  struct mapping* mappings;
+  bool verbose;
+  int rotate;
+};
+
+static int hotplugRequestPipe[2] = {-1, -1};
+static int hotplugResultPipe[2] = {-1, -1};
+static pthread_t hotplugThread;
+static bool hotplugRunning = false;
+
+static void* evdev_hotplug_thread(void* data) {
+  struct hotplug_request* request;
+  while (read(hotplugRequestPipe[0], &request, sizeof(void*)) == sizeof(void*)) {
+    // Permissions are applied by udev rules after the add event, give slow devices time to settle
+    for (int i = 0; i < HOTPLUG_OPEN_RETRIES && access(request->device, R_OK | W_OK) != 0; i++)
+      usleep(HOTPLUG_OPEN_DELAY);
+
+    struct input_device* dev = evdev_probe(request->device, request->mappings, request->verbose, request->rotate);
+    if (dev != NULL && write(hotplugResultPipe[1], &dev, sizeof(void*)) != sizeof(void*)) {
+      libevdev_free(dev->dev);
+      close(dev->fd);
+      free(dev);
+    }
+
+    free(request->device);
+    free(request);
+  }
+  return NULL;
+}
+
+static int evdev_hotplug_handle(int fd) {
+  struct input_device* dev;
+  while (read(fd, &dev, sizeof(void*)) == sizeof(void*))
+    evdev_add(dev);
+
+  return LOOP_OK;
+}
+
+void evdev_create_async(const char* device, struct mapping* mappings, bool verbose, int rotate) {
+  if (!hotplugRunning) {
+    if (pipe(hotplugRequestPipe) == -1 || pipe(hotplugResultPipe) == -1) {
+      _moonlight_log(ERR, "Can't create communication channel for hotplug\n");
+      exit(EXIT_FAILURE);
+    }
+    fcntl(hotplugResultPipe[0], F_SETFL, O_NONBLOCK);
+    loop_add_fd(hotplugResultPipe[0], &evdev_hotplug_handle, POLLIN);
+
+    if (pthread_create(&hotplugThread, NULL, evdev_hotplug_thread, NULL) != 0) {
+      _moonlight_log(ERR, "Can't create hotplug thread\n");
+      exit(EXIT_FAILURE);
+    }
+    hotplugRunning = true;
+  }
+
+  struct hotplug_request* request = malloc(sizeof(struct hotplug_request));
+  if (request == NULL || (request->device = strdup(device)) == NULL) {
+    _moonlight_log(ERR, "Not enough memory\n");
+    exit(EXIT_FAILURE);
+  }
+  request->mappings = mappings;
+  request->verbose = verbose;
+  request->rotate = rotate;
+
+  write(hotplugRequestPipe[1], &request, sizeof(void*));
+}
+
 static void evdev_map_key(char* keyName, short* key) {
   printf("Press %s\n", keyName);
   currentKey = key;
@@ -782,10 +882,48 @@ void evdev_start() {
 
 void evdev_stop() {
   evdev_drain();
+
+  // Between sessions of the daemon the devices belong to the system again
+  grabbingDevices = false;
+  for (int i = 0; i < numDevices; i++) {
+    if (devices[i].is_keyboard || devices[i].is_mouse || devices[i].is_touchscreen)
+      ioctl(devices[i].fd, EVIOCGRAB, 0);
+  }
 }
 
-void evdev_init() {
-  handler = evdev_handle_event;
+static void evdev_apply_rumble(struct input_device* device, unsigned short low_freq_motor, unsigned short high_freq_motor) {
+  struct input_event event = {0};
+  event.type = EV_FF;
+
+  if (low_freq_motor == 0 && high_freq_motor == 0) {
+    if (device->haptic_playing) {
+      event.code = device->haptic_effect_id;
+      event.value = 0;
+      write(device->fd, (const void*) &event, sizeof(event));
+      device->haptic_playing = false;
+    }
+    return;
+  }
+
+  // Reusing the id of the uploaded effect makes the kernel update it in place
+  struct ff_effect effect = {0};
+  effect.type = FF_RUMBLE;
+  effect.id = device->haptic_effect_id;
+  effect.replay.length = USHRT_MAX;
+  effect.u.rumble.strong_magnitude = low_freq_motor;
+  effect.u.rumble.weak_magnitude = high_freq_motor;
+  if (ioctl(device->fd, EVIOCSFF, &effect) == -1) {
+    _moonlight_log(ERR, "Failed to upload rumble effect: %d\n", errno);
+    return;
+  }
+  device->haptic_effect_id = effect.id;
+
+  if (!device->haptic_playing) {
+    event.code = effect.id;
+    event.value = 1;
+    write(device->fd, (const void*) &event, sizeof(event));
+    device->haptic_playing = true;
+  }
 }
 
 static struct input_device* evdev_get_input_device(unsigned short controller_id) {
@@ -796,32 +934,61 @@ static struct input_device* evdev_get_input_device(unsigned short controller_id)
   return NULL;
 }
 
-void evdev_rumble(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor) {
-  struct input_device* device = evdev_get_input_device(controller_id);
-  if (!device)
-    return;
-
-  if (device->haptic_effect_id >= 0) {
-    ioctl(device->fd, EVIOCRMFF, device->haptic_effect_id);
-    device->haptic_effect_id = -1;
+static int evdev_haptics_handle(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0);
+
+  int pending = haptics_pending();
+  for (int i = 0; i < HAPTICS_MAX_CONTROLLERS; i++) {
+    if (pending & (1 << i)) {
+      struct input_device* device = evdev_get_input_device(i);
+      if (device) {
+        unsigned short low_freq_motor, high_freq_motor;
+        haptics_get(i, &low_freq_motor, &high_freq_motor);
+        evdev_apply_rumble(device, low_freq_motor, high_freq_motor);
+      }
+    }
   }
+  return LOOP_OK;
+}
 
-  if (low_freq_motor == 0 && high_freq_motor == 0)
-    return;
+void evdev_init() {
+  handler = evdev_handle_event;
 
-  struct ff_effect effect = {0};
-  effect.type = FF_RUMBLE;
-  effect.id = -1;
-  effect.replay.length = USHRT_MAX;
-  effect.u.rumble.strong_magnitude = low_freq_motor;
-  effect.u.rumble.weak_magnitude = high_freq_motor;
-  if (ioctl(device->fd, EVIOCSFF, &effect) == -1)
+  if (pipe(hapticsPipe) == -1) {
+    _moonlight_log(ERR, "Can't create communication channel for rumble\n");
     return;
+  }
+  fcntl(hapticsPipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(hapticsPipe[1], F_SETFL, O_NONBLOCK);
+  loop_add_fd(hapticsPipe[0], &evdev_haptics_handle, POLLIN);
+}
 
-  struct input_event event = {0};
-  event.type = EV_FF;
-  event.code = effect.id;
-  event.value = 1;
-  write(device->fd, (const void*) &event, sizeof(event));
-  device->haptic_effect_id = effect.id;
+// Called from the control thread, the effect is applied on the loop thread which owns the devices
+void evdev_rumble(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor) {
+  if (haptics_queue(controller_id, low_freq_motor, high_freq_motor) && hapticsPipe[1] >= 0)
+    write(hapticsPipe[1], "", 1);
+}
+
+void evdev_destroy() {
+  // Closing the request pipe ends the hotplug thread once it's done with the device at hand
+  if (hotplugRunning) {
+    close(hotplugRequestPipe[1]);
+    pthread_join(hotplugThread, NULL);
+    hotplugRunning = false;
+
+    struct input_device* dev;
+    while (read(hotplugResultPipe[0], &dev, sizeof(void*)) == sizeof(void*)) {
+      libevdev_free(dev->dev);
+      close(dev->fd);
+      free(dev);
+    }
+
+    loop_remove_fd(hotplugResultPipe[0]);
+    close(hotplugRequestPipe[0]);
+    close(hotplugResultPipe[0]);
+    close(hotplugResultPipe[1]);
+    hotplugRequestPipe[0] = hotplugRequestPipe[1] = -1;
+    hotplugResultPipe[0] = hotplugResultPipe[1] = -1;
+  }
 }
@@ -22,10 +22,12 @@
 extern int evdev_gamepads;
 
 void evdev_create(const char* device, struct mapping* mappings, bool verbose, int rotate);
+void evdev_create_async(const char* device, struct mapping* mappings, bool verbose, int rotate);
 void evdev_loop();
 
 void evdev_init();
 void evdev_start();
 void evdev_stop();
+void evdev_destroy();
 void evdev_map(char* device);
 void evdev_rumble(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor);
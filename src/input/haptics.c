@@ -0,0 +1,50 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "haptics.h"
+
+#include <stdint.h>
+
+/* Rumble commands arrive on the control thread but are applied by the
+ * thread owning the input devices. Every controller has a single slot
+ * holding the latest motor values, so a burst of updates collapses into
+ * one write and the producer never blocks or allocates.
+ */
+static uint32_t rumble_values[HAPTICS_MAX_CONTROLLERS];
+static uint32_t rumble_pending;
+
+bool haptics_queue(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor) {
+  if (controller_id >= HAPTICS_MAX_CONTROLLERS)
+    return false;
+
+  __atomic_store_n(&rumble_values[controller_id], (uint32_t) low_freq_motor << 16 | high_freq_motor, __ATOMIC_RELAXED);
+
+  // Only the first update after the consumer emptied the queue needs to wake it up
+  return __atomic_fetch_or(&rumble_pending, 1 << controller_id, __ATOMIC_RELEASE) == 0;
+}
+
+int haptics_pending() {
+  return __atomic_exchange_n(&rumble_pending, 0, __ATOMIC_ACQUIRE);
+}
+
+void haptics_get(int controller_id, unsigned short* low_freq_motor, unsigned short* high_freq_motor) {
+  uint32_t value = __atomic_load_n(&rumble_values[controller_id], __ATOMIC_RELAXED);
+  *low_freq_motor = value >> 16;
+  *high_freq_motor = value & 0xFFFF;
+}
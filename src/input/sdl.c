@@ -18,6 +18,7 @@
  */
 
 #include "sdl.h"
+#include "haptics.h"
 #include "../sdl.h"
 
 #include <Limelight.h>
@@ -83,6 +84,8 @@ static void init_gamepad(int joystick_index) {
   }
 }
 
+static void sdlinput_handle_rumble();
+
 void sdlinput_init(char* mappings) {
   memset(gamepads, 0, sizeof(gamepads));
 
@@ -267,25 +270,26 @@ int sdlinput_handle_event(SDL_Event* event) {
 
     LiSendMultiControllerEvent(gamepad->id, activeGamepadMask, gamepad->buttons, gamepad->leftTrigger, gamepad->rightTrigger, gamepad->leftStickX, gamepad->leftStickY, gamepad->rightStickX, gamepad->rightStickY);
     break;
+  case SDL_USEREVENT:
+    if (event->user.code == SDL_CODE_RUMBLE)
+      sdlinput_handle_rumble();
+
+    break;
   }
   return SDL_NOTHING;
 }
 
-void sdlinput_rumble(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor) {
-  if (controller_id >= 4)
-    return;
-
-  PGAMEPAD_STATE state = &gamepads[controller_id];
-
+static void sdlinput_apply_rumble(PGAMEPAD_STATE state, unsigned short low_freq_motor, unsigned short high_freq_motor) {
   SDL_Haptic* haptic = state->haptic;
   if (!haptic)
     return;
 
-  if (state->haptic_effect_id >= 0)
-    SDL_HapticDestroyEffect(haptic, state->haptic_effect_id);
+  if (low_freq_motor == 0 && high_freq_motor == 0) {
+    if (state->haptic_effect_id >= 0)
+      SDL_HapticStopEffect(haptic, state->haptic_effect_id);
 
-  if (low_freq_motor == 0 && high_freq_motor == 0)
     return;
+  }
 
   SDL_HapticEffect effect;
   SDL_memset(&effect, 0, sizeof(effect));
@@ -296,7 +300,40 @@ void sdlinput_rumble(unsigned short controller_id, unsigned short low_freq_motor
   effect.leftright.large_magnitude = low_freq_motor / 2;
   effect.leftright.small_magnitude = high_freq_motor / 2;
 
+  // Keep a single effect per gamepad and update it in place
+  if (state->haptic_effect_id >= 0 && SDL_HapticUpdateEffect(haptic, state->haptic_effect_id, &effect) == 0) {
+    if (SDL_HapticGetEffectStatus(haptic, state->haptic_effect_id) != 1)
+      SDL_HapticRunEffect(haptic, state->haptic_effect_id, 1);
+
+    return;
+  }
+
+  if (state->haptic_effect_id >= 0)
+    SDL_HapticDestroyEffect(haptic, state->haptic_effect_id);
+
   state->haptic_effect_id = SDL_HapticNewEffect(haptic, &effect);
   if (state->haptic_effect_id >= 0)
     SDL_HapticRunEffect(haptic, state->haptic_effect_id, 1);
 }
+
+static void sdlinput_handle_rumble() {
+  int pending = haptics_pending();
+  for (int i = 0; i < HAPTICS_MAX_CONTROLLERS; i++) {
+    if (pending & (1 << i)) {
+      unsigned short low_freq_motor, high_freq_motor;
+      haptics_get(i, &low_freq_motor, &high_freq_motor);
+      sdlinput_apply_rumble(&gamepads[i], low_freq_motor, high_freq_motor);
+    }
+  }
+}
+
+// Called from the control thread, the effect is applied on the event loop
+void sdlinput_rumble(unsigned short controller_id, unsigned short low_freq_motor, unsigned short high_freq_motor) {
+  if (haptics_queue(controller_id, low_freq_motor, high_freq_motor)) {
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = SDL_USEREVENT;
+    event.user.code = SDL_CODE_RUMBLE;
+    SDL_PushEvent(&event);
+  }
+}
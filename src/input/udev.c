@@ -48,7 +48,7 @@ static int udev_handle(int fd) {
       const char *devnode = udev_device_get_devnode(dev);
       int id;
       if (devnode != NULL && sscanf(devnode, "/dev/input/event%d", &id) == 1) {
-        evdev_create(devnode, defaultMappings, debug, inputRotate);
+        evdev_create_async(devnode, defaultMappings, debug, inputRotate);
       }
     }
     udev_device_unref(dev);
@@ -97,6 +97,13 @@ void udev_init(bool autoload, struct mapping* mappings, bool verbose, int rotate
   loop_add_fd(udev_fd, &udev_handle, POLLIN);
 }
 
-void evdev_destroy() {
+void udev_destroy() {
+  if (udev_mon != NULL) {
+    loop_remove_fd(udev_monitor_get_fd(udev_mon));
+    udev_monitor_unref(udev_mon);
+    udev_mon = NULL;
+  }
+
   udev_unref(udev);
+  udev = NULL;
 }
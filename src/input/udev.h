@@ -20,4 +20,4 @@
 #include "mapping.h"
 
 void udev_init(bool autoload, struct mapping* mappings, bool verbose, int rotate);
-void evdev_destroy();
+void udev_destroy();
@@ -21,11 +21,16 @@
 #include "keyboard.h"
 
 #include "../loop.h"
+#include "../logging.h"
 
 #include <Limelight.h>
 
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
+#ifdef HAVE_XINPUT2
+#include <X11/extensions/XInput.h>
+#include <X11/extensions/XInput2.h>
+#endif
 
 #include <stdbool.h>
 #include <stdlib.h>
@@ -34,95 +39,387 @@
 #define ACTION_MODIFIERS (MODIFIER_SHIFT|MODIFIER_ALT|MODIFIER_CTRL)
 #define QUIT_KEY 0x18  /* KEY_Q */
 
+#define MAX_SOURCES 16
+#define MAX_BUTTONS 32
+/* Interval in server time between attempts to confine the pointer after a failure */
+#define GRAB_RETRY_MS 250
+
+/* Connection owned by the video renderer, only used for window manager messages */
 static Display *display;
+/* Dedicated connection for input so event reading never contends on the
+ * Xlib lock the renderer holds while presenting frames */
+static Display *input_display;
 static Window window;
 
 static Atom wm_deletemessage;
 
 static int last_x = -1, last_y = -1;
+static int center_x, center_y;
 static int keyboard_modifiers;
 
 static const char data[1] = {0};
 static Cursor cursor;
 static bool grabbed = True;
+static bool focused = True;
 
-static int x11_handler(int fd) {
-  XEvent event;
+#ifdef HAVE_XINPUT2
+static int xi_opcode = -1;
+static double remainder_x, remainder_y;
+
+/* Raw events carry the physical button and the unprocessed axes of the
+ * device that caused them, so its button map and axis mode are looked up
+ * once and kept until the devices or the pointer mapping change */
+struct x11_source {
+  int id;
+  bool absolute;
+  int buttons;
+  unsigned char map[MAX_BUTTONS];
+};
+
+static struct x11_source sources[MAX_SOURCES];
+static int source_count;
+static bool source_error;
+/* Whether the last raw motion came from a device with absolute axes */
+static bool absolute_motion;
+
+static bool pointer_grabbed, grab_failed;
+static Time event_time, grab_time;
+
+static int x11_source_error(Display* dpy, XErrorEvent* error) {
+  source_error = true;
+  return 0;
+}
+
+static struct x11_source* x11_get_source(int id) {
+  for (int i = 0; i < source_count; i++) {
+    if (sources[i].id == id)
+      return &sources[i];
+  }
+
+  if (source_count == MAX_SOURCES)
+    source_count = 0;
+
+  struct x11_source* source = &sources[source_count++];
+  source->id = id;
+  source->absolute = false;
+  source->buttons = 0;
+
+  /* The device may be removed in the meantime, which X reports as an error instead of a result */
+  XSync(input_display, False);
+  source_error = false;
+  int (*handler)(Display*, XErrorEvent*) = XSetErrorHandler(x11_source_error);
+
+  int count;
+  XIDeviceInfo* info = XIQueryDevice(input_display, id, &count);
+  if (info != NULL) {
+    for (int i = 0; i < info->num_classes; i++) {
+      XIValuatorClassInfo* valuator = (XIValuatorClassInfo*) info->classes[i];
+      if (valuator->type == XIValuatorClass && valuator->number < 2 && valuator->mode == XIModeAbsolute)
+        source->absolute = true;
+    }
+    XIFreeDeviceInfo(info);
+  }
+
+  XDevice* device = XOpenDevice(input_display, id);
+  if (device != NULL) {
+    int buttons = XGetDeviceButtonMapping(input_display, device, source->map, MAX_BUTTONS);
+    source->buttons = buttons < MAX_BUTTONS ? buttons : MAX_BUTTONS;
+    XCloseDevice(input_display, device);
+  }
+
+  XSync(input_display, False);
+  XSetErrorHandler(handler);
+  if (source_error)
+    source->buttons = 0;
+
+  return source;
+}
+
+static const char* x11_grab_error(int result) {
+  switch (result) {
+  case AlreadyGrabbed:
+    return "grabbed by another client";
+  case GrabNotViewable:
+    return "window not viewable";
+  case GrabFrozen:
+    return "pointer frozen";
+  default:
+    return "invalid time";
+  }
+}
+
+/* Confine the pointer once instead of warping it back on every move. The
+ * window manager may still hold a grab when focus arrives, so a failed
+ * attempt is retried on later pointer events. */
+static void x11_grab_pointer() {
+  grab_time = event_time;
+  int result = XGrabPointer(input_display, window, True, PointerMotionMask, GrabModeAsync, GrabModeAsync, window, cursor, CurrentTime);
+  pointer_grabbed = result == GrabSuccess;
+  if (!pointer_grabbed && !grab_failed)
+    _moonlight_log(WARN, "Can't confine the pointer to the window (%s), retrying\n", x11_grab_error(result));
+
+  grab_failed = !pointer_grabbed;
+}
+
+static void x11_retry_grab() {
+  if (!pointer_grabbed && event_time - grab_time >= GRAB_RETRY_MS) {
+    x11_grab_pointer();
+    XFlush(input_display);
+  }
+}
+#endif
+
+static void x11_set_grab(bool grab) {
+  grabbed = grab;
+  XDefineCursor(input_display, window, grabbed ? cursor : 0);
+  #ifdef HAVE_XINPUT2
+  if (xi_opcode >= 0) {
+    if (grabbed && focused)
+      x11_grab_pointer();
+    else {
+      XUngrabPointer(input_display, CurrentTime);
+      pointer_grabbed = false;
+    }
+  }
+  #endif
+  XFlush(input_display);
+}
+
+static int x11_handle_key(int keycode, bool press) {
+  if (keycode < 8 || keycode >= (sizeof(keyCodes)/sizeof(keyCodes[0]) + 8))
+    return LOOP_OK;
+
+  if ((keyboard_modifiers & ACTION_MODIFIERS) == ACTION_MODIFIERS && !press) {
+    if (keycode == QUIT_KEY)
+      return LOOP_RETURN;
+    else
+      x11_set_grab(!grabbed);
+  }
+
+  int modifier = 0;
+  switch (keycode) {
+  case 0x32:
+  case 0x3e:
+    modifier = MODIFIER_SHIFT;
+    break;
+  case 0x40:
+  case 0x6c:
+    modifier = MODIFIER_ALT;
+    break;
+  case 0x25:
+  case 0x69:
+    modifier = MODIFIER_CTRL;
+    break;
+  }
+
+  if (modifier != 0) {
+    if (press)
+      keyboard_modifiers |= modifier;
+    else
+      keyboard_modifiers &= ~modifier;
+  }
+
+  short code = 0x80 << 8 | keyCodes[keycode - 8];
+  LiSendKeyboardEvent(code, press ? KEY_ACTION_DOWN : KEY_ACTION_UP, keyboard_modifiers);
+  return LOOP_OK;
+}
+
+static void x11_handle_button(int x11_button, bool press) {
   int button = 0;
+  switch (x11_button) {
+  case Button1:
+    button = BUTTON_LEFT;
+    break;
+  case Button2:
+    button = BUTTON_MIDDLE;
+    break;
+  case Button3:
+    button = BUTTON_RIGHT;
+    break;
+  case Button4:
+    if (press)
+      LiSendScrollEvent(1);
+    break;
+  case Button5:
+    if (press)
+      LiSendScrollEvent(-1);
+    break;
+  case 8:
+    button = BUTTON_X1;
+    break;
+  case 9:
+    button = BUTTON_X2;
+    break;
+  }
+
+  if (button != 0)
+    LiSendMouseButtonEvent(press ? BUTTON_ACTION_PRESS : BUTTON_ACTION_RELEASE, button);
+}
+
+#ifdef HAVE_XINPUT2
+/* Absolute devices such as tablets and the pointers of virtual machines
+ * report positions in their raw events, their motion is taken from the
+ * core events instead and the pointer isn't warped back */
+static void x11_handle_absolute_motion(int x, int y) {
+  if (absolute_motion && grabbed && focused && last_x >= 0 && last_y >= 0 && (x != last_x || y != last_y))
+    LiSendMouseMoveEvent(x - last_x, y - last_y);
+
+  last_x = x;
+  last_y = y;
+}
+
+static int x11_handle_xi_event(XGenericEventCookie* cookie) {
+  XIRawEvent* raw;
+  XIDeviceEvent* device_event;
+  struct x11_source* source;
+  int button;
+  int ret = LOOP_OK;
+
+  switch (cookie->evtype) {
+  case XI_RawMotion:
+    raw = (XIRawEvent*) cookie->data;
+    event_time = raw->time;
+    if (!grabbed || !focused)
+      break;
+
+    x11_retry_grab();
+    absolute_motion = x11_get_source(raw->sourceid)->absolute;
+    if (absolute_motion)
+      break;
+
+    /* Raw values are unaccelerated and may carry sub-pixel motion, keep the remainder for the next event */
+    double* value = raw->raw_values;
+    double delta_x = 0, delta_y = 0;
+    for (int i = 0; i < raw->valuators.mask_len * 8 && i < 2; i++) {
+      if (XIMaskIsSet(raw->valuators.mask, i)) {
+        if (i == 0)
+          delta_x = *value;
+        else
+          delta_y = *value;
+
+        value++;
+      }
+    }
+
+    remainder_x += delta_x;
+    remainder_y += delta_y;
+    int motion_x = (int) remainder_x;
+    int motion_y = (int) remainder_y;
+    remainder_x -= motion_x;
+    remainder_y -= motion_y;
+    if (motion_x != 0 || motion_y != 0)
+      LiSendMouseMoveEvent(motion_x, motion_y);
+
+    break;
+  case XI_RawButtonPress:
+  case XI_RawButtonRelease:
+    raw = (XIRawEvent*) cookie->data;
+    event_time = raw->time;
+    if (!grabbed || !focused)
+      break;
+
+    x11_retry_grab();
+    /* Apply the button map, which may be changed for left handed use */
+    source = x11_get_source(raw->sourceid);
+    button = raw->detail >= 1 && raw->detail <= source->buttons ? source->map[raw->detail - 1] : raw->detail;
+    x11_handle_button(button, cookie->evtype == XI_RawButtonPress);
+    break;
+  case XI_KeyPress:
+  case XI_KeyRelease:
+    device_event = (XIDeviceEvent*) cookie->data;
+    if (!(device_event->flags & XIKeyRepeat))
+      ret = x11_handle_key(device_event->detail, cookie->evtype == XI_KeyPress);
+
+    break;
+  case XI_FocusIn:
+  case XI_FocusOut:
+    focused = cookie->evtype == XI_FocusIn;
+    /* Button maps set per device don't notify, pick up changes made while away */
+    if (focused)
+      source_count = 0;
+
+    x11_set_grab(grabbed);
+    break;
+  case XI_HierarchyChanged:
+    source_count = 0;
+    break;
+  }
+
+  return ret;
+}
+
+static bool x11_xinput2_init() {
+  int event, error;
+  if (!XQueryExtension(input_display, "XInputExtension", &xi_opcode, &event, &error)) {
+    xi_opcode = -1;
+    return false;
+  }
+
+  /* Raw events for all devices are delivered to the root window since XI 2.1 */
+  int major = 2, minor = 1;
+  if (XIQueryVersion(input_display, &major, &minor) != Success || (major == 2 && minor < 1)) {
+    xi_opcode = -1;
+    return false;
+  }
+
+  unsigned char root_mask_bits[XIMaskLen(XI_LASTEVENT)] = {0};
+  XIEventMask root_mask = { .deviceid = XIAllMasterDevices, .mask_len = sizeof(root_mask_bits), .mask = root_mask_bits };
+  XISetMask(root_mask_bits, XI_RawMotion);
+  XISetMask(root_mask_bits, XI_RawButtonPress);
+  XISetMask(root_mask_bits, XI_RawButtonRelease);
+  XISelectEvents(input_display, DefaultRootWindow(input_display), &root_mask, 1);
+
+  unsigned char hierarchy_mask_bits[XIMaskLen(XI_LASTEVENT)] = {0};
+  XIEventMask hierarchy_mask = { .deviceid = XIAllDevices, .mask_len = sizeof(hierarchy_mask_bits), .mask = hierarchy_mask_bits };
+  XISetMask(hierarchy_mask_bits, XI_HierarchyChanged);
+  XISelectEvents(input_display, DefaultRootWindow(input_display), &hierarchy_mask, 1);
+
+  unsigned char window_mask_bits[XIMaskLen(XI_LASTEVENT)] = {0};
+  XIEventMask window_mask = { .deviceid = XIAllMasterDevices, .mask_len = sizeof(window_mask_bits), .mask = window_mask_bits };
+  XISetMask(window_mask_bits, XI_KeyPress);
+  XISetMask(window_mask_bits, XI_KeyRelease);
+  XISetMask(window_mask_bits, XI_FocusIn);
+  XISetMask(window_mask_bits, XI_FocusOut);
+  XISelectEvents(input_display, window, &window_mask, 1);
+
+  /* Core motion for devices with absolute axes */
+  XSelectInput(input_display, window, PointerMotionMask);
+
+  return true;
+}
+#endif
+
+static int x11_input_handler(int fd) {
+  XEvent event;
+  int ret = LOOP_OK;
   int motion_x, motion_y;
 
-  while (XPending(display)) {
-    XNextEvent(display, &event);
+  while (ret == LOOP_OK && XPending(input_display)) {
+    XNextEvent(input_display, &event);
     switch (event.type) {
+    #ifdef HAVE_XINPUT2
+    case GenericEvent:
+      if (event.xcookie.extension == xi_opcode && XGetEventData(input_display, &event.xcookie)) {
+        ret = x11_handle_xi_event(&event.xcookie);
+        XFreeEventData(input_display, &event.xcookie);
+      }
+      break;
+    #endif
     case KeyPress:
     case KeyRelease:
-      if (event.xkey.keycode >= 8 && event.xkey.keycode < (sizeof(keyCodes)/sizeof(keyCodes[0]) + 8)) {
-        if ((keyboard_modifiers & ACTION_MODIFIERS) == ACTION_MODIFIERS && event.type == KeyRelease) {
-          if (event.xkey.keycode == QUIT_KEY)
-            return LOOP_RETURN;
-          else {
-            grabbed = !grabbed;
-            XDefineCursor(display, window, grabbed ? cursor : 0);
-          }
-        }
-
-        int modifier = 0;
-        switch (event.xkey.keycode) {
-        case 0x32:
-        case 0x3e:
-          modifier = MODIFIER_SHIFT;
-          break;
-        case 0x40:
-        case 0x6c:
-          modifier = MODIFIER_ALT;
-          break;
-        case 0x25:
-        case 0x69:
-          modifier = MODIFIER_CTRL;
-          break;
-        }
-
-        if (modifier != 0) {
-          if (event.type == KeyPress)
-            keyboard_modifiers |= modifier;
-          else
-            keyboard_modifiers &= ~modifier;
-        }
-
-        short code = 0x80 << 8 | keyCodes[event.xkey.keycode - 8];
-        LiSendKeyboardEvent(code, event.type == KeyPress ? KEY_ACTION_DOWN : KEY_ACTION_UP, keyboard_modifiers);
-      }
+      ret = x11_handle_key(event.xkey.keycode, event.type == KeyPress);
       break;
     case ButtonPress:
     case ButtonRelease:
-      switch (event.xbutton.button) {
-      case Button1:
-        button = BUTTON_LEFT;
-        break;
-      case Button2:
-        button = BUTTON_MIDDLE;
-        break;
-      case Button3:
-        button = BUTTON_RIGHT;
-        break;
-      case Button4:
-        LiSendScrollEvent(1);
-        break;
-      case Button5:
-        LiSendScrollEvent(-1);
-        break;
-      case 8:
-        button = BUTTON_X1;
-        break;
-      case 9:
-        button = BUTTON_X2;
-        break;
-      }
-
-      if (button != 0)
-        LiSendMouseButtonEvent(event.type==ButtonPress ? BUTTON_ACTION_PRESS : BUTTON_ACTION_RELEASE, button);
+      x11_handle_button(event.xbutton.button, event.type == ButtonPress);
       break;
     case MotionNotify:
+      #ifdef HAVE_XINPUT2
+      if (xi_opcode >= 0) {
+        x11_handle_absolute_motion(event.xmotion.x, event.xmotion.y);
+        break;
+      }
+      #endif
       motion_x = event.xmotion.x - last_x;
       motion_y = event.xmotion.y - last_y;
       if (abs(motion_x) > 0 || abs(motion_y) > 0) {
@@ -130,20 +427,43 @@ static int x11_handler(int fd) {
           LiSendMouseMoveEvent(motion_x, motion_y);
 
         if (grabbed)
-          XWarpPointer(display, None, window, 0, 0, 0, 0, 640, 360);
+          XWarpPointer(input_display, None, window, 0, 0, 0, 0, center_x, center_y);
       }
 
-      last_x = grabbed ? 640 : event.xmotion.x;
-      last_y = grabbed ? 360 : event.xmotion.y;
+      last_x = grabbed ? center_x : event.xmotion.x;
+      last_y = grabbed ? center_y : event.xmotion.y;
+      break;
+    case ConfigureNotify:
+      center_x = event.xconfigure.width / 2;
+      center_y = event.xconfigure.height / 2;
       break;
     case ClientMessage:
       if (event.xclient.data.l[0] == wm_deletemessage)
-        return LOOP_RETURN;
+        ret = LOOP_RETURN;
+
+      break;
+    #ifdef HAVE_XINPUT2
+    case MappingNotify:
+      if (event.xmapping.request == MappingPointer)
+        source_count = 0;
 
       break;
+    #endif
     }
   }
 
+  return ret;
+}
+
+static int x11_handler(int fd) {
+  XEvent event;
+
+  while (XPending(display)) {
+    XNextEvent(display, &event);
+    if (event.type == ClientMessage && event.xclient.data.l[0] == wm_deletemessage)
+      return LOOP_RETURN;
+  }
+
   return LOOP_OK;
 }
 
@@ -154,12 +474,50 @@ void x11_input_init(Display* x11_display, Window x11_window) {
   wm_deletemessage = XInternAtom(display, "WM_DELETE_WINDOW", False);
   XSetWMProtocols(display, window, &wm_deletemessage, 1);
 
+  input_display = XOpenDisplay(DisplayString(display));
+  if (input_display == NULL) {
+    _moonlight_log(WARN, "Can't open dedicated X connection for input\n");
+    input_display = display;
+  }
+
   /* make a blank cursor */
   XColor dummy;
-  Pixmap blank = XCreateBitmapFromData(display, window, data, 1, 1);
-  cursor = XCreatePixmapCursor(display, blank, blank, &dummy, &dummy, 0, 0);
-  XFreePixmap(display, blank);
-  XDefineCursor(display, window, cursor);
+  Pixmap blank = XCreateBitmapFromData(input_display, window, data, 1, 1);
+  cursor = XCreatePixmapCursor(input_display, blank, blank, &dummy, &dummy, 0, 0);
+  XFreePixmap(input_display, blank);
+
+  #ifdef HAVE_XINPUT2
+  if (!x11_xinput2_init())
+  #endif
+  {
+    _moonlight_log(WARN, "XInput 2.1 not available, falling back to core pointer events\n");
+    XWindowAttributes attributes;
+    XGetWindowAttributes(input_display, window, &attributes);
+    center_x = attributes.width / 2;
+    center_y = attributes.height / 2;
+    XSelectInput(input_display, window, PointerMotionMask | ButtonPressMask | ButtonReleaseMask | KeyPressMask | KeyReleaseMask | StructureNotifyMask);
+  }
+
+  x11_set_grab(grabbed);
+
+  if (input_display != display) {
+    loop_add_fd(ConnectionNumber(input_display), x11_input_handler, POLLIN | POLLERR | POLLHUP);
+    loop_add_fd(ConnectionNumber(display), x11_handler, POLLIN | POLLERR | POLLHUP);
+  } else
+    loop_add_fd(ConnectionNumber(display), x11_input_handler, POLLIN | POLLERR | POLLHUP);
+}
+
+void x11_input_destroy() {
+  if (input_display == NULL)
+    return;
+
+  loop_remove_fd(ConnectionNumber(display));
+  if (input_display != display) {
+    loop_remove_fd(ConnectionNumber(input_display));
+    // Closing the connection releases its grabs and the blank cursor
+    XCloseDisplay(input_display);
+  } else
+    XFreeCursor(display, cursor);
 
-  loop_add_fd(ConnectionNumber(display), x11_handler, POLLIN | POLLERR | POLLHUP);
+  input_display = NULL;
 }
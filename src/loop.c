@@ -34,7 +34,8 @@ static struct pollfd* fds = NULL;
 static FdHandler* fdHandlers = NULL;
 static int numFds = 0;
 
-static int sigFd;
+static int sigFd = -1;
+static bool stopped = false;
 
 static int loop_sig_handler(int fd) {
   struct signalfd_siginfo info;
@@ -44,6 +45,10 @@ static int loop_sig_handler(int fd) {
     case SIGTERM:
     case SIGQUIT:
     case SIGHUP:
+      stopped = true;
+      return LOOP_RETURN;
+    case SIGUSR1:
+      // The connection ended, which only ends the session
       return LOOP_RETURN;
   }
   return LOOP_OK;
@@ -72,8 +77,7 @@ void loop_add_fd(int fd, FdHandler handler, int events) {
 }
 
 void loop_remove_fd(int fd) {
-  numFds--;
-  int fdindex;
+  int fdindex = -1;
 
   for (int i=0;i<numFds;i++) {
     if (fds[i].fd == fd) {
@@ -82,13 +86,21 @@ void loop_remove_fd(int fd) {
     }
   }
 
-  if (fdindex != numFds && numFds > 0) {
+  if (fdindex < 0)
+    return;
+
+  numFds--;
+  if (fdindex != numFds) {
     memcpy(&fds[fdindex], &fds[numFds], sizeof(struct pollfd));
     memcpy(&fdHandlers[fdindex], &fdHandlers[numFds], sizeof(FdHandler));
   }
 }
 
 void loop_init() {
+  // The daemon sets up the loop once for all its sessions
+  if (sigFd >= 0)
+    return;
+
   main_thread_id = pthread_self();
   sigset_t sigset;
   sigemptyset(&sigset);
@@ -96,6 +108,7 @@ void loop_init() {
   sigaddset(&sigset, SIGTERM);
   sigaddset(&sigset, SIGINT);
   sigaddset(&sigset, SIGQUIT);
+  sigaddset(&sigset, SIGUSR1);
   sigprocmask(SIG_BLOCK, &sigset, NULL);
   sigFd = signalfd(-1, &sigset, 0);
   loop_add_fd(sigFd, loop_sig_handler, POLLIN | POLLERR | POLLHUP);
@@ -113,3 +126,7 @@ void loop_main() {
     }
   }
 }
+
+bool loop_stopped() {
+  return stopped;
+}
@@ -17,6 +17,8 @@
  * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdbool.h>
+
 #define LOOP_RETURN 1
 #define LOOP_OK 0
 
@@ -27,3 +29,4 @@ void loop_remove_fd(int fd);
 
 void loop_init();
 void loop_main();
+bool loop_stopped();
@@ -24,6 +24,11 @@
 #include "config.h"
 #include "platform.h"
 #include "sdl.h"
+#include "sync.h"
+#include "mtu.h"
+#include "bandwidth.h"
+#include "adaptive.h"
+#include "control.h"
 
 #include "audio/audio.h"
 #include "video/video.h"
@@ -52,10 +57,61 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <openssl/rand.h>
 #include "logging.h"
 
+static struct timespec start_time;
+
+static DECODER_RENDERER_CALLBACKS timed_video;
+static int (*timed_submit_decode_unit)(PDECODE_UNIT decodeUnit);
+static bool first_frame_seen;
+static long first_frame_ms = -1;
+static bool warm_start = false;
+
+// The daemon keeps the server, the app list and the inputs between sessions
+static PSERVER_DATA daemon_server;
+static PCONFIGURATION daemon_config;
+static PAPP_LIST daemon_apps;
+static char* daemon_app;
+static char* pending_app = NULL;
+static bool quit_pending = false;
+static bool streaming = false;
+
+static long elapsed_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start_time.tv_sec) * 1000 + (now.tv_nsec - start_time.tv_nsec) / 1000000;
+}
+
+static int submit_decode_unit_timed(PDECODE_UNIT decodeUnit) {
+  if (!__atomic_exchange_n(&first_frame_seen, true, __ATOMIC_RELAXED)) {
+    long ms = elapsed_ms();
+    __atomic_store_n(&first_frame_ms, ms, __ATOMIC_RELAXED);
+    _moonlight_log(INFO, "First frame %ld ms after %s\n", ms, warm_start ? "the stream command (warm start)" : "invocation (cold start)");
+  }
+
+  return timed_submit_decode_unit(decodeUnit);
+}
+
+// Time to first frame is what the daemon saves on, so it's measured for every session
+static PDECODER_RENDERER_CALLBACKS time_first_frame(PDECODER_RENDERER_CALLBACKS callbacks) {
+  timed_video = *callbacks;
+  timed_submit_decode_unit = callbacks->submitDecodeUnit;
+  timed_video.submitDecodeUnit = submit_decode_unit_timed;
+  first_frame_seen = false;
+  return &timed_video;
+}
+
+static void pair_check(PSERVER_DATA server) {
+  if (!server->paired) {
+    _moonlight_log(ERR, "You must pair with the PC first\n");
+    exit(-1);
+  }
+}
+
 static void applist(PSERVER_DATA server) {
   PAPP_LIST list = NULL;
   if (gs_applist(server, &list) != GS_OK) {
@@ -70,13 +126,71 @@ static void applist(PSERVER_DATA server) {
   }
 }
 
-static int get_app_id(PSERVER_DATA server, const char *name) {
-  PAPP_LIST list = NULL;
-  if (gs_applist(server, &list) != GS_OK) {
-    _moonlight_log(ERR, "Can't get app list\n");
-    return -1;
+static void discover() {
+  PDISCOVERY discovery = gs_discover_start(DISCOVER_TIMEOUT);
+  if (discovery == NULL) {
+    _moonlight_log(ERR, "Can't search for servers: %s\n", gs_error);
+    return;
   }
 
+  PDISCOVERED_HOST host = gs_discover_wait(discovery);
+  if (host == NULL)
+    printf("No servers found\n");
+
+  for (; host != NULL; host = host->next) {
+    if (host->reachable)
+      printf("%s (%s) %.1f ms\n", host->name, host->address, host->probeTime);
+    else
+      printf("%s (%s) not responding\n", host->name, host->address);
+  }
+
+  gs_discover_free(discovery);
+}
+
+static void select_host(PCONFIGURATION config) {
+  _moonlight_log(INFO, "Measuring latency to servers...\n");
+  PDISCOVERY discovery = gs_discover_start(DISCOVER_TIMEOUT);
+  if (discovery == NULL) {
+    _moonlight_log(ERR, "Not enough memory\n");
+    exit(-1);
+  }
+
+  // Hosts from the command line or configuration compete with the discovered ones
+  if (config->address != NULL) {
+    char* addresses = strdup(config->address);
+    for (char* address = strtok(addresses, ","); address != NULL; address = strtok(NULL, ","))
+      gs_discover_add_host(discovery, address);
+
+    free(addresses);
+  }
+
+  PDISCOVERED_HOST best = gs_discover_rank(discovery, RANK_PROBES);
+  int rank = 1;
+  for (PDISCOVERED_HOST host = best; host != NULL; host = host->next, rank++) {
+    if (host->reachable)
+      _moonlight_log(INFO, "%d. %s (%s): rtt %.1f ms, jitter %.1f ms, %d/%d lost, %s\n", rank, host->name, host->address, host->rtt, host->jitter, host->lost, RANK_PROBES, host->busy ? "busy" : "idle");
+    else
+      _moonlight_log(INFO, "%d. %s (%s): not responding\n", rank, host->name, host->address);
+  }
+
+  if (best == NULL || !best->reachable) {
+    _moonlight_log(ERR, "No server responded\n");
+    exit(-1);
+  } else if (best->busy)
+    _moonlight_log(WARN, "All servers are busy\n");
+
+  config->address = malloc(MAX_ADDRESS_SIZE);
+  if (config->address == NULL) {
+    perror("Not enough memory");
+    exit(-1);
+  }
+  strcpy(config->address, best->address);
+  _moonlight_log(INFO, "Selected %s (%s)\n", best->name, best->address);
+
+  gs_discover_free(discovery);
+}
+
+static int find_app_id(PAPP_LIST list, const char *name) {
   while (list != NULL) {
     if (strcmp(list->name, name) == 0)
       return list->id;
@@ -86,11 +200,49 @@ static int get_app_id(PSERVER_DATA server, const char *name) {
   return -1;
 }
 
-static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform system) {
-  int appId = get_app_id(server, config->app);
+static int get_app_id(PSERVER_DATA server, const char *name) {
+  PAPP_LIST list = NULL;
+  if (gs_applist(server, &list) != GS_OK) {
+    _moonlight_log(ERR, "Can't get app list\n");
+    return -1;
+  }
+
+  return find_app_id(list, name);
+}
+
+// Replace the cached server data with a fresh copy before looking up the app again
+static int refresh_app_id(PSERVER_DATA server, const char *name) {
+  int ret = gs_refresh(server);
+  if (ret != GS_OK) {
+    _moonlight_log(ERR, "Can't connect to server %s (%d)\n", server->serverInfo.address, ret);
+    return -1;
+  } else if (!server->paired) {
+    _moonlight_log(ERR, "You must pair with the PC first\n");
+    return -1;
+  }
+
+  return get_app_id(server, name);
+}
+
+static void* revalidate_cache(void* data) {
+  PSERVER_DATA server = data;
+  if (gs_update_cache(server) != GS_OK)
+    _moonlight_log(WARN, "Can't update cached data of %s\n", server->serverInfo.address);
+
+  return NULL;
+}
+
+// Returns false when the stream couldn't be started
+static bool stream(PSERVER_DATA server, PCONFIGURATION config, enum platform system, PAPP_LIST cached_apps) {
+  bool cached = cached_apps != NULL;
+  int appId = cached ? find_app_id(cached_apps, config->app) : get_app_id(server, config->app);
+  if (appId<0 && cached) {
+    cached = false;
+    appId = refresh_app_id(server, config->app);
+  }
   if (appId<0) {
     _moonlight_log(ERR, "Can't find app %s\n", config->app);
-    exit(-1);
+    return false;
   }
 
   int gamepads = 0;
@@ -102,7 +254,35 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
   for (int i = 0; i < gamepads && i < 4; i++)
     gamepad_mask = (gamepad_mask << 1) + 1;
 
+  // Probed before the launch, while the host has no stream sockets open
+  if (config->stream.packetSize == -1) {
+    const char* reason = "remote streaming";
+    if (config->stream.streamingRemotely)
+      config->stream.packetSize = DEFAULT_PACKET_SIZE;
+    else
+      config->stream.packetSize = mtu_packet_size(server->serverInfo.address, &reason);
+
+    _moonlight_log(INFO, "Using packet size %d (%s)\n", config->stream.packetSize, reason);
+  }
+
+  if (config->auto_bitrate && config->bitrate_headroom > 0) {
+    int bitrate = bandwidth_bitrate(server, appId, config->key_dir, config->bitrate_headroom);
+    if (bitrate > 0)
+      config->stream.bitrate = bitrate;
+
+    _moonlight_log(INFO, "Using bitrate %d kbps (%s)\n", config->stream.bitrate, bitrate > 0 ? "measured" : "default");
+  }
+
   int ret = gs_start_app(server, &config->stream, appId, config->sops, config->localaudio, gamepad_mask);
+  if (ret < 0 && cached) {
+    // The cache is only trusted until the server disagrees with it
+    _moonlight_log(WARN, "Launch with cached server data failed, fetching it again\n");
+    cached = false;
+    if ((appId = refresh_app_id(server, config->app)) >= 0)
+      ret = gs_start_app(server, &config->stream, appId, config->sops, config->localaudio, gamepad_mask);
+    else
+      _moonlight_log(ERR, "Can't find app %s\n", config->app);
+  }
   if (ret < 0) {
     if (ret == GS_NOT_SUPPORTED_4K)
       _moonlight_log(ERR, "Server doesn't support 4K\n");
@@ -114,9 +294,12 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
       _moonlight_log(ERR, "Gamestream error: %s\n", gs_error);
     else
       _moonlight_log(ERR, "Errorcode starting app: %d\n", ret);
-    exit(-1);
+    return false;
   }
 
+  pthread_t revalidate_thread;
+  bool revalidating = cached && pthread_create(&revalidate_thread, NULL, revalidate_cache, server) == 0;
+
   int drFlags = 0;
   if (config->fullscreen)
     drFlags |= DISPLAY_FULLSCREEN;
@@ -142,6 +325,17 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
     loop_init();
 
   platform_start(system);
+  audio_pipeline_set_latency(config->audio_latency);
+  sync_init(config->av_sync);
+  #ifdef HAVE_ALSA
+  if (config->audio_tune)
+    alsa_set_auto_tune(config->key_dir);
+  if (config->audio_hw)
+    alsa_set_hw_direct();
+  #endif
+  #ifdef HAVE_PIPEWIRE
+  pipewire_set_quantum(config->audio_quantum);
+  #endif
   #ifdef HAVE_AML
   if(config->stream_start_delay >= 0) {
     alsa_set_audio_init_delay(config->stream_start_delay);
@@ -151,12 +345,45 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
     ((void (*)(void)) dlsym(RTLD_DEFAULT, "aml_use_optimized_fb_algorithm"))();
   }
   #endif
-  LiStartConnection(&server->serverInfo, &config->stream, &connection_callbacks, platform_get_video(system), platform_get_audio(system, config->audio_device), NULL, drFlags, config->audio_device, 0);
+
+  _moonlight_log(INFO, "Starting connection %ld ms after %s%s\n", elapsed_ms(), warm_start ? "the stream command" : "invocation", cached ? " (cached server data)" : "");
+  PDECODER_RENDERER_CALLBACKS video = platform_get_video(system);
+  PAUDIO_RENDERER_CALLBACKS audio = platform_get_audio(system, config->audio_device);
+  if (config->adaptive) {
+    if (IS_EMBEDDED(system)) {
+      adaptive_init(&config->stream);
+      video = adaptive_wrap_video(video);
+    } else
+      _moonlight_log(WARN, "Adaptive streaming isn't supported with SDL\n");
+  }
+  video = time_first_frame(video);
+
+  LiStartConnection(&server->serverInfo, &config->stream, &connection_callbacks, video, audio, NULL, drFlags, config->audio_device, 0);
 
   if (IS_EMBEDDED(system)) {
     if (!config->viewonly)
       evdev_start();
     loop_main();
+
+    // The adaptive controller leaves the loop to resume the stream with other settings
+    while (adaptive_restart_pending() && !loop_stopped()) {
+      LiStopConnection();
+      if (revalidating) {
+        pthread_join(revalidate_thread, NULL);
+        revalidating = false;
+      }
+
+      adaptive_apply(&config->stream);
+      if ((ret = gs_start_app(server, &config->stream, appId, config->sops, config->localaudio, gamepad_mask)) != GS_OK) {
+        _moonlight_log(ERR, "Adaptive: can't resume the stream (%d)\n", ret);
+        break;
+      }
+
+      LiStartConnection(&server->serverInfo, &config->stream, &connection_callbacks, video, audio, NULL, drFlags, config->audio_device, 0);
+      loop_main();
+    }
+
+    adaptive_destroy();
     if (!config->viewonly)
       evdev_stop();
   }
@@ -166,6 +393,10 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
   #endif
 
   LiStopConnection();
+  sync_report();
+
+  if (revalidating)
+    pthread_join(revalidate_thread, NULL);
 
   if (config->quitappafter) {
     if (config->debug_level > 0)
@@ -174,8 +405,117 @@ static void stream(PSERVER_DATA server, PCONFIGURATION config, enum platform sys
   }
 
   platform_stop(system);
+  return true;
+}
 
-  close_log();
+static int daemon_command(int client, char* command, char* argument) {
+  if (strcmp("stream", command) == 0) {
+    // A running session ends and the loop of the daemon starts the next one
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    free(pending_app);
+    pending_app = strdup(argument != NULL ? argument : daemon_app);
+    control_reply(client, "ok\n");
+    return LOOP_RETURN;
+  } else if (strcmp("quit", command) == 0) {
+    if (streaming) {
+      quit_pending = true;
+      control_reply(client, "ok\n");
+      return LOOP_RETURN;
+    } else if (gs_quit_app(daemon_server) != GS_OK)
+      control_reply(client, "error can't quit app\n");
+    else
+      control_reply(client, "ok\n");
+  } else if (strcmp("list", command) == 0) {
+    // Between sessions the list is fetched again, while streaming the known one is used
+    PAPP_LIST list = NULL;
+    if (!streaming && gs_applist(daemon_server, &list) == GS_OK) {
+      xml_free_applist(daemon_apps);
+      daemon_apps = list;
+    }
+
+    for (list = daemon_apps; list != NULL; list = list->next)
+      control_reply(client, "%d %s\n", list->id, list->name);
+    control_reply(client, "ok\n");
+  } else if (strcmp("status", command) == 0) {
+    if (streaming)
+      control_reply(client, "streaming %s %dx%d %d fps %d kbps\n", daemon_config->app, daemon_config->stream.width, daemon_config->stream.height, daemon_config->stream.fps, daemon_config->stream.bitrate);
+    else
+      control_reply(client, "idle\n");
+
+    long ms = __atomic_load_n(&first_frame_ms, __ATOMIC_RELAXED);
+    if (ms >= 0)
+      control_reply(client, "first frame %ld ms\n", ms);
+    control_reply(client, "ok\n");
+  } else
+    control_reply(client, "error unknown command %s\n", command);
+
+  return LOOP_OK;
+}
+
+// Certificates, the TLS connection to the server, the sound server connection, the platform
+// and the inputs stay set up between sessions, which only launch the app and start the connection
+static void serve(PSERVER_DATA server, PCONFIGURATION config, enum platform system) {
+  char path[4096];
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (config->control_socket != NULL)
+    snprintf(path, sizeof(path), "%s", config->control_socket);
+  else if (runtime_dir != NULL)
+    snprintf(path, sizeof(path), "%s/moonlight.sock", runtime_dir);
+  else
+    snprintf(path, sizeof(path), "%s/moonlight.sock", config->key_dir);
+
+  loop_init();
+  if (!control_init(path, daemon_command))
+    exit(-1);
+
+  daemon_server = server;
+  daemon_config = config;
+  if (gs_applist(server, &daemon_apps) != GS_OK)
+    _moonlight_log(WARN, "Can't get app list\n");
+
+  // Connects to the sound server now, the sessions reuse the connection
+  platform_get_audio(system, config->audio_device);
+
+  STREAM_CONFIGURATION base = config->stream;
+  daemon_app = config->app;
+  warm_start = true;
+  _moonlight_log(INFO, "Waiting for commands on %s\n", path);
+
+  while (!loop_stopped()) {
+    loop_main();
+
+    while (pending_app != NULL && !loop_stopped()) {
+      char* app = pending_app;
+      pending_app = NULL;
+      config->app = app;
+      config->stream = base;
+
+      // The server runs one app at a time, resuming would bring back the other one
+      int appId = find_app_id(daemon_apps, app);
+      if (appId >= 0 && server->currentGame != 0 && server->currentGame != appId) {
+        _moonlight_log(INFO, "Quitting the running app to start %s\n", app);
+        gs_quit_app(server);
+      }
+
+      streaming = true;
+      if (!stream(server, config, system, daemon_apps))
+        _moonlight_log(ERR, "Can't stream %s\n", app);
+      streaming = false;
+
+      if (quit_pending && gs_quit_app(server) != GS_OK)
+        _moonlight_log(ERR, "Can't quit %s\n", app);
+      quit_pending = false;
+
+      // The packet size found for the path holds for the next sessions
+      base.packetSize = config->stream.packetSize;
+      config->app = daemon_app;
+      free(app);
+    }
+  }
+
+  control_destroy();
+  free(pending_app);
+  xml_free_applist(daemon_apps);
 }
 
 static void help() {
@@ -191,7 +531,9 @@ static void help() {
   printf("\tunpair\t\t\tUnpair device with computer\n");
   printf("\tstream\t\t\tStream computer to device\n");
   printf("\tlist\t\t\tList available games and applications\n");
+  printf("\tdiscover\t\tList the servers found on the local network\n");
   printf("\tquit\t\t\tQuit the application or game being streamed\n");
+  printf("\tdaemon\t\t\tStay ready to stream on commands from a control socket\n");
   printf("\tmap\t\t\tCreate mapping for gamepad\n");
   printf("\thelp\t\t\tShow this help\n");
   printf("\n Global Options\n\n");
@@ -212,41 +554,46 @@ static void help() {
   printf("\t-delay <N>\t\tDelay playing A/V stream until N seconds passes (default 0)\n");
   #endif
   printf("\t-fps <fps>\t\tSpecify the fps to use (default -1)\n");
-  printf("\t-bitrate <bitrate>\tSpecify the bitrate in Kbps\n");
-  printf("\t-packetsize <size>\tSpecify the maximum packetsize in bytes\n");
+  printf("\t-bitrate <bitrate>\tSpecify the bitrate in Kbps (default from measured bandwidth)\n");
+  printf("\t-adaptive\t\tLower the bitrate and resolution while the stream is degraded\n");
+  printf("\t-headroom <percent>\tUse <percent> of the measured bandwidth, 0 to use a fixed bitrate (default 80)\n");
+  printf("\t-packetsize <size>\tSpecify the maximum packetsize in bytes (default from path MTU)\n");
   printf("\t-codec <codec>\t\tSelect used codec: auto/h264/h265 (default auto)\n");
   printf("\t-remote\t\t\tEnable remote optimizations\n");
   printf("\t-app <app>\t\tName of app to stream\n");
   printf("\t-nosops\t\t\tDon't allow GFE to modify game settings\n");
   printf("\t-localaudio\t\tPlay audio locally on the host computer\n");
   printf("\t-surround\t\tStream 5.1 surround sound (requires GFE 2.7)\n");
+  printf("\t-audiolatency <ms>\tHold audio latency at <ms>, or below it for SDL and PipeWire\n");
   printf("\t-keydir <directory>\tLoad encryption keys from directory\n");
   printf("\t-mapping <file>\t\tUse <file> as gamepad mappings configuration file\n");
   printf("\t-platform <system>\tSpecify system used for audio, video and input: pi/imx/aml/rk/x11/x11_vdpau/sdl/fake (default auto)\n");
   printf("\t-unsupported\t\tTry streaming if GFE version or options are unsupported\n");
   printf("\t-quitappafter\t\tSend quit app request to remote after quitting session\n");
   printf("\t-viewonly\t\tDisable all input processing (view-only mode)\n");
+  printf("\t-socket <path>\t\tControl socket of the daemon (default $XDG_RUNTIME_DIR/moonlight.sock)\n");
+  printf("\t-selecthost\t\tConnect to the idle host with the lowest latency, host can be a comma separated list\n");
   #if defined(HAVE_SDL) || defined(HAVE_X11)
   printf("\n WM options (SDL and X11 only)\n\n");
   printf("\t-windowed\t\tDisplay screen in a window\n");
+  printf("\t-avsync <ms>\t\tDelay or drop video frames to stay within <ms> of the audio\n");
   #endif
   #ifdef HAVE_EMBEDDED
   printf("\n I/O options (Not for SDL)\n\n");
   printf("\t-input <device>\t\tUse <device> as input. Can be used multiple times\n");
   printf("\t-audio <device>\t\tUse <device> as audio output device\n");
+  printf("\t-audiotune\t\tTune the ALSA buffer size for low latency, growing it on underruns\n");
+  printf("\t-audiohw\t\tOpen the ALSA device without the plug layer and use its native format\n");
+  printf("\t-audioquantum <frames>\tRequest a PipeWire quantum of <frames> samples (default 240)\n");
   #endif
   printf("\nUse Ctrl+Alt+Shift+Q or Play+Back+LeftShoulder+RightShoulder to exit streaming session\n\n");
   exit(0);
 }
 
-static void pair_check(PSERVER_DATA server) {
-  if (!server->paired) {
-    _moonlight_log(ERR, "You must pair with the PC first\n");
-    exit(-1);
-  }
-}
 
 int main(int argc, char* argv[]) {
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
   CONFIGURATION config;
   config_parse(argc, argv, &config);
 
@@ -268,6 +615,15 @@ int main(int argc, char* argv[]) {
     exit(0);
   }
 
+  if (strcmp("discover", config.action) == 0) {
+    discover();
+    exit(0);
+  }
+
+  if (config.select_host)
+    select_host(&config);
+
+  bool discovered = config.address == NULL;
   if (config.address == NULL) {
     config.address = malloc(MAX_ADDRESS_SIZE);
     if (config.address == NULL) {
@@ -277,7 +633,23 @@ int main(int argc, char* argv[]) {
     config.address[0] = 0;
     _moonlight_log(INFO, "Searching for server...\n");
     printf("Searching for server...\n");
-    gs_discover_server(config.address);
+
+    // The last host that worked is tried while mDNS runs, discovery only matters when it's gone
+    PDISCOVERY discovery = gs_discover_start(DISCOVER_TIMEOUT);
+    if (gs_discover_load_last(config.key_dir, config.address) == GS_OK && gs_discover_probe(config.address, PROBE_TIMEOUT) == GS_OK) {
+      if (config.debug_level > 0)
+        _moonlight_log(DEBUG, "Using last known server %s\n", config.address);
+    } else {
+      config.address[0] = 0;
+      for (PDISCOVERED_HOST host = gs_discover_wait(discovery); host != NULL; host = host->next) {
+        if (host->reachable) {
+          strcpy(config.address, host->address);
+          break;
+        }
+      }
+    }
+    gs_discover_free(discovery);
+
     if (config.address[0] == 0) {
       _moonlight_log(ERR, "Autodiscovery failed. Specify an IP address next time.\n");
       exit(-1);
@@ -293,8 +665,15 @@ int main(int argc, char* argv[]) {
   _moonlight_log(INFO, "Connect to %s...\n", config.address);
   printf("Connect to %s...\n", config.address);
 
+  // Streaming starts from the cached server data and app list when there is any
+  PAPP_LIST cached_apps = NULL;
   int ret;
-  if ((ret = gs_init(&server, config.address, config.key_dir, config.debug_level, config.unsupported)) == GS_OUT_OF_MEMORY) {
+  if (strcmp("stream", config.action) == 0)
+    ret = gs_init_cached(&server, config.address, config.key_dir, config.debug_level, config.unsupported, &cached_apps);
+  else
+    ret = gs_init(&server, config.address, config.key_dir, config.debug_level, config.unsupported);
+
+  if (ret == GS_OUT_OF_MEMORY) {
     _moonlight_log(ERR, "Not enough memory\n");
     exit(-1);
   } else if (ret == GS_ERROR) {
@@ -311,13 +690,17 @@ int main(int argc, char* argv[]) {
     exit(-1);
   }
 
+  if (discovered)
+    gs_discover_save_last(config.key_dir, config.address);
+
   if (config.debug_level > 0)
-    _moonlight_log(DEBUG, "NVIDIA %s, GFE %s (%s, %s)\n", server.gpuType, server.serverInfo.serverInfoGfeVersion, server.gsVersion, server.serverInfo.serverInfoAppVersion);
+    _moonlight_log(DEBUG, "NVIDIA %s, GFE %s (%s, %s)%s\n", server.gpuType, server.serverInfo.serverInfoGfeVersion, server.gsVersion, server.serverInfo.serverInfoAppVersion, cached_apps != NULL ? " from cache" : "");
 
   if (strcmp("list", config.action) == 0) {
     pair_check(&server);
     applist(&server);
-  } else if (strcmp("stream", config.action) == 0) {
+  } else if (strcmp("stream", config.action) == 0 || strcmp("daemon", config.action) == 0) {
+    bool daemon_mode = strcmp("daemon", config.action) == 0;
     pair_check(&server);
     enum platform system = platform_check(config.platform);
     if (config.debug_level > 0)
@@ -329,6 +712,9 @@ int main(int argc, char* argv[]) {
     } else if (system == SDL && config.audio_device != NULL) {
       _moonlight_log(ERR, "You can't select a audio device for SDL\n");
       exit(-1);
+    } else if (daemon_mode && system == SDL) {
+      _moonlight_log(ERR, "The daemon isn't supported with SDL\n");
+      exit(-1);
     }
     config.stream.supportsHevc = config.codec != CODEC_H264 && (config.codec == CODEC_HEVC || platform_supports_hevc(system));
 
@@ -386,7 +772,18 @@ int main(int argc, char* argv[]) {
       #endif
     }
 
-    stream(&server, &config, system);
+    if (daemon_mode)
+      serve(&server, &config, system);
+    else if (!stream(&server, &config, system, cached_apps))
+      exit(-1);
+
+    platform_release_audio();
+
+    if (IS_EMBEDDED(system) && !config.viewonly) {
+      udev_destroy();
+      evdev_destroy();
+    }
+    close_log();
   } else if (strcmp("pair", config.action) == 0) {
     char pin[5];
     sprintf(pin, "%d%d%d%d", (int)random() % 10, (int)random() % 10, (int)random() % 10, (int)random() % 10);
@@ -0,0 +1,116 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mtu.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROBE_ROUNDS 3
+#define PROBE_WAIT 30
+
+/* UDP probes with the don't fragment bit set, sized to the route MTU.
+ * Routers on the path answer too large probes with an ICMP fragmentation
+ * needed, which lowers the route MTU the kernel reports. An ICMP port
+ * unreachable from the host proves a probe of that size got through.
+ */
+static int probe_path_mtu(const char* address, bool* lowered, bool* confirmed) {
+  struct addrinfo hints = {0}, *res;
+  char port[8];
+  char probe[MAX_PACKET_SIZE + PACKET_OVERHEAD_IPV6] = {0};
+
+  hints.ai_socktype = SOCK_DGRAM;
+  snprintf(port, sizeof(port), "%d", MTU_PROBE_PORT);
+  if (getaddrinfo(address, port, &hints, &res) != 0)
+    return -1;
+
+  bool ipv6 = res->ai_family == AF_INET6;
+  int level = ipv6 ? IPPROTO_IPV6 : IPPROTO_IP;
+  int mtuOption = ipv6 ? IPV6_MTU : IP_MTU;
+  int discover = ipv6 ? IPV6_PMTUDISC_PROBE : IP_PMTUDISC_PROBE;
+  int headers = ipv6 ? 48 : 28;
+
+  int mtu = -1;
+  int fd = socket(res->ai_family, SOCK_DGRAM, 0);
+  if (fd < 0)
+    goto cleanup;
+
+  socklen_t len = sizeof(mtu);
+  if (setsockopt(fd, level, ipv6 ? IPV6_MTU_DISCOVER : IP_MTU_DISCOVER, &discover, sizeof(discover)) < 0 ||
+      connect(fd, res->ai_addr, res->ai_addrlen) < 0 ||
+      getsockopt(fd, level, mtuOption, &mtu, &len) < 0) {
+    mtu = -1;
+    goto cleanup;
+  }
+
+  // Nothing larger than the biggest packet size needs to fit
+  int maxMtu = MAX_PACKET_SIZE + (ipv6 ? PACKET_OVERHEAD_IPV6 : PACKET_OVERHEAD_IPV4);
+  if (mtu > maxMtu)
+    mtu = maxMtu;
+
+  for (int i = 0; i < PROBE_ROUNDS && !*confirmed; i++) {
+    send(fd, probe, mtu - headers, 0);
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, PROBE_WAIT) > 0 && recv(fd, probe, sizeof(probe), MSG_DONTWAIT) < 0 && errno == ECONNREFUSED)
+      *confirmed = true;
+
+    int routeMtu;
+    len = sizeof(routeMtu);
+    if (getsockopt(fd, level, mtuOption, &routeMtu, &len) == 0 && routeMtu < mtu) {
+      mtu = routeMtu;
+      *lowered = true;
+      *confirmed = false;
+    }
+  }
+
+  cleanup:
+  if (fd >= 0)
+    close(fd);
+
+  freeaddrinfo(res);
+  return mtu > 0 ? mtu - (ipv6 ? PACKET_OVERHEAD_IPV6 : PACKET_OVERHEAD_IPV4) : -1;
+}
+
+int mtu_packet_size(const char* address, const char** reason) {
+  bool lowered = false, confirmed = false;
+  int size = probe_path_mtu(address, &lowered, &confirmed);
+  if (size <= 0) {
+    *reason = "path MTU unknown";
+    return DEFAULT_PACKET_SIZE;
+  }
+
+  if (size >= MAX_PACKET_SIZE)
+    *reason = confirmed ? "largest supported, confirmed by host" : "largest supported";
+  else if (lowered)
+    *reason = confirmed ? "path MTU, confirmed by host" : "path MTU reported by router";
+  else
+    *reason = confirmed ? "interface MTU, confirmed by host" : "interface MTU";
+
+  // Whole AES blocks, like the fixed sizes other clients use
+  return size & ~15;
+}
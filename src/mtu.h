@@ -0,0 +1,30 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Between the UDP ports of the stream, which no host listens on, so probes never reach a live socket
+#define MTU_PROBE_PORT 48001
+
+// Headers around the packetSize payload: IP, UDP, RTP and the video packet header GFE adds
+#define PACKET_OVERHEAD_IPV4 108
+#define PACKET_OVERHEAD_IPV6 128
+
+#define MAX_PACKET_SIZE 1392
+#define DEFAULT_PACKET_SIZE 1024
+
+int mtu_packet_size(const char* address, const char** reason);
@@ -194,6 +194,10 @@ AUDIO_RENDERER_CALLBACKS* platform_get_audio(enum platform system, char* audio_d
       return (PAUDIO_RENDERER_CALLBACKS) dlsym(RTLD_DEFAULT, "audio_callbacks_omx");
   #endif
   default:
+    #ifdef HAVE_PIPEWIRE
+    if (audio_pipewire_init(audio_device))
+      return &audio_callbacks_pipewire;
+    #endif
     #ifdef HAVE_PULSE
     if (audio_pulse_init(audio_device))
       return &audio_callbacks_pulse;
@@ -205,6 +209,16 @@ AUDIO_RENDERER_CALLBACKS* platform_get_audio(enum platform system, char* audio_d
   return NULL;
 }
 
+// Closes the connection to the sound server, which platform_get_audio keeps for the next streams
+void platform_release_audio() {
+  #ifdef HAVE_PIPEWIRE
+  audio_pipewire_destroy();
+  #endif
+  #ifdef HAVE_PULSE
+  audio_pulse_destroy();
+  #endif
+}
+
 bool platform_supports_hevc(enum platform system) {
   switch (system) {
   case AML:
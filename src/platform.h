@@ -31,6 +31,7 @@ enum platform { NONE, SDL, X11, X11_VDPAU, X11_VAAPI, PI, MMAL, IMX, AML, RK, FA
 enum platform platform_check(char*);
 PDECODER_RENDERER_CALLBACKS platform_get_video(enum platform system);
 PAUDIO_RENDERER_CALLBACKS platform_get_audio(enum platform system, char* audio_device);
+void platform_release_audio();
 bool platform_supports_hevc(enum platform system);
 char* platform_name(enum platform system);
 
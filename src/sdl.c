@@ -20,9 +20,16 @@
 #ifdef HAVE_SDL
 
 #include "sdl.h"
+#include "sync.h"
 #include "input/sdl.h"
 
 #include <Limelight.h>
+#include <libavcodec/avcodec.h>
+
+#include <stdint.h>
+
+// Frames can't be held back for longer, the decoder only has SDL_BUFFER_FRAMES buffers
+#define SDL_SYNC_MAX_WAIT 16
 
 static bool done;
 static int fullscreen_flags;
@@ -35,10 +42,15 @@ SDL_mutex *mutex;
 
 int sdlCurrentFrame, sdlNextFrame;
 
+// Frame waiting for its time while the event loop keeps handling input
+static AVFrame* heldFrame;
+static SDL_TimerID heldTimer;
+static uintptr_t heldSequence;
+
 void sdl_init(int width, int height, bool fullscreen) {
   sdlCurrentFrame = sdlNextFrame = 0;
 
-  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS)) {
+  if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_TIMER)) {
     fprintf(stderr, "Could not initialize SDL - %s\n", SDL_GetError());
     exit(1);
   }
@@ -70,6 +82,39 @@ void sdl_init(int width, int height, bool fullscreen) {
   }
 }
 
+static void sdl_present(AVFrame* frame) {
+  if (SDL_LockMutex(mutex) == 0) {
+    Uint8** data = frame->data;
+    int* linesize = frame->linesize;
+    SDL_UpdateYUVTexture(bmp, NULL, data[0], linesize[0], data[1], linesize[1], data[2], linesize[2]);
+    SDL_UnlockMutex(mutex);
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, bmp, NULL, NULL);
+    SDL_RenderPresent(renderer);
+  } else
+    fprintf(stderr, "Couldn't lock mutex\n");
+}
+
+// Runs on the SDL timer thread, the frame is presented from the event loop
+static Uint32 sdl_present_timer(Uint32 interval, void* param) {
+  SDL_Event event;
+  event.type = SDL_USEREVENT;
+  event.user.code = SDL_CODE_PRESENT;
+  event.user.data1 = param;
+  SDL_PushEvent(&event);
+  return 0;
+}
+
+// Show the held frame, a newer frame doesn't wait for the timer of the previous one
+static void sdl_present_held() {
+  if (heldFrame == NULL)
+    return;
+
+  SDL_RemoveTimer(heldTimer);
+  sdl_present(heldFrame);
+  heldFrame = NULL;
+}
+
 void sdl_loop() {
   SDL_Event event;
   while(!done && SDL_WaitEvent(&event)) {
@@ -91,18 +136,26 @@ void sdl_loop() {
         done = true;
       else if (event.type == SDL_USEREVENT) {
         if (event.user.code == SDL_CODE_FRAME) {
+          AVFrame* frame = event.user.data1;
+          uint64_t wait;
+          int action;
+          sdl_present_held();
           if (++sdlCurrentFrame <= sdlNextFrame - SDL_BUFFER_FRAMES) {
             //Skip frame
-          } else if (SDL_LockMutex(mutex) == 0) {
-            Uint8** data = ((Uint8**) event.user.data1);
-            int* linesize = ((int*) event.user.data2);
-            SDL_UpdateYUVTexture(bmp, NULL, data[0], linesize[0], data[1], linesize[1], data[2], linesize[2]);
-            SDL_UnlockMutex(mutex);
-            SDL_RenderClear(renderer);
-            SDL_RenderCopy(renderer, bmp, NULL, NULL);
-            SDL_RenderPresent(renderer);
+          } else if ((action = sync_video_check(frame->pts > 0 ? frame->pts : 0, sdlCurrentFrame < sdlNextFrame, &wait)) == SYNC_DROP) {
+            //Too late compared to audio
+          } else if (action == SYNC_WAIT) {
+            Uint32 delay = wait / 1000 < SDL_SYNC_MAX_WAIT ? wait / 1000 : SDL_SYNC_MAX_WAIT;
+            heldFrame = frame;
+            heldTimer = SDL_AddTimer(delay > 0 ? delay : 1, sdl_present_timer, (void*) ++heldSequence);
+            if (heldTimer == 0)
+              sdl_present_held();
           } else
-            fprintf(stderr, "Couldn't lock mutex\n");
+            sdl_present(frame);
+        } else if (event.user.code == SDL_CODE_PRESENT) {
+          // A timer which fired before it was removed belongs to an earlier frame
+          if ((uintptr_t) event.user.data1 == heldSequence)
+            sdl_present_held();
         }
       }
     }
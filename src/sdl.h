@@ -30,6 +30,8 @@
 #define SDL_TOGGLE_FULLSCREEN 4
 
 #define SDL_CODE_FRAME 0
+#define SDL_CODE_RUMBLE 1
+#define SDL_CODE_PRESENT 2
 
 #define SDL_BUFFER_FRAMES 2
 
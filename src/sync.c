@@ -0,0 +1,124 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sync.h"
+#include "logging.h"
+
+#include "audio/audio.h"
+
+#include <time.h>
+#include <stdlib.h>
+
+// Lets the clock offset follow drift between host and client, 2 us per frame (120 ppm at 60 fps)
+#define OFFSET_DRIFT_US 2
+
+/* Audio is the master clock. Audio and video captured at the same moment
+ * arrive at about the same time, and that audio is heard once it has gone
+ * through the output latency. A video frame is therefore due at its arrival
+ * time plus the audio latency at the moment it is shown.
+ *
+ * The host timestamps are mapped to the local clock with the smallest
+ * offset seen, which belongs to the frame with the least network delay.
+ *
+ * The latency is the one the audio pipeline measured for the audio being
+ * played, from its arrival and the delay the device reports. Backends which
+ * can't report a delay only give the queued audio as an estimate.
+ */
+
+static uint64_t maxSkewUs;
+static bool offsetValid;
+static int64_t offsetUs;
+
+static uint32_t framesChecked, framesDropped, framesEstimated;
+static int64_t skewSumUs, skewMaxUs;
+
+void sync_init(int maxSkewMs) {
+  maxSkewUs = maxSkewMs > 0 ? maxSkewMs * 1000 : 0;
+  offsetValid = false;
+  framesChecked = framesDropped = framesEstimated = 0;
+  skewSumUs = skewMaxUs = 0;
+}
+
+bool sync_enabled() {
+  return maxSkewUs > 0;
+}
+
+uint64_t sync_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Called from the decoder thread when a frame arrives, returns its arrival time without network jitter
+uint64_t sync_video_time(int presentationTimeMs) {
+  if (!sync_enabled())
+    return 0;
+
+  int64_t offset = (int64_t) sync_now() - (int64_t) presentationTimeMs * 1000;
+  if (!offsetValid || offset < offsetUs + OFFSET_DRIFT_US) {
+    offsetUs = offset;
+    offsetValid = true;
+  } else
+    offsetUs += OFFSET_DRIFT_US;
+
+  return (int64_t) presentationTimeMs * 1000 + offsetUs;
+}
+
+/* Called from the presenter right before a frame would be shown. A late
+ * frame is only dropped in favour of a newer one, when video can't keep up
+ * with audio at all showing something late still beats showing nothing.
+ */
+int sync_video_check(uint64_t time, bool newerFrame, uint64_t* waitUs) {
+  if (!sync_enabled() || time == 0)
+    return SYNC_PRESENT;
+
+  AUDIO_PIPELINE_STATS stats;
+  audio_pipeline_get_stats(&stats);
+  bool measured = stats.playedLatencyMs > 0;
+  double latencyMs = measured ? stats.playedLatencyMs : stats.latencyMs;
+
+  int64_t skew = (int64_t) sync_now() - (int64_t) time - (int64_t) (latencyMs * 1000);
+  if (skew < -(int64_t) maxSkewUs) {
+    *waitUs = -skew;
+    return SYNC_WAIT;
+  }
+
+  framesChecked++;
+  if (!measured)
+    framesEstimated++;
+  skewSumUs += llabs(skew);
+  if (llabs(skew) > skewMaxUs)
+    skewMaxUs = llabs(skew);
+
+  if (skew > (int64_t) maxSkewUs && newerFrame) {
+    framesDropped++;
+    return SYNC_DROP;
+  }
+
+  return SYNC_PRESENT;
+}
+
+void sync_report() {
+  if (!sync_enabled() || framesChecked == 0)
+    return;
+
+  _moonlight_log(INFO, "A/V sync: frames shown %.1f ms from the played audio on average, %.1f ms at most, %u of %u frames dropped\n", (double) skewSumUs / framesChecked / 1000, (double) skewMaxUs / 1000, framesDropped, framesChecked);
+  if (framesEstimated > 0)
+    _moonlight_log(INFO, "A/V sync: %u frames compared with the queued audio only, the device didn't report its delay\n", framesEstimated);
+}
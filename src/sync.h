@@ -0,0 +1,32 @@
+/*
+ * This file is part of Moonlight Embedded.
+ *
+ * Copyright (C) 2017 Iwan Timmer
+ *
+ * Moonlight is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Moonlight is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Moonlight; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SYNC_PRESENT 0
+#define SYNC_WAIT 1
+#define SYNC_DROP 2
+
+void sync_init(int maxSkewMs);
+bool sync_enabled();
+uint64_t sync_now();
+uint64_t sync_video_time(int presentationTimeMs);
+int sync_video_check(uint64_t time, bool newerFrame, uint64_t* waitUs);
+void sync_report();
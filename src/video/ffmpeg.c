@@ -158,11 +158,13 @@ AVFrame* ffmpeg_get_frame(bool native_frame) {
 
 // packets must be decoded in order
 // indata must be inlen + AV_INPUT_BUFFER_PADDING_SIZE in length
-int ffmpeg_decode(unsigned char* indata, int inlen) {
+// pts comes out with the frame decoded from the packet, however late the decoder returns it
+int ffmpeg_decode(unsigned char* indata, int inlen, int64_t pts) {
   int err;
 
   pkt.data = indata;
   pkt.size = inlen;
+  pkt.pts = pts;
 
   err = avcodec_send_packet(decoder_ctx, &pkt);
   if (err < 0) {
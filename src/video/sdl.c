@@ -21,6 +21,7 @@
 #include "ffmpeg.h"
 
 #include "../sdl.h"
+#include "../sync.h"
 
 #include <SDL.h>
 #include <SDL_thread.h>
@@ -63,7 +64,7 @@ static int sdl_submit_decode_unit(PDECODE_UNIT decodeUnit) {
       length += entry->length;
       entry = entry->next;
     }
-    ffmpeg_decode(ffmpeg_buffer, length);
+    ffmpeg_decode(ffmpeg_buffer, length, sync_video_time(decodeUnit->presentationTimeMs));
 
     if (SDL_LockMutex(mutex) == 0) {
       AVFrame* frame = ffmpeg_get_frame(false);
@@ -73,8 +74,7 @@ static int sdl_submit_decode_unit(PDECODE_UNIT decodeUnit) {
         SDL_Event event;
         event.type = SDL_USEREVENT;
         event.user.code = SDL_CODE_FRAME;
-        event.user.data1 = &frame->data;
-        event.user.data2 = &frame->linesize;
+        event.user.data1 = frame;
         SDL_PushEvent(&event);
       }
 
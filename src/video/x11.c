@@ -26,6 +26,7 @@
 
 #include "../input/x11.h"
 #include "../loop.h"
+#include "../sync.h"
 
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
@@ -36,32 +37,84 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/timerfd.h>
 
 #define DECODER_BUFFER_SIZE 92*1024
 #define X11_VDPAU_ACCELERATION ENABLE_HARDWARE_ACCELERATION_1
 #define X11_VAAPI_ACCELERATION ENABLE_HARDWARE_ACCELERATION_2
 
+// Decoded frames held back while video is ahead of audio
+#define SYNC_QUEUE_FRAMES 8
+
 static char* ffmpeg_buffer = NULL;
 
 static Display *display = NULL;
 static Window window;
 
-static int pipefd[2];
+static int pipefd[2] = {-1, -1};
 
 static int display_width;
 static int display_height;
 
+static AVFrame* frameQueue[SYNC_QUEUE_FRAMES];
+static int queueHead, queueCount;
+static int timerfd = -1;
+
+static void x11_present(AVFrame* frame) {
+  if (ffmpeg_decoder == SOFTWARE)
+    egl_draw(frame->data);
+  #ifdef HAVE_VAAPI
+  else if (ffmpeg_decoder == VAAPI)
+    vaapi_queue(frame, window, display_width, display_height);
+  #endif
+}
+
+// Show queued frames which are due, and wake up again when the next one will be
+static void x11_present_queue() {
+  while (queueCount > 0) {
+    AVFrame* frame = frameQueue[queueHead];
+    uint64_t wait;
+    int action = sync_video_check(frame->pts > 0 ? frame->pts : 0, queueCount > 1, &wait);
+    if (action == SYNC_WAIT) {
+      struct itimerspec timer = { .it_value = { .tv_sec = wait / 1000000, .tv_nsec = (wait % 1000000) * 1000 } };
+      timerfd_settime(timerfd, 0, &timer, NULL);
+      return;
+    }
+
+    queueHead = (queueHead + 1) % SYNC_QUEUE_FRAMES;
+    queueCount--;
+    if (action == SYNC_PRESENT)
+      x11_present(frame);
+  }
+}
+
+static int timer_handle(int fd) {
+  uint64_t expirations;
+  read(fd, &expirations, sizeof(expirations));
+  x11_present_queue();
+  return LOOP_OK;
+}
+
 static int frame_handle(int pipefd) {
   AVFrame* frame = NULL;
-  while (read(pipefd, &frame, sizeof(void*)) > 0);
-  if (frame) {
-    if (ffmpeg_decoder == SOFTWARE)
-      egl_draw(frame->data);
-    #ifdef HAVE_VAAPI
-    else if (ffmpeg_decoder == VAAPI)
-      vaapi_queue(frame, window, display_width, display_height);
-    #endif
+  if (!sync_enabled()) {
+    while (read(pipefd, &frame, sizeof(void*)) > 0);
+    if (frame)
+      x11_present(frame);
+
+    return LOOP_OK;
+  }
+
+  while (read(pipefd, &frame, sizeof(void*)) > 0) {
+    // The decoder reuses its buffers, so the oldest frame has to go once the queue is full
+    if (queueCount == SYNC_QUEUE_FRAMES) {
+      queueHead = (queueHead + 1) % SYNC_QUEUE_FRAMES;
+      queueCount--;
+    }
+    frameQueue[(queueHead + queueCount) % SYNC_QUEUE_FRAMES] = frame;
+    queueCount++;
   }
+  x11_present_queue();
 
   return LOOP_OK;
 }
@@ -102,7 +155,8 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
   }
 
   Window root = DefaultRootWindow(display);
-  XSetWindowAttributes winattr = { .event_mask = PointerMotionMask | ButtonPressMask | ButtonReleaseMask | KeyPressMask | KeyReleaseMask };
+  // Input events are selected by the input module on its own connection
+  XSetWindowAttributes winattr = { .event_mask = NoEventMask };
   window = XCreateWindow(display, root, 0, 0, display_width, display_height, 0, CopyFromParent, InputOutput, CopyFromParent, CWEventMask, &winattr);
   XMapWindow(display, window);
   XStoreName(display, window, "Moonlight");
@@ -130,7 +184,9 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
   else if (drFlags & X11_VAAPI_ACCELERATION)
     avc_flags |= VAAPI_ACCELERATION;
 
-  if (ffmpeg_init(videoFormat, width, height, avc_flags, 2, 2) < 0) {
+  // Frames waiting in the sync queue must not be overwritten by the decoder
+  int buffer_count = sync_enabled() ? SYNC_QUEUE_FRAMES + 2 : 2;
+  if (ffmpeg_init(videoFormat, width, height, avc_flags, buffer_count, 2) < 0) {
     fprintf(stderr, "Couldn't initialize video decoding\n");
     return -1;
   }
@@ -145,6 +201,16 @@ int x11_setup(int videoFormat, int width, int height, int redrawRate, void* cont
   loop_add_fd(pipefd[0], &frame_handle, POLLIN);
   fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
 
+  if (sync_enabled()) {
+    queueHead = queueCount = 0;
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd == -1) {
+      fprintf(stderr, "Can't create timer for A/V sync\n");
+      return -2;
+    }
+    loop_add_fd(timerfd, &timer_handle, POLLIN);
+  }
+
   x11_input_init(display, window);
 
   return 0;
@@ -159,8 +225,32 @@ int x11_setup_vaapi(int videoFormat, int width, int height, int redrawRate, void
 }
 
 void x11_cleanup() {
+  // Every restart and daemon session sets up a new timer and queue
+  if (timerfd >= 0) {
+    loop_remove_fd(timerfd);
+    close(timerfd);
+    timerfd = -1;
+  }
+  queueHead = queueCount = 0;
+
+  if (pipefd[0] >= 0) {
+    loop_remove_fd(pipefd[0]);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+  }
+
+  x11_input_destroy();
   ffmpeg_destroy();
   egl_destroy();
+
+  free(ffmpeg_buffer);
+  ffmpeg_buffer = NULL;
+
+  if (display != NULL) {
+    XDestroyWindow(display, window);
+    XFlush(display);
+  }
 }
 
 int x11_submit_decode_unit(PDECODE_UNIT decodeUnit) {
@@ -172,7 +262,7 @@ int x11_submit_decode_unit(PDECODE_UNIT decodeUnit) {
       length += entry->length;
       entry = entry->next;
     }
-    ffmpeg_decode(ffmpeg_buffer, length);
+    ffmpeg_decode(ffmpeg_buffer, length, sync_video_time(decodeUnit->presentationTimeMs));
     AVFrame* frame = ffmpeg_get_frame(true);
     if (frame != NULL)
       write(pipefd[1], &frame, sizeof(void*));